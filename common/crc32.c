@@ -0,0 +1,309 @@
+/*
+ * CRC32/MPEG-2, as used by PSI / SI sections
+ *
+ * polynomial 0x04c11db7, not bit reflected, initial value 0xffffffff,
+ * no final xor. A section including its CRC_32 field thus has a CRC of 0.
+ *
+ * Several implementations, the fastest one usable on the CPU is selected
+ * at runtime:
+ *  - "byte":   the classic table driven one, one byte per step
+ *  - "slice8": slicing-by-8, eight bytes per step, works everywhere
+ *  - "pclmul": x86_64 carry-less multiplication, folding 64 bytes per step
+ *  - "armv8":  the ARMv8 CRC32 instructions
+ *
+ * License: GPLv2 or later
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "lt_debug.h"
+
+#define lt_debug_c(args...) _lt_debug(HAL_DEBUG_DEMUX, NULL, args)
+#define lt_info_c(args...) _lt_info(HAL_DEBUG_DEMUX, NULL, args)
+
+#define CRC32_POLY 0x04c11db7
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_CRC32_PCLMUL 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__GNUC__)
+#define HAVE_CRC32_ARMV8 1
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#elif defined(__arm__) && defined(__ARM_FEATURE_CRC32)
+/* 32bit ARM: only if the compiler was told that the CPU has it */
+#define HAVE_CRC32_ARMV8 1
+#include <arm_acle.h>
+#endif
+
+static uint32_t crc_table[8][256];
+
+static uint32_t crc32_byte(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len--)
+		crc = (crc << 8) ^ crc_table[0][(crc >> 24) ^ *p++];
+	return crc;
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len >= 8) {
+		uint32_t a = crc ^ ((p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+		uint32_t b = (p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+		crc = crc_table[7][a >> 24] ^ crc_table[6][(a >> 16) & 0xff] ^
+		      crc_table[5][(a >> 8) & 0xff] ^ crc_table[4][a & 0xff] ^
+		      crc_table[3][b >> 24] ^ crc_table[2][(b >> 16) & 0xff] ^
+		      crc_table[1][(b >> 8) & 0xff] ^ crc_table[0][b & 0xff];
+		p += 8;
+		len -= 8;
+	}
+	return crc32_byte(crc, p, len);
+}
+
+#ifdef HAVE_CRC32_PCLMUL
+/* x^n mod P and floor(x^64 / P), calculated in crc32_init() */
+static uint64_t k_576, k_512, k_192, k_128, k_96, k_64, k_mu;
+
+static uint64_t xpow_mod(int n)
+{
+	uint32_t r = 1;
+	while (n--)
+		r = (r << 1) ^ ((r & 0x80000000) ? CRC32_POLY : 0);
+	return r;
+}
+
+/* floor(x^64 / P), for the Barrett reduction */
+static uint64_t x64_div_p(void)
+{
+	unsigned __int128 d = (unsigned __int128)1 << 64;
+	uint64_t q = 0;
+	int i;
+	for (i = 64; i >= 32; i--) {
+		if ((uint64_t)(d >> i) & 1) {
+			q |= 1ULL << (i - 32);
+			d ^= (unsigned __int128)(0x100000000ULL | CRC32_POLY) << (i - 32);
+		}
+	}
+	return q;
+}
+
+/* fold the 128 bit value x forward by the distance k was made for */
+__attribute__((target("pclmul,sse2")))
+static inline __m128i fold(__m128i x, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11),
+			     _mm_clmulepi64_si128(x, k, 0x00));
+}
+
+/* see Intel's "Fast CRC Computation for Generic Polynomials Using
+ * PCLMULQDQ Instruction". The data is kept in big endian order, so
+ * that the 128 bit registers are the polynomials of the data. */
+__attribute__((target("pclmul,ssse3,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *p, size_t len)
+{
+	if (len < 64)
+		return crc32_slice8(crc, p, len);
+
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i k4 = _mm_set_epi64x(k_576, k_512);
+	const __m128i k1 = _mm_set_epi64x(k_192, k_128);
+#define LOAD(i) _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * (i))), bswap)
+	__m128i x0 = _mm_xor_si128(LOAD(0), _mm_set_epi32(crc, 0, 0, 0));
+	__m128i x1 = LOAD(1);
+	__m128i x2 = LOAD(2);
+	__m128i x3 = LOAD(3);
+	p += 64;
+	len -= 64;
+	while (len >= 64) {
+		x0 = _mm_xor_si128(fold(x0, k4), LOAD(0));
+		x1 = _mm_xor_si128(fold(x1, k4), LOAD(1));
+		x2 = _mm_xor_si128(fold(x2, k4), LOAD(2));
+		x3 = _mm_xor_si128(fold(x3, k4), LOAD(3));
+		p += 64;
+		len -= 64;
+	}
+	__m128i x = _mm_xor_si128(fold(x0, k1), x1);
+	x = _mm_xor_si128(fold(x, k1), x2);
+	x = _mm_xor_si128(fold(x, k1), x3);
+	while (len >= 16) {
+		x = _mm_xor_si128(fold(x, k1), LOAD(0));
+		p += 16;
+		len -= 16;
+	}
+#undef LOAD
+	/* crc = x * x^32 mod P. 128 => 96 bits: hi * (x^96 mod P) + lo * x^32 */
+	__m128i t = _mm_clmulepi64_si128(x, _mm_cvtsi64_si128(k_96), 0x01);
+	t = _mm_xor_si128(t, _mm_slli_si128(_mm_move_epi64(x), 4));
+	/* 96 => 64 bits: hi * (x^64 mod P) + lo */
+	__m128i u = _mm_clmulepi64_si128(_mm_srli_si128(t, 8), _mm_cvtsi64_si128(k_64), 0x00);
+	u = _mm_xor_si128(u, _mm_move_epi64(t));
+	/* Barrett reduction 64 => 32 bits: q = (u / x^32) * mu / x^32, crc = u - q * P */
+	__m128i q = _mm_clmulepi64_si128(_mm_srli_epi64(u, 32), _mm_cvtsi64_si128(k_mu), 0x00);
+	q = _mm_srli_epi64(q, 32);
+	u = _mm_xor_si128(u, _mm_clmulepi64_si128(q, _mm_cvtsi64_si128(0x100000000ULL | CRC32_POLY), 0x00));
+	crc = _mm_cvtsi128_si32(u);
+
+	return crc32_slice8(crc, p, len);
+}
+
+static int have_pclmul(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+#ifdef HAVE_CRC32_ARMV8
+/* the CRC32 instructions calculate the bit reflected CRC-32 with the same
+ * polynomial. Feeding them bit reversed bytes and bit reversing the CRC
+ * register before and after gives the unreflected CRC. */
+#ifdef __aarch64__
+static inline uint32_t rbit32(uint32_t v)
+{
+	__asm__("rbit %w0, %w1" : "=r"(v) : "r"(v));
+	return v;
+}
+
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *p, size_t len)
+{
+	crc = rbit32(crc);
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+#ifndef __AARCH64EB__
+		v = __builtin_bswap64(v);
+#endif
+		/* now reverse all 64 bits => every byte is bit reversed */
+		__asm__("rbit %x0, %x0\n\t"
+			".arch_extension crc\n\t"
+			"crc32x %w1, %w1, %x0" : "+r"(v), "+r"(crc));
+		p += 8;
+		len -= 8;
+	}
+	while (len--) {
+		uint32_t b = rbit32(*p++) >> 24;
+		__asm__(".arch_extension crc\n\t"
+			"crc32b %w0, %w0, %w1" : "+r"(crc) : "r"(b));
+	}
+	return rbit32(crc);
+}
+
+static int have_armv8(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+}
+#else
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *p, size_t len)
+{
+	crc = __rbit(crc);
+	while (len >= 4) {
+		uint32_t v;
+		memcpy(&v, p, 4);
+#ifndef __ARMEB__
+		v = __rev(v);
+#endif
+		crc = __crc32w(crc, __rbit(v));
+		p += 4;
+		len -= 4;
+	}
+	while (len--)
+		crc = __crc32b(crc, __rbit(*p++) >> 24);
+	return __rbit(crc);
+}
+
+static int have_armv8(void)
+{
+	return 1; /* the compiler already uses it */
+}
+#endif
+#endif
+
+static struct dvb_crc32_impl impls[4];
+static int num_impls;
+static dvb_crc32_fn crc_fn;
+static const char *crc_name;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void)
+{
+	int i, j;
+	for (i = 0; i < 256; i++) {
+		uint32_t c = i << 24;
+		for (j = 0; j < 8; j++)
+			c = (c << 1) ^ ((c & 0x80000000) ? CRC32_POLY : 0);
+		crc_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc_table[j][i] = (crc_table[j - 1][i] << 8) ^ crc_table[0][crc_table[j - 1][i] >> 24];
+
+	impls[num_impls].name = "byte";
+	impls[num_impls++].fn = crc32_byte;
+	impls[num_impls].name = "slice8";
+	impls[num_impls++].fn = crc32_slice8;
+#ifdef HAVE_CRC32_PCLMUL
+	if (have_pclmul()) {
+		k_576 = xpow_mod(576);
+		k_512 = xpow_mod(512);
+		k_192 = xpow_mod(192);
+		k_128 = xpow_mod(128);
+		k_96 = xpow_mod(96);
+		k_64 = xpow_mod(64);
+		k_mu = x64_div_p();
+		impls[num_impls].name = "pclmul";
+		impls[num_impls++].fn = crc32_pclmul;
+	}
+#endif
+#ifdef HAVE_CRC32_ARMV8
+	if (have_armv8()) {
+		impls[num_impls].name = "armv8";
+		impls[num_impls++].fn = crc32_armv8;
+	}
+#endif
+	/* the last one is the fastest */
+	crc_fn = impls[num_impls - 1].fn;
+	crc_name = impls[num_impls - 1].name;
+	const char *force = getenv("HAL_CRC32");
+	if (force) {
+		for (i = 0; i < num_impls; i++) {
+			if (!strcmp(force, impls[i].name)) {
+				crc_fn = impls[i].fn;
+				crc_name = impls[i].name;
+				break;
+			}
+		}
+		if (i == num_impls)
+			lt_info_c("%s: HAL_CRC32=%s not available\n", __func__, force);
+	}
+	lt_debug_c("%s: using %s\n", __func__, crc_name);
+}
+
+uint32_t dvb_crc32_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+	pthread_once(&crc_once, crc32_init);
+	return crc_fn(crc, data, len);
+}
+
+uint32_t dvb_crc32(const uint8_t *data, size_t len)
+{
+	return dvb_crc32_update(0xffffffff, data, len);
+}
+
+int dvb_crc32_impls(const struct dvb_crc32_impl **list)
+{
+	pthread_once(&crc_once, crc32_init);
+	*list = impls;
+	return num_impls;
+}
+
+const char *dvb_crc32_name(void)
+{
+	pthread_once(&crc_once, crc32_init);
+	return crc_name;
+}
@@ -0,0 +1,30 @@
+/*
+ * CRC32/MPEG-2, as used by PSI / SI sections
+ *
+ * License: GPLv2 or later
+ */
+#ifndef __CRC32_H__
+#define __CRC32_H__
+#include <inttypes.h>
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* CRC of a complete section, 0 if the CRC_32 at its end is correct */
+uint32_t dvb_crc32(const uint8_t *data, size_t len);
+/* continue a CRC, start with crc = 0xffffffff */
+uint32_t dvb_crc32_update(uint32_t crc, const uint8_t *data, size_t len);
+
+/* the implementations usable on this CPU, for testing and benchmarking.
+ * The fastest one is used by dvb_crc32() unless HAL_CRC32=<name> is set. */
+typedef uint32_t (*dvb_crc32_fn)(uint32_t crc, const uint8_t *data, size_t len);
+struct dvb_crc32_impl {
+	const char *name;
+	dvb_crc32_fn fn;
+};
+int dvb_crc32_impls(const struct dvb_crc32_impl **list);
+const char *dvb_crc32_name(void);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,181 @@
+/*
+ * adaptive size of the kernel demux buffers
+ *
+ * The driver frees the buffer contents on DMX_SET_BUFFER_SIZE and only
+ * allows it while the filter is stopped. After an overflow the data are
+ * lost anyway, so the buffer grows right away. Everything else (growing
+ * because the reader lags behind, shrinking an idle buffer) waits until
+ * the filter is restarted for other reasons, e.g. on the next zap.
+ *
+ * License: GPLv2 or later
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include <cstdlib>
+
+#include <config.h>
+#if !HAVE_TRIPLEDRAGON
+#include <linux/dvb/dmx.h>
+
+#include "dmx_bufsize.h"
+#include "lt_debug.h"
+#include "hal_time.h"
+
+#define lt_debug(args...) _lt_debug(HAL_DEBUG_DEMUX, this, args)
+#define lt_info(args...) _lt_info(HAL_DEBUG_DEMUX, this, args)
+#define lt_info_c(args...) _lt_info(HAL_DEBUG_DEMUX, NULL, args)
+
+/* what dmxdev uses if nobody calls DMX_SET_BUFFER_SIZE */
+#define DRIVER_DEFAULT (8 * 1024)
+/* the usage of the buffer is judged over this period */
+#define WINDOW_MS 10000
+/* no shrinking for that long after an overflow */
+#define IDLE_MS 60000
+
+static pthread_mutex_t conf_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool conf_checked = false;
+static int conf_min = 0;
+static int conf_max = 0;
+
+DmxBufSize *DmxBufSize::create(int size)
+{
+	pthread_mutex_lock(&conf_lock);
+	if (!conf_checked) {
+		conf_checked = true;
+		const char *conf = getenv("HAL_DMX_BUFSIZE");
+		int mn, mx;
+		if (conf && sscanf(conf, "%d:%d", &mn, &mx) == 2 && mn > 0 && mx >= mn) {
+			conf_min = mn * 1024;
+			conf_max = mx * 1024;
+			lt_info_c("%s: demux buffers between %d and %d kB\n", __func__, mn, mx);
+		} else if (conf)
+			lt_info_c("%s: HAL_DMX_BUFSIZE=%s is not <min>:<max>\n", __func__, conf);
+	}
+	pthread_mutex_unlock(&conf_lock);
+	if (conf_max == 0)
+		return NULL;
+	return new DmxBufSize(size, conf_min, conf_max);
+}
+
+DmxBufSize::DmxBufSize(int size, int _min, int _max)
+{
+	min = _min;
+	max = _max;
+	/* the default is left alone, lots of small PSI filters would
+	 * otherwise all get the minimum size */
+	cur = size;
+	if (cur > max)
+		cur = max;
+	else if (cur > 0 && cur < min)
+		cur = min;
+	fd = -1;
+	pending = 0;
+	running = false;
+	peak = 0;
+	lag = false;
+	window_start = now_ms();
+	last_overflow = 0;
+	pthread_mutex_init(&lock, NULL);
+}
+
+DmxBufSize::~DmxBufSize()
+{
+	pthread_mutex_destroy(&lock);
+}
+
+int DmxBufSize::getSize(void)
+{
+	pthread_mutex_lock(&lock);
+	int ret = cur;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+void DmxBufSize::setFd(int _fd)
+{
+	pthread_mutex_lock(&lock);
+	if (fd != _fd)
+		running = false;
+	fd = _fd;
+	pthread_mutex_unlock(&lock);
+}
+
+/* call with lock held and the filter stopped */
+bool DmxBufSize::resize(int size)
+{
+	if (ioctl(fd, DMX_SET_BUFFER_SIZE, size) < 0) {
+		lt_info("%s: fd %d DMX_SET_BUFFER_SIZE %d: %m\n", __func__, fd, size);
+		return false;
+	}
+	lt_debug("%s: fd %d %d -> %d kB\n", __func__, fd, (cur ? cur : DRIVER_DEFAULT) / 1024, size / 1024);
+	cur = size;
+	return true;
+}
+
+void DmxBufSize::start(void)
+{
+	pthread_mutex_lock(&lock);
+	if (pending) {
+		ioctl(fd, DMX_STOP);
+		resize(pending);
+		pending = 0;
+	}
+	ioctl(fd, DMX_START);
+	running = true;
+	pthread_mutex_unlock(&lock);
+}
+
+void DmxBufSize::stop(void)
+{
+	pthread_mutex_lock(&lock);
+	running = false;
+	ioctl(fd, DMX_STOP);
+	pthread_mutex_unlock(&lock);
+}
+
+void DmxBufSize::event(int len, int want)
+{
+	int err = errno;
+	int64_t now = now_ms();
+	pthread_mutex_lock(&lock);
+	int size = cur ? cur : DRIVER_DEFAULT;
+	if (len == -EOVERFLOW) {
+		last_overflow = now;
+		int n = (size * 2 < max) ? size * 2 : max;
+		if (running && n > size) {
+			/* the buffer was flushed anyway, nothing more is lost */
+			lt_info("%s: fd %d overflow, buffer %d -> %d kB\n", __func__, fd, size / 1024, n / 1024);
+			ioctl(fd, DMX_STOP);
+			resize(n);
+			ioctl(fd, DMX_START);
+			pending = 0;
+			peak = 0;
+			lag = false;
+			window_start = now;
+		}
+	} else if (len > 0) {
+		if (len > peak)
+			peak = len;
+		if (want > 0 && len >= want)
+			lag = true;
+	}
+	if (now - window_start >= WINDOW_MS) {
+		pending = 0;
+		if (peak >= size * 3 / 4 && size < max)
+			pending = (size * 2 < max) ? size * 2 : max;
+		else if (!lag && peak < size / 4 && size > min && now - last_overflow >= IDLE_MS)
+			pending = (size / 2 > min) ? size / 2 : min;
+		if (pending)
+			lt_debug("%s: fd %d peak %d of %d kB, resize to %d kB on restart\n", __func__,
+				fd, peak / 1024, size / 1024, pending / 1024);
+		peak = 0;
+		lag = false;
+		window_start = now;
+	}
+	pthread_mutex_unlock(&lock);
+	errno = err;
+}
+#endif
@@ -0,0 +1,54 @@
+/*
+ * adaptive size of the kernel demux buffers
+ *
+ * The buffer sizes cDemux::Open() uses are a guess: too small for a HD
+ * recording on a busy box, megabytes too big for a radio service.
+ * With HAL_DMX_BUFSIZE=<min>:<max> (in kB), the buffer of every kernel
+ * filter grows (up to max) when the demux reports an overflow and
+ * shrinks again (down to min) if it stays mostly unused.
+ *
+ * License: GPLv2 or later
+ */
+#ifndef __DMX_BUFSIZE_H__
+#define __DMX_BUFSIZE_H__
+
+#include <inttypes.h>
+#include <pthread.h>
+
+class DmxBufSize
+{
+public:
+	/* NULL if not enabled. size is what the caller asked for,
+	 * 0 for the driver's default */
+	static DmxBufSize *create(int size);
+	~DmxBufSize();
+	/* the size for DMX_SET_BUFFER_SIZE after opening the fd, 0 == default */
+	int getSize(void);
+	void setFd(int fd);
+	/* use these instead of ioctl(DMX_START / DMX_STOP), so that the
+	 * buffer is never resized behind the back of the caller. start()
+	 * also applies a resize that was decided while the filter ran */
+	void start(void);
+	void stop(void);
+	/* the result of a read() from the demux fd which asked for "want"
+	 * bytes (0 == unknown): the number of bytes or -errno.
+	 * Called in the reader's context, might resize the buffer. */
+	void event(int len, int want = 0);
+private:
+	DmxBufSize(int size, int min, int max);
+	int fd;
+	int cur;		/* 0 == the driver's default */
+	int min;
+	int max;
+	int pending;		/* apply on the next start() */
+	bool running;
+	int peak;		/* largest read in the current window */
+	bool lag;		/* a read filled the whole buffer of the reader */
+	int64_t window_start;
+	int64_t last_overflow;
+	pthread_mutex_t lock;
+
+	bool resize(int size);
+};
+
+#endif
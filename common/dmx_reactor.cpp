@@ -0,0 +1,252 @@
+/*
+ * one epoll thread for all demux file descriptors
+ *
+ * License: GPLv2 or later
+ */
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <cstdlib>
+#include <vector>
+
+#include "dmx_reactor.h"
+#include "lt_debug.h"
+#include "hal_time.h"
+
+#define lt_debug(args...) _lt_debug(HAL_DEBUG_DEMUX, this, args)
+#define lt_info(args...) _lt_info(HAL_DEBUG_DEMUX, this, args)
+#define lt_info_c(args...) _lt_info(HAL_DEBUG_DEMUX, NULL, args)
+
+#define MAX_EVENTS 32
+
+static pthread_mutex_t reactor_lock = PTHREAD_MUTEX_INITIALIZER;
+static DmxReactor *reactor = NULL;
+static bool reactor_checked = false;
+
+DmxReactor *DmxReactor::get(void)
+{
+	pthread_mutex_lock(&reactor_lock);
+	if (!reactor_checked) {
+		reactor_checked = true;
+		if (getenv("HAL_DMX_REACTOR")) {
+			reactor = new DmxReactor();
+			if (reactor->epfd < 0 || pthread_create(&reactor->thread, NULL, run_thread, reactor)) {
+				lt_info_c("%s: cannot start the demux reactor (%m)\n", __func__);
+				/* leaked, but this only happens once */
+				reactor = NULL;
+			}
+		}
+	}
+	pthread_mutex_unlock(&reactor_lock);
+	return reactor;
+}
+
+DmxReactor::DmxReactor()
+{
+	next_id = 1;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	wakefd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0; /* id 0 == wakeup */
+	if (epfd > -1 && epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) < 0) {
+		close(epfd);
+		epfd = -1;
+	}
+}
+
+/* call with lock held */
+void DmxReactor::wakeup(void)
+{
+	uint64_t one = 1;
+	if (write(wakefd, &one, sizeof(one)) < 0)
+		lt_debug("%s: eventfd write: %m\n", __func__);
+}
+
+int DmxReactor::add(int fd, dmx_reactor_cb_t cb, void *priv)
+{
+	entry *e = new entry;
+	e->fd = fd;
+	e->cb = cb;
+	e->priv = priv;
+	e->timer = 0;
+	e->busy = 0;
+	pthread_mutex_lock(&lock);
+	int id = next_id++;
+	if (fd > -1) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN|EPOLLPRI;
+		ev.data.u64 = id;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			lt_debug("%s: epoll_ctl(ADD, %d): %m\n", __func__, fd);
+			pthread_mutex_unlock(&lock);
+			delete e;
+			return -1;
+		}
+	}
+	entries[id] = e;
+	pthread_mutex_unlock(&lock);
+	lt_debug("%s: fd %d id %d\n", __func__, fd, id);
+	return id;
+}
+
+void DmxReactor::unwatch(int id)
+{
+	pthread_mutex_lock(&lock);
+	std::map<int, entry *>::iterator i = entries.find(id);
+	if (i != entries.end() && i->second->fd > -1) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, i->second->fd, NULL);
+		i->second->fd = -1;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void DmxReactor::remove(int id)
+{
+	pthread_mutex_lock(&lock);
+	std::map<int, entry *>::iterator i = entries.find(id);
+	if (i == entries.end()) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	entry *e = i->second;
+	entries.erase(i);
+	if (e->fd > -1)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, e->fd, NULL);
+	/* the callback might just be running, wait for it to finish,
+	 * unless we are called from within the callback */
+	if (!pthread_equal(pthread_self(), thread)) {
+		while (e->busy > 0)
+			pthread_cond_wait(&cond, &lock);
+	}
+	if (e->busy > 0)
+		e->cb = NULL; /* dispatch() deletes it */
+	else
+		delete e;
+	pthread_mutex_unlock(&lock);
+}
+
+void DmxReactor::setTimer(int id, int64_t when)
+{
+	pthread_mutex_lock(&lock);
+	std::map<int, entry *>::iterator i = entries.find(id);
+	if (i != entries.end()) {
+		i->second->timer = when;
+		wakeup();
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* runs the callback without holding the lock, so that it can call back
+ * into the reactor and take its own locks in any order */
+void DmxReactor::dispatch(int id, uint32_t events)
+{
+	pthread_mutex_lock(&lock);
+	std::map<int, entry *>::iterator i = entries.find(id);
+	if (i == entries.end()) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	entry *e = i->second;
+	e->busy++;
+	pthread_mutex_unlock(&lock);
+	e->cb(e->priv, e->fd, events);
+	pthread_mutex_lock(&lock);
+	e->busy--;
+	if (!e->cb)
+		delete e; /* removed by itself */
+	else
+		pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void *DmxReactor::run_thread(void *c)
+{
+	DmxReactor *obj = (DmxReactor *)c;
+	obj->run();
+	return NULL;
+}
+
+void DmxReactor::run(void)
+{
+	hal_set_threadname("hal:dmxreactor");
+	lt_info("%s: start\n", __func__);
+	struct epoll_event ev[MAX_EVENTS];
+	std::vector<int> expired;
+	while (true) {
+		int timeout = -1;
+		int64_t now = now_ms();
+		pthread_mutex_lock(&lock);
+		for (std::map<int, entry *>::iterator i = entries.begin(); i != entries.end(); ++i) {
+			int64_t t = i->second->timer;
+			if (t == 0)
+				continue;
+			int to = (t > now) ? (int)(t - now) : 0;
+			if (timeout < 0 || to < timeout)
+				timeout = to;
+		}
+		pthread_mutex_unlock(&lock);
+
+		int n = epoll_wait(epfd, ev, MAX_EVENTS, timeout);
+		if (n < 0 && errno != EINTR) {
+			lt_info("%s: epoll_wait: %m\n", __func__);
+			usleep(100000);
+		}
+		for (int j = 0; j < n; j++) {
+			if (ev[j].data.u64 == 0) {
+				uint64_t tmp;
+				if (read(wakefd, &tmp, sizeof(tmp)) < 0 && errno != EAGAIN)
+					lt_debug("%s: eventfd read: %m\n", __func__);
+				continue;
+			}
+			dispatch((int)ev[j].data.u64, ev[j].events);
+		}
+
+		now = now_ms();
+		expired.clear();
+		pthread_mutex_lock(&lock);
+		for (std::map<int, entry *>::iterator i = entries.begin(); i != entries.end(); ++i) {
+			if (i->second->timer && i->second->timer <= now) {
+				i->second->timer = 0; /* one-shot */
+				expired.push_back(i->first);
+			}
+		}
+		pthread_mutex_unlock(&lock);
+		for (std::vector<int>::iterator i = expired.begin(); i != expired.end(); ++i)
+			dispatch(*i, 0);
+	}
+}
+
+/* fill a cDemux' ring from its demux fd */
+static void ring_cb(void *priv, int fd, uint32_t events)
+{
+	static uint8_t scratch[65536];
+	cMmapRing *ring = (cMmapRing *)priv;
+	uint8_t *w;
+	if (!events)
+		return;
+	int n = ring->reserve(&w);
+	if (n == 0) {
+		/* the reader does not keep up. drop the kernel's data and
+		 * report EOVERFLOW, just like the kernel demux would do */
+		if (read(fd, scratch, sizeof(scratch)) < 0 && errno != EAGAIN)
+			lt_info_c("%s: fd %d read: %m\n", __func__, fd);
+		ring->setError(EOVERFLOW);
+		return;
+	}
+	int r = read(fd, w, n);
+	if (r > 0)
+		ring->commit(r);
+	else if (r < 0 && errno != EAGAIN && errno != EINTR)
+		ring->srcError(errno);
+}
+
+int DmxReactor::addRing(int fd, cMmapRing *ring)
+{
+	return add(fd, ring_cb, ring);
+}
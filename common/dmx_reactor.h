@@ -0,0 +1,66 @@
+/*
+ * one epoll thread for all demux file descriptors
+ *
+ * Instead of every cDemux user blocking in its own poll() / read() loop
+ * (and waking up every few ms just to time out), the reactor waits for
+ * all registered fds in one epoll set, reads them into the filters'
+ * cMmapRing buffers and runs the (one-shot) timers of the userspace demux.
+ * cDemux::Read() then only waits on the ring.
+ *
+ * Enabled with HAL_DMX_REACTOR=1.
+ *
+ * License: GPLv2 or later
+ */
+#ifndef __DMX_REACTOR_H__
+#define __DMX_REACTOR_H__
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <map>
+
+#include "mmap_ring.h"
+
+/* events == 0 means the timer of that entry has expired */
+typedef void (*dmx_reactor_cb_t)(void *priv, int fd, uint32_t events);
+
+class DmxReactor
+{
+public:
+	/* the reactor, or NULL if it is not enabled */
+	static DmxReactor *get(void);
+	/* call cb whenever fd is readable. returns the id of the entry,
+	 * or -1 if fd cannot be watched (e.g. regular files) */
+	int add(int fd, dmx_reactor_cb_t cb, void *priv);
+	/* read fd into ring whenever it is readable, see ring_cb() */
+	int addRing(int fd, cMmapRing *ring);
+	/* when remove() returns, the callback is not running and will not
+	 * be called again. Can also be called from the callback itself. */
+	void remove(int id);
+	/* stop watching the fd, but keep the entry for its timer */
+	void unwatch(int id);
+	/* call the callback once at CLOCK_MONOTONIC ms "when", 0 == never */
+	void setTimer(int id, int64_t when);
+private:
+	DmxReactor();
+	struct entry {
+		int fd;
+		dmx_reactor_cb_t cb;
+		void *priv;
+		int64_t timer;
+		int busy;
+	};
+	std::map<int, entry *> entries;
+	int next_id;
+	int epfd;
+	int wakefd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	void wakeup(void);
+	void dispatch(int id, uint32_t events);
+	void run(void);
+	static void *run_thread(void *);
+};
+
+#endif
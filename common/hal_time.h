@@ -0,0 +1,33 @@
+/*
+ * CLOCK_MONOTONIC in the units the timeouts, statistics and A/V clocks
+ * of libstb-hal use
+ *
+ * License: GPLv2 or later
+ */
+#ifndef __HAL_TIME_H__
+#define __HAL_TIME_H__
+#include <inttypes.h>
+#include <time.h>
+
+static inline int64_t now_ms(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+static inline int64_t now_us(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/* 90kHz, like PTS and PCR */
+static inline int64_t clock_90k(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec * 90000 + t.tv_nsec / (1000000000 / 90000);
+}
+#endif
@@ -0,0 +1,368 @@
+/*
+ * mirrored ring buffer for zero-copy access to demux data
+ *
+ * The buffer memory is a memfd (or an unlinked tmpfs file) which is
+ * mapped twice, directly after each other. Data which wraps around the
+ * end of the ring thus is still contiguous in virtual memory and can be
+ * handed out as one pointer, without any copying.
+ *
+ * License: GPLv2 or later
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "mmap_ring.h"
+#include "lt_debug.h"
+
+#define lt_debug(args...) _lt_debug(HAL_DEBUG_DEMUX, this, args)
+#define lt_info(args...) _lt_info(HAL_DEBUG_DEMUX, this, args)
+
+/* a multiple of the page size and of SHMLBA on all our platforms: the
+ * sh4 data cache would alias if both mappings were not congruent */
+#define RING_ALIGN 0x10000
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+static int ring_memfd(void)
+{
+	int fd = -1;
+#ifdef SYS_memfd_create
+	fd = syscall(SYS_memfd_create, "hal_ring", MFD_CLOEXEC);
+#endif
+	if (fd < 0) {
+		/* older kernels: /tmp is a tmpfs on the boxes anyway */
+		char name[] = "/tmp/.hal_ring.XXXXXX";
+		fd = mkstemp(name);
+		if (fd > -1) {
+			unlink(name);
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+		}
+	}
+	return fd;
+}
+
+cMmapRing::cMmapRing(int sz)
+{
+	base = NULL;
+	size = 0;
+	rpos = 0;
+	fill = 0;
+	error = 0;
+	readers = 0;
+	closing = false;
+	src_fd = -1;
+	sections = false;
+	sec_left = 0;
+	tap = NULL;
+	tap_priv = NULL;
+	overflows = 0;
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&lock, NULL);
+	efd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+
+	if (sz < RING_ALIGN)
+		sz = RING_ALIGN;
+	sz = (sz + RING_ALIGN - 1) & ~(RING_ALIGN - 1);
+	int mfd = ring_memfd();
+	if (mfd < 0 || ftruncate(mfd, sz) < 0) {
+		lt_info("%s: cannot create ring memory (%m)\n", __func__);
+		goto out;
+	}
+	/* reserve the address space, then map the memory twice into it */
+	base = (uint8_t *)mmap(NULL, 2 * sz, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		lt_info("%s: mmap(%d) failed (%m)\n", __func__, 2 * sz);
+		base = NULL;
+		goto out;
+	}
+	if (mmap(base, sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, mfd, 0) == MAP_FAILED ||
+	    mmap(base + sz, sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, mfd, 0) == MAP_FAILED) {
+		lt_info("%s: mirror mmap failed (%m)\n", __func__);
+		munmap(base, 2 * sz);
+		base = NULL;
+		goto out;
+	}
+	size = sz;
+	lt_debug("%s: %d bytes at %p\n", __func__, size, base);
+ out:
+	if (mfd > -1)
+		close(mfd);
+}
+
+cMmapRing::~cMmapRing()
+{
+	shutdown();
+	if (base)
+		munmap(base, 2 * size);
+	if (efd > -1)
+		close(efd);
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+/* call with lock held */
+void cMmapRing::signal(void)
+{
+	uint64_t one = 1;
+	if (::write(efd, &one, sizeof(one)) < 0)
+		lt_debug("%s: eventfd write: %m\n", __func__);
+	pthread_cond_broadcast(&cond);
+}
+
+/* call with lock held */
+void cMmapRing::clear_event(void)
+{
+	uint64_t tmp;
+	if (::read(efd, &tmp, sizeof(tmp)) < 0 && errno != EAGAIN)
+		lt_debug("%s: eventfd read: %m\n", __func__);
+}
+
+/* read from the source fd into the free space. consumer side, lock not held */
+int cMmapRing::pull(int timeout)
+{
+	struct pollfd pfd;
+	pfd.fd = src_fd;
+	pfd.events = POLLIN|POLLPRI;
+	pfd.revents = 0;
+	int ret = poll(&pfd, 1, timeout);
+	if (ret <= 0)
+		return (ret < 0 && errno != EINTR) ? -1 : 0;
+	uint8_t *w;
+	int n = reserve(&w);
+	if (n == 0)
+		return 0;
+	ret = ::read(src_fd, w, n);
+	if (ret > 0)
+		commit(ret);
+	else if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+		int err = errno;
+		if (err == EOVERFLOW) {
+			pthread_mutex_lock(&lock);
+			overflows++;
+			pthread_mutex_unlock(&lock);
+		}
+		if (tap)
+			tap(tap_priv, NULL, -err);
+		errno = err;
+	}
+	return ret;
+}
+
+int cMmapRing::peek(uint8_t **data, int timeout, int min)
+{
+	int ret = 0;
+	if (!base) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (min > size)
+		min = size;
+	if (src_fd > -1) {
+		/* top up what we have, but only wait if it is not enough */
+		int f = getFill();
+		if (f < size && pull(f < min ? timeout : 0) < 0 && errno != EAGAIN && errno != EINTR)
+			return -1;
+		timeout = 0;
+	}
+	struct timespec deadline;
+	if (timeout > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+	pthread_mutex_lock(&lock);
+	readers++;
+	while (fill < min && !error && !closing) {
+		if (timeout == 0)
+			break;
+		if (timeout < 0)
+			pthread_cond_wait(&cond, &lock);
+		else if (pthread_cond_timedwait(&cond, &lock, &deadline) == ETIMEDOUT)
+			break;
+	}
+	if (closing) {
+		errno = EBADF;
+		ret = -1;
+	} else if (error) {
+		/* like dmxdev: report the error once and flush the buffer */
+		errno = error;
+		ret = -1;
+		rpos = (rpos + fill) % size;
+		fill = 0;
+		sec_left = 0;
+		error = 0;
+		clear_event();
+	} else {
+		*data = base + rpos;
+		ret = fill;
+	}
+	readers--;
+	if (closing)
+		pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+void cMmapRing::release(int len)
+{
+	pthread_mutex_lock(&lock);
+	if (len > fill)
+		len = fill;
+	rpos = (rpos + len) % size;
+	fill -= len;
+	if (fill == 0)
+		clear_event();
+	pthread_mutex_unlock(&lock);
+}
+
+int cMmapRing::read(uint8_t *buf, int len, int timeout)
+{
+	uint8_t *data;
+	/* in section mode, wait for at least the section header */
+	int n = peek(&data, timeout, (sections && sec_left == 0) ? 3 : 1);
+	if (n <= 0 || (sections && sec_left == 0 && n < 3)) {
+		if (n >= 0 && timeout == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+		return (n < 0) ? -1 : 0;
+	}
+	if (sections) {
+		/* return at most one section per read, as most users expect */
+		if (sec_left == 0)
+			sec_left = 3 + (((data[1] & 0x0f) << 8) | data[2]);
+		if (len > sec_left)
+			len = sec_left;
+	}
+	if (len > n)
+		len = n;
+	memcpy(buf, data, len);
+	if (sections)
+		sec_left -= len;
+	release(len);
+	return len;
+}
+
+int cMmapRing::reserve(uint8_t **data)
+{
+	pthread_mutex_lock(&lock);
+	*data = base + (rpos + fill) % size;
+	int ret = size - fill;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+void cMmapRing::commit(int len)
+{
+	if (tap) {
+		/* the consumer cannot see the data before fill is updated */
+		pthread_mutex_lock(&lock);
+		uint8_t *data = base + (rpos + fill) % size;
+		pthread_mutex_unlock(&lock);
+		tap(tap_priv, data, len);
+	}
+	pthread_mutex_lock(&lock);
+	if (fill == 0)
+		signal();
+	else
+		pthread_cond_broadcast(&cond);
+	fill += len;
+	pthread_mutex_unlock(&lock);
+}
+
+bool cMmapRing::write(const uint8_t *data, int len)
+{
+	pthread_mutex_lock(&lock);
+	if (error || closing || !base) {
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+	if (fill + len > size) {
+		lt_debug("%s: overflow, fill %d len %d size %d\n", __func__, fill, len, size);
+		error = EOVERFLOW;
+		overflows++;
+		signal();
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+	memcpy(base + (rpos + fill) % size, data, len);
+	if (fill == 0)
+		signal();
+	else
+		pthread_cond_broadcast(&cond);
+	fill += len;
+	pthread_mutex_unlock(&lock);
+	if (tap)
+		tap(tap_priv, data, len);
+	return true;
+}
+
+int cMmapRing::getFill(void)
+{
+	pthread_mutex_lock(&lock);
+	int ret = fill;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+void cMmapRing::setError(int err)
+{
+	pthread_mutex_lock(&lock);
+	if (err == EOVERFLOW)
+		overflows++;
+	if (!error) {
+		error = err;
+		signal();
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void cMmapRing::srcError(int err)
+{
+	if (tap)
+		tap(tap_priv, NULL, -err);
+	setError(err);
+}
+
+void cMmapRing::reset(void)
+{
+	pthread_mutex_lock(&lock);
+	/* flush by moving rpos, so that a concurrent reserve() / commit()
+	 * still works on the right part of the ring */
+	if (size)
+		rpos = (rpos + fill) % size;
+	fill = 0;
+	sec_left = 0;
+	error = 0;
+	clear_event();
+	pthread_mutex_unlock(&lock);
+}
+
+void cMmapRing::shutdown(void)
+{
+	pthread_mutex_lock(&lock);
+	closing = true;
+	pthread_cond_broadcast(&cond);
+	while (readers > 0)
+		pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+}
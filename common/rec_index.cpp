@@ -0,0 +1,309 @@
+/*
+ * sidecar index of a recording, <recording>.idx
+ *
+ * The I-frames are found in the first TS packet of each video PES packet:
+ * MPEG-2 by the sequence header or the picture coding type, H.264 and
+ * HEVC by the access unit delimiter (which DVB requires) or the parameter
+ * sets and IDR / IRAP slices. A set random_access_indicator is also taken
+ * as an I-frame.
+ *
+ * License: GPLv2 or later
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "rec_index.h"
+#include "ts_scan.h"
+#include "lt_debug.h"
+
+#define lt_debug(args...) _lt_debug(HAL_DEBUG_RECORD, this, args)
+#define lt_info(args...) _lt_info(HAL_DEBUG_RECORD, this, args)
+#define lt_info_c(args...) _lt_info(HAL_DEBUG_RECORD, NULL, args)
+
+#define PTS_MASK 0x1FFFFFFFFLL
+
+enum {
+	CODEC_UNKNOWN = 0,
+	CODEC_MPEG2,
+	CODEC_H264,
+	CODEC_HEVC
+};
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+	for (int i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	uint64_t v = 0;
+	for (int i = 7; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+RecIndexWriter *RecIndexWriter::create(int recfd, uint16_t vpid)
+{
+	if (!getenv("HAL_REC_INDEX"))
+		return NULL;
+	char link[32];
+	char name[4096];
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", recfd);
+	ssize_t len = readlink(link, name, sizeof(name) - 5);
+	if (len <= 0) {
+		lt_info_c("%s: cannot get the file name of fd %d (%m)\n", __func__, recfd);
+		return NULL;
+	}
+	strcpy(name + len, ".idx");
+	int fd = ::open(name, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0) {
+		lt_info_c("%s: %s: %m\n", __func__, name);
+		return NULL;
+	}
+	if (write(fd, REC_INDEX_MAGIC, 8) != 8) {
+		lt_info_c("%s: %s: write: %m\n", __func__, name);
+		close(fd);
+		unlink(name);
+		return NULL;
+	}
+	lt_info_c("%s: writing %s, vpid 0x%04x\n", __func__, name, vpid);
+	return new RecIndexWriter(fd, vpid);
+}
+
+RecIndexWriter::RecIndexWriter(int _fd, uint16_t _vpid)
+	: packets(packet_cb, this)
+{
+	fd = _fd;
+	vpid = _vpid;
+	pcr_pid = -1;
+	last_pcr = -1;
+	codec = CODEC_UNKNOWN;
+	out_fill = 0;
+}
+
+RecIndexWriter::~RecIndexWriter()
+{
+	flush();
+	close(fd);
+}
+
+void RecIndexWriter::flush(void)
+{
+	if (out_fill && write(fd, out, out_fill) != out_fill)
+		lt_info("%s: write: %m\n", __func__);
+	out_fill = 0;
+}
+
+void RecIndexWriter::add(int type, off_t offset, int64_t pts)
+{
+	put_le64(out + out_fill, offset);
+	put_le64(out + out_fill + 8, ((uint64_t)type << 56) | (pts & PTS_MASK));
+	out_fill += 16;
+	/* the PCR entries come once per second: good enough for playing
+	 * a recording that is still running */
+	if (type == REC_INDEX_PCR || out_fill == sizeof(out))
+		flush();
+}
+
+/* es: the start of the elementary stream data of a PES packet */
+bool RecIndexWriter::keyframe(const uint8_t *es, int len)
+{
+	int i = 0;
+	int r;
+	while ((r = ts_find_startcode(es + i, len - i)) >= 0) {
+		i += r + 3;
+		if (i + 3 > len)
+			break;
+		const uint8_t *p = es + i;
+		if (codec == CODEC_UNKNOWN) {
+			if (p[0] == 0x09)
+				codec = CODEC_H264;
+			else if (p[0] == 0x46 && p[1] == 0x01)
+				codec = CODEC_HEVC;
+			else if (p[0] == 0xb3 || p[0] == 0x00)
+				codec = CODEC_MPEG2;
+			else
+				continue;
+			lt_debug("%s: video codec %d\n", __func__, codec);
+		}
+		switch (codec) {
+		case CODEC_MPEG2:
+			if (p[0] == 0xb3)		/* sequence header */
+				return true;
+			if (p[0] == 0x00)		/* picture, coding type 1 == I */
+				return ((p[2] >> 3) & 0x07) == 1;
+			break;
+		case CODEC_H264:
+			switch (p[0] & 0x1f) {
+			case 5:				/* IDR slice */
+			case 7:				/* SPS */
+				return true;
+			case 9:				/* AUD: I, SI or I+SI only */
+				if (p[1] >> 5 == 0 || p[1] >> 5 == 3 || p[1] >> 5 == 5)
+					return true;
+				break;
+			case 1:				/* other slices */
+				return false;
+			}
+			break;
+		case CODEC_HEVC: {
+			int type = (p[0] >> 1) & 0x3f;
+			if ((type >= 16 && type <= 23) || type == 32 || type == 33)
+				return true;		/* IRAP slice, VPS, SPS */
+			if (type == 35 && p[2] >> 5 == 0)
+				return true;		/* AUD: I only */
+			if (type < 16)
+				return false;
+			break;
+		}
+		}
+	}
+	return false;
+}
+
+void RecIndexWriter::packet(const uint8_t *p, off_t offset)
+{
+	if (p[0] != 0x47 || (p[1] & 0x80))	/* out of sync or transport error */
+		return;
+	int pid = ((p[1] & 0x1f) << 8) | p[2];
+	int afc = (p[3] >> 4) & 0x03;
+	int o = 4;
+	bool rai = false;
+	if (afc & 0x02) {
+		int alen = p[4];
+		if (alen > 183)
+			return;
+		if (alen >= 7 && (p[5] & 0x10)) {
+			int64_t pcr = ((int64_t)p[6] << 25) | (p[7] << 17) | (p[8] << 9) | (p[9] << 1) | (p[10] >> 7);
+			if (pcr_pid < 0)
+				pcr_pid = pid;
+			if (pid == pcr_pid && (last_pcr < 0 || ((pcr - last_pcr) & PTS_MASK) >= 90000)) {
+				add(REC_INDEX_PCR, offset, pcr);
+				last_pcr = pcr;
+			}
+		}
+		rai = alen > 0 && (p[5] & 0x40);
+		o = 5 + alen;
+	}
+	if (pid != vpid || !(p[1] & 0x40) || !(afc & 0x01) || o + 14 > 188)
+		return;
+	const uint8_t *pes = p + o;
+	if (pes[0] || pes[1] || pes[2] != 0x01 || !(pes[7] & 0x80))
+		return;	/* no PES start or no PTS */
+	int64_t pts = ((int64_t)(pes[9] & 0x0e) << 29) | (pes[10] << 22) | ((pes[11] & 0xfe) << 14) |
+			(pes[12] << 7) | (pes[13] >> 1);
+	int es = o + 9 + pes[8];
+	if (rai || (es < 188 && keyframe(p + es, 188 - es)))
+		add(REC_INDEX_IFRAME, offset, pts);
+}
+
+void RecIndexWriter::feed(const uint8_t *data, int len, off_t offset)
+{
+	packets.feed(data, len, offset);
+}
+
+void RecIndexWriter::packet_cb(void *priv, const uint8_t *p, int64_t pos, bool)
+{
+	((RecIndexWriter *)priv)->packet(p, pos);
+}
+
+RecIndex *RecIndex::open(const char *filename)
+{
+	std::string name = std::string(filename) + ".idx";
+	int fd = ::open(name.c_str(), O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	char magic[8];
+	if (read(fd, magic, 8) != 8 || memcmp(magic, REC_INDEX_MAGIC, 8)) {
+		lt_info_c("%s: %s is not an index\n", __func__, name.c_str());
+		close(fd);
+		return NULL;
+	}
+	RecIndex *idx = new RecIndex(fd);
+	idx->read_entries();
+	lt_info_c("%s: %s: %d I-frames, %d PCRs\n", __func__, name.c_str(),
+		  (int)idx->iframes.size(), (int)idx->pcrs.size());
+	return idx;
+}
+
+RecIndex::RecIndex(int _fd)
+{
+	fd = _fd;
+	part_fill = 0;
+}
+
+RecIndex::~RecIndex()
+{
+	close(fd);
+}
+
+void RecIndex::append(std::vector<entry> &v, off_t offset, int64_t pts)
+{
+	entry e;
+	e.offset = offset;
+	e.pts = pts;
+	if (!v.empty()) {
+		/* continue after the last one, across the 33 bit wraparound */
+		int64_t last = v.back().pts;
+		e.pts = last + (((pts - last) & PTS_MASK) ^ 0x100000000LL) - 0x100000000LL;
+	}
+	v.push_back(e);
+}
+
+/* read what the writer has added since the last time */
+void RecIndex::read_entries(void)
+{
+	uint8_t buf[4096];
+	ssize_t n;
+	memcpy(buf, part, part_fill);
+	while ((n = read(fd, buf + part_fill, sizeof(buf) - part_fill)) > 0) {
+		n += part_fill;
+		int i;
+		for (i = 0; i + 16 <= n; i += 16) {
+			uint64_t v = get_le64(buf + i + 8);
+			off_t offset = get_le64(buf + i);
+			if (v >> 56 == REC_INDEX_IFRAME)
+				append(iframes, offset, v & PTS_MASK);
+			else if (v >> 56 == REC_INDEX_PCR)
+				append(pcrs, offset, v & PTS_MASK);
+		}
+		part_fill = n - i;
+		memmove(buf, buf + i, part_fill);
+	}
+	memcpy(part, buf, part_fill);
+}
+
+off_t RecIndex::lookup(const std::vector<entry> &v, int64_t pts)
+{
+	if (v.empty())
+		return -1;
+	/* pts is relative to the start here */
+	int64_t rel = (pts - v[0].pts) & PTS_MASK;
+	if (rel >= 0x100000000LL)	/* "negative": before the start */
+		return v[0].offset;
+	size_t lo = 0, hi = v.size();
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if (v[mid].pts - v[0].pts <= rel)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return v[lo].offset;
+}
+
+off_t RecIndex::find(int64_t pts)
+{
+	/* a timeshift or running recording keeps growing */
+	read_entries();
+	if (!iframes.empty())
+		return lookup(iframes, pts);
+	return lookup(pcrs, pts);
+}
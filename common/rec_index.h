@@ -0,0 +1,78 @@
+/*
+ * sidecar index of a recording, <recording>.idx
+ *
+ * cRecord writes the file offsets of the video I-frames with their PTS
+ * and a PCR timeline (one entry per second), so that the playback can
+ * seek with a binary search instead of guessing from the bitrate.
+ *
+ * License: GPLv2 or later
+ */
+#ifndef __REC_INDEX_H__
+#define __REC_INDEX_H__
+
+#include <inttypes.h>
+#include <sys/types.h>
+#include <vector>
+
+#include "ts_packets.h"
+
+/* the file is a header, then 16 byte entries: offset (64 bit) and
+ * type << 56 | PTS or PCR base (33 bit), both little endian */
+#define REC_INDEX_MAGIC "HALIDX1\n"
+#define REC_INDEX_IFRAME 1
+#define REC_INDEX_PCR 2
+
+class RecIndexWriter
+{
+public:
+	/* index the recording that is written to fd. Enabled with
+	 * HAL_REC_INDEX=1, NULL if not enabled or the file cannot be created */
+	static RecIndexWriter *create(int fd, uint16_t vpid);
+	~RecIndexWriter();
+	/* the TS data which is written at file offset "offset", in order */
+	void feed(const uint8_t *data, int len, off_t offset);
+private:
+	RecIndexWriter(int fd, uint16_t vpid);
+	int fd;
+	uint16_t vpid;
+	int pcr_pid;		/* the first PID with a PCR */
+	int64_t last_pcr;
+	int codec;		/* see rec_index.cpp */
+	TSPackets packets;
+	uint8_t out[4096];
+	int out_fill;
+
+	void packet(const uint8_t *p, off_t offset);
+	static void packet_cb(void *priv, const uint8_t *p, int64_t pos, bool buffered);
+	bool keyframe(const uint8_t *es, int len);
+	void add(int type, off_t offset, int64_t pts);
+	void flush(void);
+};
+
+class RecIndex
+{
+public:
+	/* the index of the recording "filename", NULL if there is none */
+	static RecIndex *open(const char *filename);
+	~RecIndex();
+	/* the offset of the last I-frame (without video: PCR entry) at or
+	 * before pts (90 kHz, as in the stream), -1 if not known */
+	off_t find(int64_t pts);
+private:
+	struct entry {
+		off_t offset;
+		int64_t pts;	/* without 33 bit wraparounds */
+	};
+	RecIndex(int fd);
+	int fd;
+	std::vector<entry> iframes;
+	std::vector<entry> pcrs;
+	uint8_t part[16];	/* a partial entry, if the writer is not done yet */
+	int part_fill;
+
+	void read_entries(void);
+	static void append(std::vector<entry> &v, off_t offset, int64_t pts);
+	static off_t lookup(const std::vector<entry> &v, int64_t pts);
+};
+
+#endif
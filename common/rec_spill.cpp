@@ -0,0 +1,220 @@
+/*
+ * elastic memory buffer for recordings on slow storage
+ *
+ * The data only go into the chunks while the ring is full, and come out
+ * of them before anything newer, so the order is kept. The chunks are
+ * mapped anonymously and given back to the system when the recordings
+ * have caught up, except for a few spare ones.
+ *
+ * License: GPLv2 or later
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "rec_spill.h"
+#include "lt_debug.h"
+#include "hal_time.h"
+
+#define lt_debug(args...) _lt_debug(HAL_DEBUG_RECORD, this, args)
+#define lt_info(args...) _lt_info(HAL_DEBUG_RECORD, this, args)
+#define lt_info_c(args...) _lt_info(HAL_DEBUG_RECORD, NULL, args)
+
+#define SPILL_CHUNK (1 << 20)	/* 1MB */
+/* chunks which are kept when they are free again */
+#define SPILL_SPARE 2
+
+/* the pool, for all recordings */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t pool_budget = 0;
+static int64_t pool_used = 0;	/* spare chunks included */
+static std::vector<uint8_t *> pool_spare;
+
+static uint8_t *chunk_get(void)
+{
+	uint8_t *ret = NULL;
+	pthread_mutex_lock(&pool_lock);
+	if (!pool_spare.empty()) {
+		ret = pool_spare.back();
+		pool_spare.pop_back();
+	} else if (pool_used + SPILL_CHUNK <= pool_budget) {
+		void *p = mmap(NULL, SPILL_CHUNK, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (p != MAP_FAILED) {
+			ret = (uint8_t *)p;
+			pool_used += SPILL_CHUNK;
+		}
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return ret;
+}
+
+static void chunk_put(uint8_t *mem)
+{
+	pthread_mutex_lock(&pool_lock);
+	if (pool_spare.size() < SPILL_SPARE)
+		pool_spare.push_back(mem);
+	else {
+		munmap(mem, SPILL_CHUNK);
+		pool_used -= SPILL_CHUNK;
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+RecSpill *RecSpill::create(int bufsize)
+{
+	const char *e = getenv("HAL_REC_SPILL");
+	if (!e)
+		return NULL;
+	int64_t budget = (int64_t)atoi(e) << 20;
+	if (budget < SPILL_CHUNK) {
+		lt_info_c("%s: HAL_REC_SPILL=%s: not even one chunk\n", __func__, e);
+		return NULL;
+	}
+	cMmapRing *ring = new cMmapRing(bufsize);
+	if (ring->getSize() == 0) {
+		lt_info_c("%s: no ring buffer of %d bytes\n", __func__, bufsize);
+		delete ring;
+		return NULL;
+	}
+	pthread_mutex_lock(&pool_lock);
+	pool_budget = budget;
+	pthread_mutex_unlock(&pool_lock);
+	lt_info_c("%s: up to %lld MB in memory for all recordings\n", __func__, (long long)budget >> 20);
+	return new RecSpill(ring);
+}
+
+RecSpill::RecSpill(cMmapRing *_ring)
+{
+	ring = _ring;
+	spilled = 0;
+	spilled_max = 0;
+	exhausted = false;
+	rate_start = now_ms();
+	rate_bytes = 0;
+	rate = 0;
+}
+
+RecSpill::~RecSpill()
+{
+	while (!chunks.empty()) {
+		chunk_put(chunks.front().mem);
+		chunks.pop_front();
+	}
+	if (spilled)
+		lt_info("%s: %lld bytes were not written\n", __func__, (long long)spilled);
+	delete ring;
+}
+
+/* the oldest data first: from the chunks into the ring */
+int RecSpill::drain(void)
+{
+	int ret = 0;
+	while (!chunks.empty()) {
+		chunk &c = chunks.front();
+		uint8_t *out;
+		int room = ring->reserve(&out);
+		if (room <= 0)
+			break;
+		int n = c.end - c.start;
+		if (n > room)
+			n = room;
+		memcpy(out, c.mem + c.start, n);
+		ring->commit(n);
+		c.start += n;
+		spilled -= n;
+		ret += n;
+		if (c.start < c.end)
+			break;
+		chunk_put(c.mem);
+		chunks.pop_front();
+	}
+	if (chunks.empty() && spilled_max) {
+		lt_info("%s: caught up, %lld kB were in memory\n", __func__, (long long)spilled_max >> 10);
+		spilled_max = 0;
+		exhausted = false;
+	}
+	return ret;
+}
+
+void RecSpill::count(int len)
+{
+	int64_t now = now_ms();
+	rate_bytes += len;
+	if (now - rate_start < 1000)
+		return;
+	int r = rate_bytes * 1000 / (now - rate_start);
+	rate = rate ? (rate * 3 + r) / 4 : r;
+	rate_start = now;
+	rate_bytes = 0;
+}
+
+int RecSpill::seconds(void)
+{
+	if (rate <= 0)
+		return 0;
+	return (spilled + ring->getFill()) / rate;
+}
+
+int RecSpill::pump(cMmapRing *src, int timeout)
+{
+	int ret = drain();
+	uint8_t *in;
+	/* the writer has something to do, no need to wait */
+	int len = src->peek(&in, ret > 0 ? 0 : timeout);
+	if (len < 0) {
+		if (ret > 0 && errno == EAGAIN)
+			return ret;
+		return -1;
+	}
+	int used = 0;
+	if (chunks.empty()) {
+		uint8_t *out;
+		int room = ring->reserve(&out);
+		used = len < room ? len : room;
+		if (used > 0) {
+			memcpy(out, in, used);
+			ring->commit(used);
+			ret += used;
+		}
+	}
+	while (used < len) {
+		if (chunks.empty() || chunks.back().end == SPILL_CHUNK) {
+			chunk c;
+			c.mem = chunk_get();
+			if (!c.mem) {
+				/* the rest stays in src, which will overflow */
+				if (!exhausted)
+					lt_info("%s: memory budget used up, %lld kB in memory\n", __func__, (long long)spilled >> 10);
+				exhausted = true;
+				break;
+			}
+			if (chunks.empty())
+				lt_debug("%s: disk is slow, buffering in memory\n", __func__);
+			c.start = 0;
+			c.end = 0;
+			chunks.push_back(c);
+		}
+		chunk &c = chunks.back();
+		int n = len - used;
+		if (n > SPILL_CHUNK - c.end)
+			n = SPILL_CHUNK - c.end;
+		memcpy(c.mem + c.end, in + used, n);
+		c.end += n;
+		used += n;
+		spilled += n;
+	}
+	if (spilled > spilled_max)
+		spilled_max = spilled;
+	src->release(used);
+	count(used);
+	if (ret == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return ret;
+}
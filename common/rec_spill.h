@@ -0,0 +1,61 @@
+/*
+ * elastic memory buffer for recordings on slow storage
+ *
+ * The ring buffer of a recording holds well under a second of an HD
+ * service. When the disk (a NAS, a USB stick...) stalls for longer, data
+ * is lost. With HAL_REC_SPILL=<MB>, cRecord passes the demux data through
+ * RecSpill: whatever does not fit into the ring that is written to the
+ * file goes into chunks of memory, which are written out in order when
+ * the disk has caught up. The chunks come from a pool whose size is
+ * shared by all recordings.
+ *
+ * License: GPLv2 or later
+ */
+#ifndef __REC_SPILL_H__
+#define __REC_SPILL_H__
+
+#include <inttypes.h>
+#include <deque>
+
+#include "mmap_ring.h"
+
+class RecSpill
+{
+public:
+	/* NULL if not enabled */
+	static RecSpill *create(int bufsize);
+	~RecSpill();
+	/* what is written to the file */
+	cMmapRing *getRing(void) { return ring; };
+	/* move data from src into the ring, or into memory if the ring is
+	 * full. Like RecSpts::pump(): waits up to timeout ms for data and
+	 * returns the number of bytes put into the ring, or -1 and errno */
+	int pump(cMmapRing *src, int timeout);
+	/* bytes in memory which did not fit into the ring */
+	int64_t pending(void) { return spilled; };
+	/* the memory budget is used up, the source is not emptied */
+	bool isFull(void) { return exhausted; };
+	/* how many seconds of the recording wait to be written, ring
+	 * included, estimated from the data rate */
+	int seconds(void);
+private:
+	struct chunk {
+		uint8_t *mem;
+		int start;
+		int end;
+	};
+	RecSpill(cMmapRing *ring);
+	cMmapRing *ring;
+	std::deque<chunk> chunks;
+	int64_t spilled;
+	int64_t spilled_max;	/* of this stall, for the log */
+	bool exhausted;		/* the pool was empty */
+	int64_t rate_start;	/* the data rate, in bytes per second */
+	int64_t rate_bytes;
+	int rate;
+
+	int drain(void);
+	void count(int len);
+};
+
+#endif
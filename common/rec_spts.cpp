@@ -0,0 +1,382 @@
+/*
+ * single program transport stream for the recordings
+ *
+ * The PAT and PMT of the service are taken from the stream, the PMT is
+ * rebuilt with the recorded elementary streams only (descriptors are kept
+ * as they are). Until both have been seen, the stream passes unchanged.
+ *
+ * License: GPLv2 or later
+ */
+#include <errno.h>
+#include <time.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "rec_spts.h"
+#include "crc32.h"
+#include "ts_scan.h"
+#include "lt_debug.h"
+#include "hal_time.h"
+
+#define lt_debug(args...) _lt_debug(HAL_DEBUG_RECORD, this, args)
+#define lt_info(args...) _lt_info(HAL_DEBUG_RECORD, this, args)
+#define lt_info_c(args...) _lt_info(HAL_DEBUG_RECORD, NULL, args)
+
+/* how often PAT and PMT are repeated, the maximum DVB allows */
+#define INTERVAL_MS 100
+
+RecSpts *RecSpts::create(uint16_t sid, int bufsize)
+{
+	if (!getenv("HAL_REC_SPTS"))
+		return NULL;
+	cMmapRing *ring = new cMmapRing(bufsize);
+	if (ring->getSize() == 0) {
+		lt_info_c("%s: no ring buffer of %d bytes\n", __func__, bufsize);
+		delete ring;
+		return NULL;
+	}
+	lt_info_c("%s: single program recording, service 0x%04x\n", __func__, sid);
+	return new RecSpts(sid, ring);
+}
+
+RecSpts::RecSpts(uint16_t _sid, cMmapRing *_ring)
+{
+	ring = _ring;
+	sid = _sid;
+	sid_guessed = (sid == 0);
+	pmt_pid = -1;
+	pcr_pid = 0x1fff;
+	tsid = 0;
+	ready = false;
+	resend = false;
+	last_sent = 0;
+	memset(recorded, 0, sizeof(recorded));
+	memset(keep, 0, sizeof(keep));
+	pat_in.fill = 0;
+	pat_in.sync = false;
+	pmt_in.fill = 0;
+	pmt_in.sync = false;
+	pat_version = 0;
+	pmt_version = 0;
+	pmt_pkts = 0;
+	pat_cc = 0;
+	pmt_cc = 0;
+	pthread_mutex_init(&lock, NULL);
+}
+
+RecSpts::~RecSpts()
+{
+	delete ring;
+	pthread_mutex_destroy(&lock);
+}
+
+void RecSpts::setPids(const std::vector<uint16_t> &pids)
+{
+	pthread_mutex_lock(&lock);
+	memset(recorded, 0, sizeof(recorded));
+	for (std::vector<uint16_t>::const_iterator i = pids.begin(); i != pids.end(); ++i)
+		recorded[*i & 0x1fff] = 1;
+	if (!pmt_orig.empty())
+		build_pmt();
+	pthread_mutex_unlock(&lock);
+}
+
+int RecSpts::getPmtPid(void)
+{
+	pthread_mutex_lock(&lock);
+	int ret = pmt_pid;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+/* assemble the sections of PAT or PMT. call with lock held */
+void RecSpts::collect(section *s, const uint8_t *p, bool pat)
+{
+	int afc = (p[3] >> 4) & 0x03;
+	int o = 4;
+	if (!(afc & 0x01))
+		return;
+	if (afc & 0x02)
+		o += p[4] + 1;
+	if (o >= 188)
+		return;
+	const uint8_t *pl = p + o;
+	int len = 188 - o;
+	if (p[1] & 0x40) {
+		int ptr = pl[0];
+		if (ptr >= len - 1) {
+			s->sync = false;
+			return;
+		}
+		/* the end of the previous section is of no use, it would
+		 * have been complete already if nothing was lost */
+		pl += 1 + ptr;
+		len -= 1 + ptr;
+		s->fill = 0;
+		s->sync = true;
+	}
+	if (!s->sync)
+		return;
+	if (s->fill + len > (int)sizeof(s->data)) {
+		s->sync = false;
+		return;
+	}
+	memcpy(s->data + s->fill, pl, len);
+	s->fill += len;
+	if (s->fill < 3)
+		return;
+	int seclen = 3 + (((s->data[1] & 0x0f) << 8) | s->data[2]);
+	if (seclen > 1024) {
+		s->sync = false;
+		return;
+	}
+	if (s->fill < seclen)
+		return;
+	s->sync = false;
+	if (seclen < 12 || !(s->data[1] & 0x80) || !(s->data[5] & 0x01) || dvb_crc32(s->data, seclen))
+		return;	/* no syntax, not current or broken */
+	if (pat)
+		parse_pat(s->data, seclen);
+	else
+		parse_pmt(s->data, seclen);
+}
+
+/* call with lock held */
+void RecSpts::parse_pat(const uint8_t *sec, int len)
+{
+	if (sec[0] != 0x00)
+		return;
+	int pid = -1;
+	int prog = 0;
+	int progs = 0;
+	int only_pid = -1;
+	int only_prog = 0;
+	for (int i = 8; i + 4 <= len - 4; i += 4) {
+		int p = (sec[i] << 8) | sec[i + 1];
+		int ppid = ((sec[i + 2] & 0x1f) << 8) | sec[i + 3];
+		if (p == 0)	/* the NIT */
+			continue;
+		progs++;
+		only_pid = ppid;
+		only_prog = p;
+		if (sid_guessed ? recorded[ppid] : p == sid) {
+			pid = ppid;
+			prog = p;
+			break;
+		}
+	}
+	if (pid < 0 && sid_guessed && progs == 1) {
+		pid = only_pid;
+		prog = only_prog;
+	}
+	if (pid < 0)
+		return;
+	uint16_t ts = (sec[3] << 8) | sec[4];
+	if (pid == pmt_pid && prog == sid && ts == tsid)
+		return;
+	/* cRecord adds it when it sees it in getPmtPid() */
+	if (!recorded[pid])
+		lt_debug("%s: PMT PID 0x%04x of service 0x%04x is not recorded yet\n", __func__, pid, prog);
+	lt_debug("%s: service 0x%04x PMT PID 0x%04x tsid 0x%04x\n", __func__, prog, pid, ts);
+	if (pid != pmt_pid) {
+		pmt_pid = pid;
+		pmt_in.sync = false;
+		pmt_orig.clear();
+		ready = false;
+	}
+	sid = prog;
+	tsid = ts;
+	pat_version = (pat_version + 1) & 0x1f;
+	build_pat();
+}
+
+/* call with lock held */
+void RecSpts::parse_pmt(const uint8_t *sec, int len)
+{
+	if (sec[0] != 0x02 || ((sec[3] << 8) | sec[4]) != sid)
+		return;
+	if ((int)pmt_orig.size() == len && !memcmp(&pmt_orig[0], sec, len))
+		return;
+	pmt_orig.assign(sec, sec + len);
+	build_pmt();
+}
+
+/* call with lock held */
+void RecSpts::build_pat(void)
+{
+	uint8_t sec[16];
+	sec[0] = 0x00;
+	sec[1] = 0xb0;
+	sec[2] = 13;
+	sec[3] = tsid >> 8;
+	sec[4] = tsid & 0xff;
+	sec[5] = 0xc1 | (pat_version << 1);
+	sec[6] = 0;
+	sec[7] = 0;
+	sec[8] = sid >> 8;
+	sec[9] = sid & 0xff;
+	sec[10] = 0xe0 | (pmt_pid >> 8);
+	sec[11] = pmt_pid & 0xff;
+	uint32_t crc = dvb_crc32_update(0xffffffff, sec, 12);
+	for (int i = 0; i < 4; i++)
+		sec[12 + i] = crc >> (24 - 8 * i);
+	packetize(0, sec, 16, pat_out);
+	resend = true;
+}
+
+/* the PMT with the recorded streams only. call with lock held */
+void RecSpts::build_pmt(void)
+{
+	const uint8_t *o = &pmt_orig[0];
+	int len = pmt_orig.size() - 4;
+	int pilen = ((o[10] & 0x0f) << 8) | o[11];
+	if (12 + pilen > len)
+		return;
+	std::vector<uint8_t> body(o, o + 12 + pilen);
+	body[5] = 0xc1;
+	memset(keep, 0, sizeof(keep));
+	pcr_pid = ((o[8] & 0x1f) << 8) | o[9];
+	keep[pcr_pid] = 1;
+	for (int i = 12 + pilen; i + 5 <= len; ) {
+		int pid = ((o[i + 1] & 0x1f) << 8) | o[i + 2];
+		int eslen = ((o[i + 3] & 0x0f) << 8) | o[i + 4];
+		if (i + 5 + eslen > len)
+			break;
+		if (recorded[pid]) {
+			body.insert(body.end(), o + i, o + i + 5 + eslen);
+			keep[pid] = 1;
+		}
+		i += 5 + eslen;
+	}
+	/* keep[] is all that passes: PAT and PMT are replaced */
+	keep[0] = 0;
+	keep[pmt_pid] = 0;
+	int seclen = body.size() + 4;
+	body[1] = 0xb0 | ((seclen - 3) >> 8);
+	body[2] = (seclen - 3) & 0xff;
+	if (body != pmt_body) {
+		pmt_body = body;
+		pmt_version = (pmt_version + 1) & 0x1f;
+		lt_info("%s: service 0x%04x, PMT version %d, %d bytes\n", __func__, sid, pmt_version, seclen);
+	}
+	body[5] = 0xc1 | (pmt_version << 1);
+	uint32_t crc = dvb_crc32_update(0xffffffff, &body[0], body.size());
+	for (int i = 0; i < 4; i++)
+		body.push_back(crc >> (24 - 8 * i));
+	pmt_pkts = packetize(pmt_pid, &body[0], body.size(), pmt_out);
+	ready = true;
+	resend = true;
+}
+
+/* a section into TS packets, the continuity counters are set by inject().
+ * Returns the number of packets */
+int RecSpts::packetize(uint16_t pid, const uint8_t *sec, int len, uint8_t *out)
+{
+	int n = 0;
+	int done = 0;
+	while (done < len) {
+		uint8_t *p = out + n * 188;
+		int room = 184;
+		p[0] = 0x47;
+		p[1] = (n == 0 ? 0x40 : 0) | (pid >> 8);
+		p[2] = pid & 0xff;
+		p[3] = 0x10;
+		uint8_t *pl = p + 4;
+		if (n == 0) {
+			*pl++ = 0;	/* pointer_field */
+			room--;
+		}
+		int c = (len - done < room) ? len - done : room;
+		memcpy(pl, sec + done, c);
+		memset(pl + c, 0xff, room - c);
+		done += c;
+		n++;
+	}
+	return n;
+}
+
+/* PAT and PMT into out. call with lock held */
+int RecSpts::inject(uint8_t *out)
+{
+	memcpy(out, pat_out, 188);
+	out[3] = 0x10 | pat_cc;
+	pat_cc = (pat_cc + 1) & 0x0f;
+	for (int i = 0; i < pmt_pkts; i++) {
+		uint8_t *p = out + 188 * (i + 1);
+		memcpy(p, pmt_out + 188 * i, 188);
+		p[3] = 0x10 | pmt_cc;
+		pmt_cc = (pmt_cc + 1) & 0x0f;
+	}
+	return 188 * (1 + pmt_pkts);
+}
+
+int RecSpts::convert(const uint8_t *in, int len, uint8_t *out, int room, int *used)
+{
+	int i = 0;
+	int n = 0;
+	int64_t now = now_ms();
+	pthread_mutex_lock(&lock);
+	while (i + 188 <= len && n + 188 + REC_SPTS_RESERVE <= room) {
+		const uint8_t *p = in + i;
+		if (p[0] != 0x47) {
+			int s = ts_resync(p, len - i, 188);
+			if (s < 0) {
+				i = len;
+				break;
+			}
+			i += s;
+			continue;
+		}
+		i += 188;
+		int pid = ((p[1] & 0x1f) << 8) | p[2];
+		if (!(p[1] & 0x80)) {
+			if (pid == 0)
+				collect(&pat_in, p, true);
+			else if (pid == pmt_pid)
+				collect(&pmt_in, p, false);
+		}
+		if (!ready) {
+			/* continue the counters of what passes now */
+			if (pid == 0)
+				pat_cc = (p[3] + 1) & 0x0f;
+			else if (pid == pmt_pid)
+				pmt_cc = (p[3] + 1) & 0x0f;
+			memcpy(out + n, p, 188);
+			n += 188;
+			continue;
+		}
+		if (resend || now - last_sent >= INTERVAL_MS) {
+			n += inject(out + n);
+			last_sent = now;
+			resend = false;
+		}
+		if (keep[pid]) {
+			memcpy(out + n, p, 188);
+			n += 188;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	*used = i;
+	return n;
+}
+
+int RecSpts::pump(cMmapRing *src, int timeout)
+{
+	uint8_t *in;
+	uint8_t *out;
+	int room = ring->reserve(&out);
+	if (room < 188 + REC_SPTS_RESERVE) {
+		errno = EAGAIN;
+		return -1;
+	}
+	int len = src->peek(&in, timeout, 188);
+	if (len < 0)
+		return -1;
+	int used;
+	int n = convert(in, len, out, room, &used);
+	src->release(used);
+	if (n > 0)
+		ring->commit(n);
+	return n;
+}
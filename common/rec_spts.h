@@ -0,0 +1,87 @@
+/*
+ * single program transport stream for the recordings
+ *
+ * A recording of some PIDs still carries the PAT of the whole multiplex,
+ * so players have to probe all programs. With HAL_REC_SPTS=1, cRecord
+ * passes the demux data through RecSpts: the PAT is replaced by one with
+ * only the recorded service, the PMT by one with only the recorded
+ * streams, both repeated every 100 ms, and packets of PIDs which the new
+ * PMT does not reference are dropped.
+ *
+ * License: GPLv2 or later
+ */
+#ifndef __REC_SPTS_H__
+#define __REC_SPTS_H__
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <vector>
+
+#include "mmap_ring.h"
+
+/* the output ring needs this much more room than the packet that is
+ * converted: a PAT and a PMT of up to 6 packets may be put in front */
+#define REC_SPTS_RESERVE (8 * 188)
+
+class RecSpts
+{
+public:
+	/* NULL if not enabled. sid is the recorded service, 0 if unknown:
+	 * then it is the program whose PMT PID is recorded */
+	static RecSpts *create(uint16_t sid, int bufsize);
+	~RecSpts();
+	/* the PIDs which are recorded. PAT and PMT have to be among them */
+	void setPids(const std::vector<uint16_t> &pids);
+	/* the PMT PID of the service, from the PAT. -1 if not known yet */
+	int getPmtPid(void);
+	/* where the rewritten stream goes, to be written to the file */
+	cMmapRing *getRing(void) { return ring; };
+	/* move data from src (the demux ring) into the own ring. Waits up
+	 * to timeout ms for data, returns the number of bytes produced or
+	 * -1 and errno, EAGAIN if there is nothing to do */
+	int pump(cMmapRing *src, int timeout);
+	/* the same for a buffer: converts whole packets while there is room
+	 * for them, returns the length of the output, *used is the input
+	 * that was consumed */
+	int convert(const uint8_t *in, int len, uint8_t *out, int room, int *used);
+private:
+	struct section {
+		uint8_t data[1024 + 184];
+		int fill;
+		bool sync;
+	};
+	RecSpts(uint16_t sid, cMmapRing *ring);
+	cMmapRing *ring;
+	pthread_mutex_t lock;
+	uint16_t sid;
+	bool sid_guessed;	/* not from cRecord::Start() */
+	int pmt_pid;		/* -1 until found in the PAT */
+	int pcr_pid;
+	uint16_t tsid;
+	bool ready;		/* PAT and PMT are there, rewriting */
+	bool resend;		/* PAT / PMT changed, insert now */
+	int64_t last_sent;
+	uint8_t recorded[0x2000];	/* by setPids() */
+	uint8_t keep[0x2000];		/* referenced by the new PMT */
+	section pat_in;
+	section pmt_in;
+	std::vector<uint8_t> pmt_orig;	/* the last original PMT section */
+	std::vector<uint8_t> pmt_body;	/* the new one, without version and CRC */
+	int pat_version;
+	int pmt_version;
+	uint8_t pat_out[188];
+	uint8_t pmt_out[6 * 188];
+	int pmt_pkts;
+	uint8_t pat_cc;
+	uint8_t pmt_cc;
+
+	void collect(section *s, const uint8_t *p, bool pat);
+	void parse_pat(const uint8_t *sec, int len);
+	void parse_pmt(const uint8_t *sec, int len);
+	void build_pat(void);
+	void build_pmt(void);
+	static int packetize(uint16_t pid, const uint8_t *sec, int len, uint8_t *out);
+	int inject(uint8_t *out);
+};
+
+#endif
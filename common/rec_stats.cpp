@@ -0,0 +1,127 @@
+/*
+ * counters of a recording, for cRecord::GetStats()
+ *
+ * The write latency is measured by the record thread, from handing the
+ * write to the kernel until it sees it completed.
+ *
+ * License: GPLv2 or later
+ */
+#include <stdio.h>
+#include <time.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "rec_stats.h"
+#include "lt_debug.h"
+#include "hal_time.h"
+
+RecStats::RecStats()
+{
+	pthread_mutex_init(&lock, NULL);
+	reset();
+	const char *e = getenv("HAL_REC_STATS");
+	interval = e ? (int64_t)atoi(e) * 1000000 : 0;
+	last_dump = now_us();
+}
+
+RecStats::~RecStats()
+{
+	pthread_mutex_destroy(&lock);
+}
+
+void RecStats::reset(void)
+{
+	pthread_mutex_lock(&lock);
+	memset(&s, 0, sizeof(s));
+	window_bytes = 0;
+	window_start = now_us();
+	pthread_mutex_unlock(&lock);
+}
+
+/* call with lock held */
+void RecStats::update_bitrate(int64_t now)
+{
+	int64_t elapsed = now - window_start;
+	if (elapsed < 1000000)
+		return;
+	s.bitrate = (unsigned int)(window_bytes * 8 * 1000000 / elapsed);
+	window_bytes = 0;
+	window_start = now;
+}
+
+void RecStats::read(int len)
+{
+	pthread_mutex_lock(&lock);
+	s.bytes_read += len;
+	window_bytes += len;
+	update_bitrate(now_us());
+	pthread_mutex_unlock(&lock);
+}
+
+void RecStats::written(int len, int64_t start)
+{
+	unsigned int ms = (now_us() - start) / 1000;
+	int i = 0;
+	while (i < REC_STATS_BUCKETS - 1 && ms >= 1U << (2 * i))
+		i++;
+	pthread_mutex_lock(&lock);
+	s.bytes_written += len;
+	s.latency[i]++;
+	if (ms > s.latency_max)
+		s.latency_max = ms;
+	pthread_mutex_unlock(&lock);
+}
+
+void RecStats::fill(int64_t bytes, int size)
+{
+	pthread_mutex_lock(&lock);
+	s.buffer_size = size;
+	if (bytes > s.buffer_max)
+		s.buffer_max = bytes;
+	pthread_mutex_unlock(&lock);
+}
+
+void RecStats::overflow(void)
+{
+	pthread_mutex_lock(&lock);
+	s.overflows++;
+	memmove(s.overflow_time + 1, s.overflow_time, sizeof(time_t) * (REC_STATS_EVENTS - 1));
+	s.overflow_time[0] = time(NULL);
+	pthread_mutex_unlock(&lock);
+}
+
+void RecStats::lost(unsigned int count)
+{
+	pthread_mutex_lock(&lock);
+	s.lost = count;
+	pthread_mutex_unlock(&lock);
+}
+
+void RecStats::get(rec_stats *stats)
+{
+	pthread_mutex_lock(&lock);
+	/* if the data stopped, the bitrate must drop, too */
+	update_bitrate(now_us());
+	*stats = s;
+	pthread_mutex_unlock(&lock);
+}
+
+void RecStats::dump(const void *owner)
+{
+	int64_t now = now_us();
+	if (!interval || now - last_dump < interval)
+		return;
+	last_dump = now;
+	rec_stats t;
+	get(&t);
+	char hist[REC_STATS_BUCKETS * 11 + 1];
+	int n = 0;
+	for (int i = 0; i < REC_STATS_BUCKETS; i++)
+		n += snprintf(hist + n, sizeof(hist) - n, " %u", t.latency[i]);
+	_lt_info(HAL_DEBUG_RECORD, owner, "%s: read %llu kB, written %llu kB, %u kbit/s, "
+		"buffer max %lld kB of %d kB, overflows %u, lost %u, write ms max %u, histogram%s\n",
+		__func__, (unsigned long long)t.bytes_read >> 10, (unsigned long long)t.bytes_written >> 10,
+		t.bitrate / 1000, (long long)t.buffer_max >> 10, t.buffer_size >> 10,
+		t.overflows, t.lost, t.latency_max, hist);
+}
@@ -0,0 +1,45 @@
+/*
+ * counters of a recording, for cRecord::GetStats()
+ *
+ * License: GPLv2 or later
+ */
+#ifndef __REC_STATS_H__
+#define __REC_STATS_H__
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "record_hal.h"
+
+class RecStats
+{
+public:
+	RecStats();
+	~RecStats();
+	void reset(void);
+	/* len new bytes to write */
+	void read(int len);
+	/* a write of len bytes which was started at start (now_us()) has
+	 * completed */
+	void written(int len, int64_t start);
+	/* the bytes in memory now, size is what fits into the ring */
+	void fill(int64_t bytes, int size);
+	/* the buffer ran full */
+	void overflow(void);
+	/* the total of demux buffer overflows */
+	void lost(unsigned int count);
+	void get(rec_stats *stats);
+	/* log the counters every HAL_REC_STATS seconds, owner for lt_info */
+	void dump(const void *owner);
+private:
+	rec_stats s;
+	uint64_t window_bytes;
+	int64_t window_start;
+	int64_t interval;	/* of dump(), 0 == never */
+	int64_t last_dump;
+	pthread_mutex_t lock;
+
+	void update_bitrate(int64_t now);
+};
+
+#endif
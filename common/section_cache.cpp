@@ -0,0 +1,73 @@
+/*
+ * version aware PSI / SI section cache
+ *
+ * License: GPLv2 or later
+ */
+#include <pthread.h>
+#include <cstdlib>
+
+#include "section_cache.h"
+#include "lt_debug.h"
+
+#define lt_info_c(args...) _lt_info(HAL_DEBUG_DEMUX, NULL, args)
+
+static pthread_mutex_t version_lock = PTHREAD_MUTEX_INITIALIZER;
+/* (pid, table_id, table_id_extension) => version_number */
+static std::map<uint64_t, uint8_t> versions;
+static int enabled = -1; /* not yet checked */
+
+void cSectionCache::Enable(bool on)
+{
+	lt_info_c("%s: %d\n", __func__, on);
+	enabled = on;
+}
+
+bool cSectionCache::Enabled(void)
+{
+	if (enabled < 0)
+		enabled = !!getenv("HAL_DMX_SECTION_CACHE");
+	return enabled;
+}
+
+int cSectionCache::GetVersion(unsigned short pid, unsigned char table_id, unsigned short ext)
+{
+	int ret = -1;
+	uint64_t key = ((uint64_t)(pid & 0x1fff) << 32) | (table_id << 16) | ext;
+	pthread_mutex_lock(&version_lock);
+	std::map<uint64_t, uint8_t>::iterator i = versions.find(key);
+	if (i != versions.end())
+		ret = i->second;
+	pthread_mutex_unlock(&version_lock);
+	return ret;
+}
+
+bool cSectionCache::Seen(uint16_t pid, const uint8_t *sec, int len)
+{
+	/* only the long form has version and section number, and all
+	 * sections with that have a CRC_32 */
+	if (len < 12 || !(sec[1] & 0x80))
+		return false;
+	uint8_t tid = sec[0];
+	uint16_t ext = (sec[3] << 8) | sec[4];
+	uint8_t version = (sec[5] >> 1) & 0x1f;
+	uint8_t secnum = sec[6];
+	const uint8_t *c = sec + len - 4;
+	uint32_t crc = (c[0] << 24) | (c[1] << 16) | (c[2] << 8) | c[3];
+
+	if (sec[5] & 0x01) { /* current_next_indicator: a "next" table does not count */
+		uint64_t vkey = ((uint64_t)(pid & 0x1fff) << 32) | (tid << 16) | ext;
+		pthread_mutex_lock(&version_lock);
+		versions[vkey] = version;
+		pthread_mutex_unlock(&version_lock);
+	}
+
+	/* one entry per section: a new version replaces the old one */
+	uint64_t key = ((uint64_t)(pid & 0x1fff) << 32) | ((uint64_t)tid << 24) | (ext << 8) | secnum;
+	uint64_t val = ((uint64_t)version << 32) | crc;
+	std::map<uint64_t, uint64_t>::iterator i = sections.find(key);
+	if (i != sections.end() && i->second == val)
+		return true;
+	/* new, or changed with or without a version update */
+	sections[key] = val;
+	return false;
+}
@@ -0,0 +1,397 @@
+/*
+ * TS streaming server, a recording to the network
+ *
+ * One thread per stream waits for demux data (like the record thread),
+ * write()s them into a pipe and tee()s that to one pipe per client, from
+ * which they are splice()d to the client's socket. That is one copy for
+ * all clients. vmsplice() of the demux ring itself would be none, but the
+ * ring reuses the pages while the sockets might still send from them.
+ * A client which cannot take the data as fast as they come is dropped,
+ * the stream is not held up for it.
+ *
+ * License: GPLv2 or later
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <config.h>
+#include "stream_hal.h"
+#include "dmx_hal.h"
+#include "mmap_ring.h"
+#include "lt_debug.h"
+#include "hal_time.h"
+
+#define lt_debug(args...) _lt_debug(HAL_DEBUG_RECORD, this, args)
+#define lt_info(args...) _lt_info(HAL_DEBUG_RECORD, this, args)
+
+#define BUFSIZE (2 << 20) /* 2MB */
+#define MAX_CLIENTS 8
+/* per client: this much may wait for the socket, else it is dropped */
+#define CLIENT_PIPESIZE (1 << 20) /* 1MB */
+/* wait up to WAIT_MS for this much data, fewer but bigger tee()s */
+#define CHUNK (348 * 188)
+#define WAIT_MS 20
+/* a client that has not sent a request by then gets raw TS */
+#define REQUEST_MS 500
+
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#endif
+
+static const char http_reply[] =
+	"HTTP/1.0 200 OK\r\n"
+	"Content-Type: video/mp2t\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+class StreamData
+{
+public:
+	StreamData(int num) {
+		dmx = NULL;
+		dmx_num = num;
+		listen_fd = -1;
+		null_fd = -1;
+		pipe_fd[0] = pipe_fd[1] = -1;
+		thread_running = false;
+		running = false;
+		clients = 0;
+	}
+	struct client {
+		int fd;
+		int pipe_fd[2];
+		int pending;		/* bytes in the pipe */
+		bool streaming;		/* request done */
+		int64_t since;
+		char name[32];
+	};
+	int dmx_num;
+	cDemux *dmx;
+	int listen_fd;
+	int null_fd;
+	int pipe_fd[2];
+	pthread_t thread;
+	bool thread_running;
+	volatile bool running;
+	volatile int clients;
+	std::vector<client> cl;
+	void StreamThread();
+	void Accept(void);
+	void Request(client &c);
+	int Send(const uint8_t *data, int len);
+	bool Flush(client &c);
+	void Drop(unsigned int i, const char *why);
+};
+
+#if !HAVE_TRIPLEDRAGON
+static void *execute_stream_thread(void *c)
+{
+	StreamData *obj = (StreamData *)c;
+	obj->StreamThread();
+	return NULL;
+}
+#endif
+
+cStream::cStream(int num)
+{
+	lt_info("%s %d\n", __func__, num);
+	pd = new StreamData(num);
+}
+
+cStream::~cStream()
+{
+	Stop();
+	delete pd;
+	pd = NULL;
+}
+
+bool cStream::Start(int port, unsigned short vpid, unsigned short *apids, int numapids)
+{
+	lt_info("%s: port %d, vpid 0x%03x\n", __func__, port, vpid);
+#if HAVE_TRIPLEDRAGON
+	/* no cMmapRing from the demux, no splice() in the kernel */
+	lt_info("%s: not supported on this box\n", __func__);
+	(void)apids;
+	(void)numapids;
+	return false;
+#else
+	if (pd->thread_running) {
+		lt_info("%s: already running\n", __func__);
+		return false;
+	}
+	int fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		lt_info("%s: socket: %m\n", __func__);
+		return false;
+	}
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, MAX_CLIENTS)) {
+		lt_info("%s: port %d: %m\n", __func__, port);
+		close(fd);
+		return false;
+	}
+	if (pipe2(pd->pipe_fd, O_CLOEXEC|O_NONBLOCK)) {
+		lt_info("%s: pipe: %m\n", __func__);
+		close(fd);
+		return false;
+	}
+	fcntl(pd->pipe_fd[1], F_SETPIPE_SZ, CHUNK);
+	pd->null_fd = open("/dev/null", O_WRONLY|O_CLOEXEC);
+	pd->listen_fd = fd;
+
+	if (!pd->dmx)
+		pd->dmx = new cDemux(pd->dmx_num);
+	pd->dmx->Open(DMX_TP_CHANNEL, NULL, BUFSIZE);
+	pd->dmx->pesFilter(vpid);
+	for (int i = 0; i < numapids; i++)
+		pd->dmx->addPid(apids[i]);
+
+	int ret = ENOMEM;
+	pd->running = true;
+	if (pd->dmx->getBuffer())
+		ret = pthread_create(&pd->thread, 0, execute_stream_thread, pd);
+	if (ret) {
+		errno = ret;
+		lt_info("%s: error creating thread! (%m)\n", __func__);
+		pd->running = false;
+		Stop();
+		return false;
+	}
+	pd->thread_running = true;
+	return true;
+#endif
+}
+
+bool cStream::Stop(void)
+{
+	lt_info("%s\n", __func__);
+	pd->running = false;
+	if (pd->thread_running)
+		pthread_join(pd->thread, NULL);
+	pd->thread_running = false;
+	delete pd->dmx;
+	pd->dmx = NULL;
+	if (pd->listen_fd > -1)
+		close(pd->listen_fd);
+	pd->listen_fd = -1;
+	if (pd->null_fd > -1)
+		close(pd->null_fd);
+	pd->null_fd = -1;
+	for (int i = 0; i < 2; i++) {
+		if (pd->pipe_fd[i] > -1)
+			close(pd->pipe_fd[i]);
+		pd->pipe_fd[i] = -1;
+	}
+	return true;
+}
+
+bool cStream::AddPid(unsigned short pid)
+{
+	lt_info("%s: 0x%04x\n", __func__, pid);
+	if (!pd->dmx) {
+		lt_info("%s: DMX = NULL\n", __func__);
+		return false;
+	}
+	return pd->dmx->addPid(pid);
+}
+
+int cStream::GetClients(void)
+{
+	return pd->clients;
+}
+
+#if !HAVE_TRIPLEDRAGON
+void StreamData::Accept(void)
+{
+	struct sockaddr_in addr;
+	socklen_t alen = sizeof(addr);
+	int fd;
+	while ((fd = accept4(listen_fd, (struct sockaddr *)&addr, &alen, SOCK_CLOEXEC|SOCK_NONBLOCK)) > -1) {
+		client c;
+		snprintf(c.name, sizeof(c.name), "%s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+		if (cl.size() >= MAX_CLIENTS) {
+			lt_info("%s: %s: too many clients\n", __func__, c.name);
+			close(fd);
+			continue;
+		}
+		if (pipe2(c.pipe_fd, O_CLOEXEC|O_NONBLOCK)) {
+			lt_info("%s: %s: pipe: %m\n", __func__, c.name);
+			close(fd);
+			continue;
+		}
+		if (fcntl(c.pipe_fd[1], F_SETPIPE_SZ, CLIENT_PIPESIZE) < 0)
+			lt_debug("%s: F_SETPIPE_SZ: %m\n", __func__);
+		c.fd = fd;
+		c.pending = 0;
+		c.streaming = false;
+		c.since = now_ms();
+		cl.push_back(c);
+		clients = cl.size();
+		lt_info("%s: %s connected, %d clients\n", __func__, c.name, clients);
+		alen = sizeof(addr);
+	}
+}
+
+/* a HTTP request gets a HTTP reply, anything else nothing */
+void StreamData::Request(client &c)
+{
+	char buf[1024];
+	ssize_t n = recv(c.fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0 || c.streaming)
+		return;
+	buf[n] = 0;
+	c.streaming = true;
+	if (strncmp(buf, "GET ", 4))
+		return;
+	lt_debug("%s: %s: %s", __func__, c.name, buf);
+	if (send(c.fd, http_reply, sizeof(http_reply) - 1, MSG_NOSIGNAL) != sizeof(http_reply) - 1)
+		lt_info("%s: %s: send: %m\n", __func__, c.name);
+}
+
+void StreamData::Drop(unsigned int i, const char *why)
+{
+	lt_info("%s: %s: %s\n", __func__, cl[i].name, why);
+	close(cl[i].fd);
+	close(cl[i].pipe_fd[0]);
+	close(cl[i].pipe_fd[1]);
+	cl.erase(cl.begin() + i);
+	clients = cl.size();
+}
+
+/* false if the client is gone */
+bool StreamData::Flush(client &c)
+{
+	while (c.pending > 0) {
+		ssize_t n = splice(c.pipe_fd[0], NULL, c.fd, NULL, c.pending, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (n < 0)
+			return errno == EAGAIN;
+		if (n == 0)
+			break;
+		c.pending -= n;
+	}
+	return true;
+}
+
+/* returns how much of data was sent */
+int StreamData::Send(const uint8_t *data, int len)
+{
+	ssize_t n = write(pipe_fd[1], data, len);
+	if (n <= 0) {
+		lt_info("%s: write: %m\n", __func__);
+		return len;	/* do not get stuck */
+	}
+	int ret = n;
+	for (unsigned int i = 0; i < cl.size(); i++) {
+		if (!cl[i].streaming)
+			continue;
+		/* all or nothing, the clients must not miss parts of a packet */
+		ssize_t t = tee(pipe_fd[0], cl[i].pipe_fd[1], n, SPLICE_F_NONBLOCK);
+		if (t != n) {
+			Drop(i--, t < 0 ? "too slow" : "too slow, partial data");
+			continue;
+		}
+		cl[i].pending += n;
+		if (!Flush(cl[i]))
+			Drop(i--, "connection lost");
+	}
+	/* tee() did not consume it */
+	while (n > 0) {
+		ssize_t r = splice(pipe_fd[0], NULL, null_fd, NULL, n, 0);
+		if (r <= 0) {
+			uint8_t buf[4096];
+			r = read(pipe_fd[0], buf, n < (ssize_t)sizeof(buf) ? n : sizeof(buf));
+			if (r <= 0)
+				break;
+		}
+		n -= r;
+	}
+	return ret;
+}
+
+void StreamData::StreamThread()
+{
+	lt_info("%s: begin\n", __func__);
+	hal_set_threadname("hal:stream");
+	/* splice() to a closed socket raises SIGPIPE in this thread */
+	sigset_t sigpipe;
+	sigemptyset(&sigpipe);
+	sigaddset(&sigpipe, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+	struct timespec zero = { 0, 0 };
+
+	cMmapRing *ring = (cMmapRing *)dmx->getBuffer();
+	dmx->Start();
+	while (running)
+	{
+		uint8_t *data;
+		int len = ring->peek(&data, WAIT_MS, CHUNK);
+		if (len < 0 && errno != EAGAIN)
+			lt_info("%s: read failed: %m\n", __func__);
+		if (len > 0)
+		{
+			if (len > CHUNK)
+				len = CHUNK;
+			/* nobody is watching: drop it */
+			if (!cl.empty())
+				len = Send(data, len);
+			ring->release(len);
+		}
+
+		std::vector<struct pollfd> pfd(cl.size() + 1);
+		pfd[0].fd = listen_fd;
+		pfd[0].events = POLLIN;
+		for (unsigned int i = 0; i < cl.size(); i++) {
+			pfd[i + 1].fd = cl[i].fd;
+			pfd[i + 1].events = POLLIN;
+			if (cl[i].pending)
+				pfd[i + 1].events |= POLLOUT;
+		}
+		if (poll(&pfd[0], pfd.size(), 0) < 0)
+			continue;
+		/* backwards, Drop() moves the later ones */
+		for (int i = cl.size() - 1; i >= 0; i--) {
+			short ev = pfd[i + 1].revents;
+			client &c = cl[i];
+			if (ev & (POLLERR|POLLHUP))
+				Drop(i, "connection closed");
+			else if ((ev & POLLOUT) && !Flush(c))
+				Drop(i, "connection lost");
+			else if (ev & POLLIN) {
+				char buf[1];
+				if (recv(c.fd, buf, 1, MSG_PEEK) <= 0)
+					Drop(i, "connection closed");
+				else
+					Request(c);
+			}
+			else if (!c.streaming && now_ms() - c.since > REQUEST_MS)
+				c.streaming = true;	/* no request: raw TS */
+		}
+		if (pfd[0].revents & POLLIN)
+			Accept();
+		sigtimedwait(&sigpipe, NULL, &zero);
+	}
+	dmx->Stop();
+	while (!cl.empty())
+		Drop(cl.size() - 1, "stopped");
+	lt_info("%s: end\n", __func__);
+}
+#endif
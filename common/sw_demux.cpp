@@ -0,0 +1,865 @@
+/*
+ * userspace transport stream demultiplexer
+ *
+ * The semantics try to follow the linux dvb_demux / dmxdev code as close
+ * as possible, so that cDemux users cannot tell the difference:
+ *  - packets with transport_error_indicator set are dropped
+ *  - PES output starts at the first payload_unit_start_indicator and is
+ *    restarted after a continuity counter error
+ *  - section filters use filter / mask / mode just like DMX_SET_FILTER
+ *  - a full buffer results in one read() returning EOVERFLOW
+ *  - a section filter timeout results in one read() returning ETIMEDOUT
+ *
+ * License: GPLv2 or later
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include <config.h>
+#if !HAVE_TRIPLEDRAGON
+#include <linux/dvb/dmx.h>
+#endif
+
+#include "sw_demux.h"
+#include "dmx_reactor.h"
+#include "crc32.h"
+#include "ts_scan.h"
+#include "lt_debug.h"
+#include "hal_time.h"
+
+#define lt_debug(args...) _lt_debug(HAL_DEBUG_DEMUX, this, args)
+#define lt_info(args...) _lt_info(HAL_DEBUG_DEMUX, this, args)
+#define lt_info_c(args...) _lt_info(HAL_DEBUG_DEMUX, NULL, args)
+
+/* 348 packets, ~64kB */
+#define SWDMX_READSIZE (348 * 188)
+/* kernel buffer of a shared demux, which carries all shared PIDs */
+#define SWDMX_SHARE_BUFSIZE (1024 * 1024)
+/* same, if it also carries the recordings (HAL_REC_HUB) */
+#define SWDMX_HUB_BUFSIZE (4 * 1024 * 1024)
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<SWDemux *> registry;
+
+SWFilter::SWFilter(SWDemux *d, swdmx_output_t type, int bufsize)
+{
+	dmx = d;
+	output = type;
+	running = false;
+	pes_started = false;
+	doneq = false;
+	check_crc = false;
+	timeout = 0;
+	started = 0;
+	got_data = false;
+	run = NULL;
+	run_len = 0;
+	memset(filter_value, 0, sizeof(filter_value));
+	memset(maskandmode, 0, sizeof(maskandmode));
+	memset(maskandnotmode, 0, sizeof(maskandnotmode));
+	if (bufsize <= 0)
+		bufsize = 8192; /* dmxdev default */
+	ring = new cMmapRing(bufsize);
+	ring->setSections(type == SWDMX_OUT_SECTION);
+	cache = NULL;
+	if (type == SWDMX_OUT_SECTION && cSectionCache::Enabled())
+		cache = new cSectionCache();
+	pthread_mutex_init(&lock, NULL);
+	fd = ring->getFd();
+	if (fd < 0 || ring->getSize() == 0)
+		lt_info("%s: no ring buffer of %d bytes (%m)\n", __func__, bufsize);
+	pthread_mutex_lock(&dmx->lock);
+	dmx->filters.push_back(this);
+	pthread_mutex_unlock(&dmx->lock);
+}
+
+SWFilter::~SWFilter()
+{
+	ring->shutdown();
+
+	pthread_mutex_lock(&dmx->lock);
+	while (!pids.empty())
+		dmx->detach(this, pids.back());
+	for (std::vector<SWFilter *>::iterator i = dmx->filters.begin(); i != dmx->filters.end(); ++i) {
+		if (*i == this) {
+			dmx->filters.erase(i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&dmx->lock);
+
+	delete ring;
+	delete cache;
+	pthread_mutex_destroy(&lock);
+}
+
+/* call with lock held */
+void SWFilter::reset(void)
+{
+	ring->reset();
+	if (cache)
+		cache->Clear();
+}
+
+/* call with lock held */
+void SWFilter::set_error(int err)
+{
+	ring->setError(err);
+}
+
+bool SWFilter::setSection(uint16_t pid, const uint8_t *filter, const uint8_t *mask,
+			  const uint8_t *mode, int len, bool crc, int to)
+{
+	if (pid > SWDMX_MAX_PID)
+		return false;
+	if (len > SWDMX_FILTER_SIZE)
+		len = SWDMX_FILTER_SIZE;
+	pthread_mutex_lock(&dmx->lock);
+	while (!pids.empty())
+		dmx->detach(this, pids.back());
+	pthread_mutex_lock(&lock);
+	doneq = false;
+	for (int i = 0; i < SWDMX_FILTER_SIZE; i++) {
+		uint8_t m = (i < len) ? mask[i] : 0;
+		/* dmxdev inverts the mode passed by the user, dvb_demux then
+		 * uses "mask & mode" for positive and "mask & ~mode" for
+		 * negative matching. Do the same here. */
+		uint8_t md = (i < len && mode) ? ~mode[i] : 0xff;
+		filter_value[i] = (i < len) ? filter[i] : 0;
+		maskandmode[i] = m & md;
+		maskandnotmode[i] = m & ~md;
+		doneq |= !!maskandnotmode[i];
+	}
+	check_crc = crc;
+	timeout = to;
+	reset();
+	got_data = false;
+	started = now_ms();
+	running = true; /* DMX_IMMEDIATE_START */
+	pthread_mutex_unlock(&lock);
+	dmx->attach(this, pid);
+	if (timeout > 0)
+		dmx->arm_timeout(started + timeout + 1);
+	pthread_mutex_unlock(&dmx->lock);
+	return true;
+}
+
+bool SWFilter::setPid(uint16_t pid)
+{
+	if (pid > SWDMX_MAX_PID)
+		return false;
+	pthread_mutex_lock(&dmx->lock);
+	while (!pids.empty())
+		dmx->detach(this, pids.back());
+	dmx->attach(this, pid);
+	pthread_mutex_unlock(&dmx->lock);
+	return true;
+}
+
+bool SWFilter::addPid(uint16_t pid)
+{
+	if (pid > SWDMX_MAX_PID || output != SWDMX_OUT_TS)
+		return false;
+	pthread_mutex_lock(&dmx->lock);
+	dmx->attach(this, pid);
+	pthread_mutex_unlock(&dmx->lock);
+	return true;
+}
+
+bool SWFilter::removePid(uint16_t pid)
+{
+	bool ret = false;
+	pthread_mutex_lock(&dmx->lock);
+	for (std::vector<uint16_t>::iterator i = pids.begin(); i != pids.end(); ++i) {
+		if (*i == pid) {
+			dmx->detach(this, pid);
+			ret = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&dmx->lock);
+	return ret;
+}
+
+void SWFilter::start(void)
+{
+	int64_t deadline = 0;
+	pthread_mutex_lock(&lock);
+	if (!running) {
+		reset();
+		pes_started = false;
+		got_data = false;
+		started = now_ms();
+		running = true;
+		if (output == SWDMX_OUT_SECTION && timeout > 0)
+			deadline = started + timeout + 1;
+	}
+	pthread_mutex_unlock(&lock);
+	if (deadline) {
+		pthread_mutex_lock(&dmx->lock);
+		dmx->arm_timeout(deadline);
+		pthread_mutex_unlock(&dmx->lock);
+	}
+}
+
+void SWFilter::stop(void)
+{
+	pthread_mutex_lock(&lock);
+	running = false;
+	pthread_mutex_unlock(&lock);
+}
+
+/* dvb_dmx_swfilter_sectionfilter(): the two section_length bytes are skipped */
+bool SWFilter::match(const uint8_t *sec, int len)
+{
+	uint8_t neq = 0;
+	for (int i = 0; i < SWDMX_FILTER_SIZE; i++) {
+		int j = i ? i + 2 : 0;
+		uint8_t x = filter_value[i] ^ ((j < len) ? sec[j] : 0);
+		if (maskandmode[i] & x)
+			return false;
+		neq |= maskandnotmode[i] & x;
+	}
+	if (doneq && !neq)
+		return false;
+	return true;
+}
+
+/* called from the demux thread with dmx->lock held */
+void SWFilter::push(const uint8_t *data, int len)
+{
+	pthread_mutex_lock(&lock);
+	if (running && ring->write(data, len))
+		got_data = true;
+	pthread_mutex_unlock(&lock);
+}
+
+/* called from the demux thread with dmx->lock held: extend the run of
+ * packets for this filter if p follows it directly, else write the old
+ * run and start a new one. false: there was no run, the caller has to
+ * add the filter to SWDemux::runs */
+bool SWFilter::queue(const uint8_t *p)
+{
+	if (run && run + run_len == p) {
+		run_len += 188;
+		return true;
+	}
+	bool had_run = run != NULL;
+	if (had_run)
+		push(run, run_len);
+	run = p;
+	run_len = 188;
+	return had_run;
+}
+
+/* same, but drop sections this filter already delivered */
+void SWFilter::push_section(uint16_t pid, const uint8_t *sec, int len)
+{
+	pthread_mutex_lock(&lock);
+	if (running && !(cache && cache->Seen(pid, sec, len))) {
+		if (ring->write(sec, len))
+			got_data = true;
+		else if (cache)
+			cache->Clear(); /* overflow flushes the ring: deliver everything again */
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+int SWFilter::read(uint8_t *dst, int len, bool block)
+{
+	return ring->read(dst, len, block ? -1 : 0);
+}
+
+SWDemux::SWDemux(const std::string &source, int fd, bool kernel_share)
+	: packets(packet_cb, this)
+{
+	src = source;
+	in_fd = fd;
+	share = kernel_share;
+	kpids = 0;
+	refcount = 1;
+	thread_running = false;
+	reactor_id = -1;
+	next_timeout = 0;
+	rbuf = (uint8_t *)malloc(SWDMX_READSIZE);
+	paced = false;
+	pace_rate = 0;
+	pace_start = 0;
+	pace_bytes = 0;
+	pcr_pid = -1;
+	pcr_first = -1;
+	pcr_last = 0;
+	pace_until = 0;
+	memset(pid_table, 0, sizeof(pid_table));
+	pthread_mutex_init(&lock, NULL);
+}
+
+SWDemux::~SWDemux()
+{
+	if (__atomic_load_n(&thread_running, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&thread_running, false, __ATOMIC_RELAXED);
+		pthread_join(thread, NULL);
+	}
+	if (reactor_id > 0)
+		DmxReactor::get()->remove(reactor_id);
+	free(rbuf);
+	if (in_fd > -1 && src.compare(0, 3, "fd:"))
+		close(in_fd);
+	for (int i = 0; i <= SWDMX_MAX_PID; i++)
+		delete pid_table[i];
+	pthread_mutex_destroy(&lock);
+}
+
+SWDemux *SWDemux::get(const char *source)
+{
+	SWDemux *ret = NULL;
+	struct stat st;
+	int fd = -1;
+	bool share = false;
+	pthread_mutex_lock(&registry_lock);
+	for (std::vector<SWDemux *>::iterator i = registry.begin(); i != registry.end(); ++i) {
+		if ((*i)->src == source) {
+			ret = *i;
+			ret->refcount++;
+			goto out;
+		}
+	}
+	if (!strncmp(source, "fd:", 3))
+		fd = atoi(source + 3);
+	else if (!strncmp(source, "udp://", 6)) {
+		struct sockaddr_in a;
+		std::string host(source + 6);
+		std::string::size_type colon = host.rfind(':');
+		int one = 1;
+		int rcvbuf = 4 << 20;
+		memset(&a, 0, sizeof(a));
+		a.sin_family = AF_INET;
+		a.sin_addr.s_addr = htonl(INADDR_ANY);
+		if (colon == std::string::npos) {
+			lt_info_c("%s: no port in '%s'\n", __func__, source);
+			goto out;
+		}
+		a.sin_port = htons(atoi(host.c_str() + colon + 1));
+		host.erase(colon);
+		if (!host.empty() && !inet_aton(host.c_str(), &a.sin_addr)) {
+			lt_info_c("%s: invalid address in '%s'\n", __func__, source);
+			goto out;
+		}
+		fd = socket(AF_INET, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			goto err;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+		if (bind(fd, (struct sockaddr *)&a, sizeof(a)) < 0) {
+			close(fd);
+			fd = -1;
+			goto err;
+		}
+		if (IN_MULTICAST(ntohl(a.sin_addr.s_addr))) {
+			struct ip_mreq mreq;
+			mreq.imr_multiaddr = a.sin_addr;
+			mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+			if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+				lt_info_c("%s: IP_ADD_MEMBERSHIP %s: %m\n", __func__, source);
+		}
+	}
+#if !HAVE_TRIPLEDRAGON
+	else if (!strncmp(source, "share:", 6)) {
+		int size = getenv("HAL_REC_HUB") ? SWDMX_HUB_BUFSIZE : SWDMX_SHARE_BUFSIZE;
+		fd = open(source + 6, O_RDWR|O_CLOEXEC|O_NONBLOCK);
+		if (fd > -1 && ioctl(fd, DMX_SET_BUFFER_SIZE, size) < 0)
+			lt_info_c("%s: DMX_SET_BUFFER_SIZE %s: %m\n", __func__, source);
+		share = true;
+	}
+#endif
+	else
+		fd = open(source, O_RDONLY|O_CLOEXEC);
+ err:
+	if (fd < 0) {
+		lt_info_c("%s: cannot open '%s': %m\n", __func__, source);
+		goto out;
+	}
+	ret = new SWDemux(source, fd, share);
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		/* a file would be read in no time: pace it like a live source */
+		const char *rate = getenv("HAL_SWDEMUX_RATE");
+		ret->paced = !rate || atoi(rate) > 0;
+		ret->pace_rate = rate ? atoi(rate) : 0;
+		if (ret->pace_rate)
+			lt_info_c("%s: '%s' is a file, read at %u kbit/s\n", __func__, source, ret->pace_rate);
+		else if (!ret->paced)
+			lt_info_c("%s: '%s' is a file, HAL_SWDEMUX_RATE=0: not paced\n", __func__, source);
+	}
+	if (DmxReactor::get() && !ret->paced) {
+		/* fails for regular files, which then get their own thread */
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		ret->reactor_id = DmxReactor::get()->add(fd, reactor_cb, ret);
+	}
+	if (ret->reactor_id < 0)
+		ret->thread_running = true;
+	if (ret->thread_running && pthread_create(&ret->thread, NULL, run_thread, ret)) {
+		lt_info_c("%s: pthread_create: %m\n", __func__);
+		ret->thread_running = false;
+		delete ret;
+		ret = NULL;
+		goto out;
+	}
+	registry.push_back(ret);
+	lt_info_c("%s: opened '%s' fd %d\n", __func__, source, fd);
+ out:
+	pthread_mutex_unlock(&registry_lock);
+	return ret;
+}
+
+void SWDemux::put(void)
+{
+	pthread_mutex_lock(&registry_lock);
+	if (--refcount > 0) {
+		pthread_mutex_unlock(&registry_lock);
+		return;
+	}
+	for (std::vector<SWDemux *>::iterator i = registry.begin(); i != registry.end(); ++i) {
+		if (*i == this) {
+			registry.erase(i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&registry_lock);
+	delete this;
+}
+
+/* call with lock held */
+void SWDemux::attach(SWFilter *f, uint16_t pid)
+{
+	pid_data *pd = pid_table[pid];
+	if (!pd) {
+		pd = new pid_data;
+		pd->nsec = 0;
+		pd->cc = -1;
+		pd->sec_sync = false;
+		pd->sec_fill = 0;
+		pid_table[pid] = pd;
+		if (share)
+			kernel_pid(pid, true);
+	}
+	pd->filters.push_back(f);
+	if (f->output == SWDMX_OUT_SECTION)
+		pd->nsec++;
+	f->pids.push_back(pid);
+	lt_debug("%s: pid 0x%04x, %d filters\n", __func__, pid, (int)pd->filters.size());
+}
+
+/* call with lock held */
+void SWDemux::detach(SWFilter *f, uint16_t pid)
+{
+	pid_data *pd = pid_table[pid];
+	for (std::vector<uint16_t>::iterator i = f->pids.begin(); i != f->pids.end(); ++i) {
+		if (*i == pid) {
+			f->pids.erase(i);
+			break;
+		}
+	}
+	if (!pd)
+		return;
+	for (std::vector<SWFilter *>::iterator i = pd->filters.begin(); i != pd->filters.end(); ++i) {
+		if (*i == f) {
+			pd->filters.erase(i);
+			if (f->output == SWDMX_OUT_SECTION)
+				pd->nsec--;
+			break;
+		}
+	}
+	if (pd->filters.empty()) {
+		delete pd;
+		pid_table[pid] = NULL;
+		if (share)
+			kernel_pid(pid, false);
+	}
+}
+
+/* add or remove pid on the shared kernel demux. call with lock held */
+void SWDemux::kernel_pid(uint16_t pid, bool add)
+{
+#if HAVE_TRIPLEDRAGON
+	lt_info("%s: not supported on this box (pid 0x%04x)\n", __func__, pid);
+	(void)add;
+#else
+	int ret;
+	if (add && kpids == 0) {
+		/* the first PID (re)starts the filter, the others are added */
+		struct dmx_pes_filter_params p;
+		memset(&p, 0, sizeof(p));
+		p.pid = pid;
+		p.input = DMX_IN_FRONTEND;
+		p.output = DMX_OUT_TSDEMUX_TAP;
+		p.pes_type = DMX_PES_OTHER;
+		p.flags = DMX_IMMEDIATE_START;
+		ret = ioctl(in_fd, DMX_SET_PES_FILTER, &p);
+	}
+	else if (add)
+		ret = ioctl(in_fd, DMX_ADD_PID, &pid);
+	else if (kpids == 1)
+		ret = ioctl(in_fd, DMX_STOP);
+	else
+		ret = ioctl(in_fd, DMX_REMOVE_PID, &pid);
+	if (ret < 0)
+		lt_info("%s: %s pid 0x%04x on '%s' failed: %m\n", __func__,
+			add ? "add" : "remove", pid, src.c_str());
+	kpids += add ? 1 : -1;
+	lt_debug("%s: %s pid 0x%04x, %d kernel pids\n", __func__, add ? "add" : "remove", pid, kpids);
+#endif
+}
+
+/* a kernel buffer overflow loses data for everybody. call with lock held */
+void SWDemux::set_error(int err)
+{
+	for (std::vector<SWFilter *>::iterator i = filters.begin(); i != filters.end(); ++i) {
+		SWFilter *f = *i;
+		pthread_mutex_lock(&f->lock);
+		if (f->running && !f->pids.empty())
+			f->set_error(err);
+		pthread_mutex_unlock(&f->lock);
+	}
+	for (int i = 0; i <= SWDMX_MAX_PID; i++) {
+		if (pid_table[i]) {
+			pid_table[i]->cc = -1;
+			pid_table[i]->sec_sync = false;
+		}
+	}
+	packets.reset();
+}
+
+void SWDemux::feed(const uint8_t *data, int len)
+{
+	pthread_mutex_lock(&lock);
+	int skipped = packets.feed(data, len, 0);
+	if (skipped)
+		lt_debug("%s: resync, skipped %d bytes\n", __func__, skipped);
+	flush_runs();
+	pthread_mutex_unlock(&lock);
+}
+
+/* for TSPackets, with lock held */
+void SWDemux::packet_cb(void *priv, const uint8_t *p, int64_t, bool buffered)
+{
+	SWDemux *obj = (SWDemux *)priv;
+	obj->packet(p);
+	/* the runs must not point into the packet buffer of TSPackets */
+	if (buffered)
+		obj->flush_runs();
+}
+
+/* write the queued runs of TS packets into the rings. call with lock held */
+void SWDemux::flush_runs(void)
+{
+	for (std::vector<SWFilter *>::iterator i = runs.begin(); i != runs.end(); ++i) {
+		SWFilter *f = *i;
+		f->push(f->run, f->run_len);
+		f->run = NULL;
+		f->run_len = 0;
+	}
+	runs.clear();
+}
+
+/* call with lock held */
+void SWDemux::packet(const uint8_t *p)
+{
+	uint16_t pid = ((p[1] & 0x1f) << 8) | p[2];
+	pid_data *pd = pid_table[pid];
+	if (!pd)
+		return;
+	if (p[1] & 0x80) /* transport_error_indicator: data cannot be trusted */
+		return;
+
+	bool pusi = !!(p[1] & 0x40);
+	int afc = (p[3] >> 4) & 3;
+	const uint8_t *pl = p + 4;
+	int plen = 0;
+	bool discont = false;
+	bool dup = false;
+	if (afc & 1) {
+		int cc = p[3] & 0x0f;
+		plen = 184;
+		if (afc & 2) {
+			plen -= p[4] + 1;
+			pl += p[4] + 1;
+		}
+		if (pd->cc > -1) {
+			if (cc == pd->cc)
+				dup = true;
+			else if (cc != ((pd->cc + 1) & 0x0f))
+				discont = true;
+		}
+		pd->cc = cc;
+	}
+	if (plen < 0) /* invalid adaptation_field_length */
+		plen = 0;
+
+	for (std::vector<SWFilter *>::iterator i = pd->filters.begin(); i != pd->filters.end(); ++i) {
+		SWFilter *f = *i;
+		switch (f->output) {
+		case SWDMX_OUT_TS:
+			/* the recordings of a multiplex get lots of packets,
+			 * do not lock and signal their rings for each one */
+			if (!f->queue(p))
+				runs.push_back(f);
+			break;
+		case SWDMX_OUT_PES:
+			if (plen == 0 || dup)
+				break;
+			if (discont)
+				f->pes_started = false;
+			if (pusi)
+				f->pes_started = true;
+			if (f->pes_started)
+				f->push(pl, plen);
+			break;
+		default:
+			break;
+		}
+	}
+	if (pd->nsec > 0 && plen > 0 && !dup) {
+		if (discont)
+			pd->sec_sync = false;
+		section_data(pd, pid, pl, plen, pusi);
+	}
+}
+
+/* reassemble sections from TS payload. call with lock held */
+void SWDemux::section_data(pid_data *pd, uint16_t pid, const uint8_t *p, int len, bool pusi)
+{
+	if (pusi) {
+		int ptr = p[0];
+		p++;
+		len--;
+		if (ptr > len) {
+			lt_debug("%s: pid 0x%04x invalid pointer_field %d\n", __func__, pid, ptr);
+			pd->sec_sync = false;
+			return;
+		}
+		if (pd->sec_sync && pd->sec_fill + ptr <= (int)sizeof(pd->sec)) {
+			/* the end of the previous section */
+			memcpy(pd->sec + pd->sec_fill, p, ptr);
+			pd->sec_fill += ptr;
+			section_out(pd, pid, pd->sec, pd->sec_fill);
+		}
+		p += ptr;
+		len -= ptr;
+		pd->sec_fill = 0;
+		pd->sec_sync = true;
+	}
+	if (!pd->sec_sync)
+		return;
+	if (pd->sec_fill + len > (int)sizeof(pd->sec)) {
+		pd->sec_sync = false;
+		return;
+	}
+	memcpy(pd->sec + pd->sec_fill, p, len);
+	pd->sec_fill += len;
+	section_out(pd, pid, pd->sec, pd->sec_fill);
+}
+
+/* output all complete sections in sec, keep the rest. call with lock held */
+void SWDemux::section_out(pid_data *pd, uint16_t pid, const uint8_t *sec, int len)
+{
+	int off = 0;
+	while (len - off >= 3) {
+		const uint8_t *s = sec + off;
+		if (s[0] == 0xff) { /* stuffing: the rest of the packet is unused */
+			off = len;
+			break;
+		}
+		int seclen = 3 + (((s[1] & 0x0f) << 8) | s[2]);
+		if (seclen > 4096) {
+			pd->sec_sync = false;
+			off = len;
+			break;
+		}
+		if (len - off < seclen)
+			break;
+		int crc = -1; /* not yet calculated */
+		for (std::vector<SWFilter *>::iterator i = pd->filters.begin(); i != pd->filters.end(); ++i) {
+			SWFilter *f = *i;
+			if (f->output != SWDMX_OUT_SECTION || !f->running || !f->match(s, seclen))
+				continue;
+			if (f->check_crc) {
+				if (crc < 0)
+					crc = (dvb_crc32(s, seclen) == 0);
+				if (!crc)
+					continue;
+			}
+			f->push_section(pid, s, seclen);
+		}
+		off += seclen;
+	}
+	pd->sec_fill = len - off;
+	if (off > 0 && pd->sec_fill > 0)
+		memmove(pd->sec, sec + off, pd->sec_fill);
+}
+
+/* dmxdev stops a section filter which did not receive anything before
+ * its timeout expired and returns ETIMEDOUT on the next read() */
+void SWDemux::check_timeouts(void)
+{
+	int64_t now = now_ms();
+	int64_t next = 0;
+	pthread_mutex_lock(&lock);
+	for (std::vector<SWFilter *>::iterator i = filters.begin(); i != filters.end(); ++i) {
+		SWFilter *f = *i;
+		if (f->output != SWDMX_OUT_SECTION || f->timeout <= 0)
+			continue;
+		pthread_mutex_lock(&f->lock);
+		if (f->running && !f->got_data && now - f->started > f->timeout) {
+			lt_debug("%s: filter %p pid 0x%04x timed out\n", __func__, f,
+				 f->pids.empty() ? 0xffff : f->pids[0]);
+			f->running = false;
+			f->set_error(ETIMEDOUT);
+		}
+		else if (f->running && !f->got_data) {
+			int64_t t = f->started + f->timeout + 1;
+			if (!next || t < next)
+				next = t;
+		}
+		pthread_mutex_unlock(&f->lock);
+	}
+	if (reactor_id > 0) {
+		next_timeout = next;
+		DmxReactor::get()->setTimer(reactor_id, next);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* with the reactor, the timeouts are checked only when one can expire.
+ * call with lock held */
+void SWDemux::arm_timeout(int64_t when)
+{
+	if (reactor_id < 0 || (next_timeout && next_timeout <= when))
+		return;
+	next_timeout = when;
+	DmxReactor::get()->setTimer(reactor_id, when);
+}
+
+/* one read from the input. returns false if there will be no more data */
+bool SWDemux::read_input(void)
+{
+	ssize_t r = ::read(in_fd, rbuf, SWDMX_READSIZE);
+	if (r > 0) {
+		feed(rbuf, r);
+		if (paced)
+			pace(rbuf, r);
+	}
+	else if (r < 0 && errno == EOVERFLOW) {
+		lt_info("%s: '%s' overflow\n", __func__, src.c_str());
+		pthread_mutex_lock(&lock);
+		set_error(EOVERFLOW);
+		pthread_mutex_unlock(&lock);
+	}
+	else if ((r == 0 && !share) || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+		lt_info("%s: end of input '%s' (%m)\n", __func__, src.c_str());
+		return false;
+	}
+	return true;
+}
+
+/* when to read the next chunk of a regular file, from HAL_SWDEMUX_RATE
+ * or from the first PCR PID: a PCR jump of more than 5 seconds, a
+ * discontinuity or a wrap starts over with the current time */
+void SWDemux::pace(const uint8_t *data, int len)
+{
+	int64_t now = now_ms();
+	if (!pace_start)
+		pace_start = now;
+	if (pace_rate) {
+		pace_bytes += len;
+		pace_until = pace_start + (int64_t)(pace_bytes * 8 / pace_rate);
+		return;
+	}
+	int i = ts_find_sync(data, len, 188);
+	for (; i >= 0 && i + 188 <= len && data[i] == 0x47; i += 188) {
+		const uint8_t *p = data + i;
+		int pid = ((p[1] & 0x1f) << 8) | p[2];
+		/* adaptation field with PCR_flag */
+		if (!(p[3] & 0x20) || p[4] < 7 || !(p[5] & 0x10))
+			continue;
+		if (pcr_pid < 0) {
+			lt_info("%s: '%s' paced by the PCR of PID 0x%04x\n", __func__, src.c_str(), pid);
+			pcr_pid = pid;
+		}
+		if (pid != pcr_pid)
+			continue;
+		int64_t pcr = ((int64_t)p[6] << 25) | (p[7] << 17) | (p[8] << 9) | (p[9] << 1) | (p[10] >> 7);
+		if (pcr_first < 0 || pcr < pcr_last || pcr - pcr_last > 5 * 90000 || (p[5] & 0x80)) {
+			pace_start = now;
+			pcr_first = pcr;
+		}
+		pcr_last = pcr;
+	}
+	if (pcr_first >= 0)
+		pace_until = pace_start + (pcr_last - pcr_first) / 90;
+}
+
+void SWDemux::reactor_cb(void *priv, int, uint32_t events)
+{
+	SWDemux *obj = (SWDemux *)priv;
+	if (!events)
+		obj->check_timeouts();
+	else if (!obj->read_input())
+		DmxReactor::get()->unwatch(obj->reactor_id); /* but keep the timer */
+}
+
+void *SWDemux::run_thread(void *c)
+{
+	SWDemux *obj = (SWDemux *)c;
+	obj->run();
+	return NULL;
+}
+
+void SWDemux::run(void)
+{
+	hal_set_threadname("hal:swdemux");
+	lt_info("%s: start, source '%s'\n", __func__, src.c_str());
+	struct pollfd pfd;
+	int64_t last_check = 0;
+	pfd.fd = in_fd;
+	pfd.events = POLLIN;
+	while (__atomic_load_n(&thread_running, __ATOMIC_RELAXED) && rbuf) {
+		if (pfd.fd < 0) {
+			/* input is gone, only keep servicing the timeouts */
+			usleep(100000);
+			check_timeouts();
+			continue;
+		}
+		int ret;
+		int64_t wait = paced ? pace_until - now_ms() : 0;
+		if (wait > 0) {
+			/* a file that is read at the pace of a live source */
+			usleep((wait < 100 ? wait : 100) * 1000);
+			ret = 0;
+		} else
+			ret = poll(&pfd, 1, 100);
+		if (ret > 0) {
+			if (!read_input())
+				pfd.fd = -1;
+		} else if (ret < 0 && errno != EINTR) {
+			lt_info("%s: poll: %m\n", __func__);
+			pfd.fd = -1;
+		}
+		if (now_ms() - last_check >= 100) {
+			check_timeouts();
+			last_check = now_ms();
+		}
+	}
+	lt_info("%s: end\n", __func__);
+}
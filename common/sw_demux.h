@@ -0,0 +1,157 @@
+/*
+ * userspace transport stream demultiplexer
+ *
+ * parses 188 byte TS packets from an arbitrary file descriptor (file,
+ * FIFO, UDP socket...) and hands out TS packets, PES payload or sections
+ * to SWFilter instances, very much like the kernel's dvb_demux does.
+ *
+ * License: GPLv2 or later
+ */
+#ifndef __SW_DEMUX_H__
+#define __SW_DEMUX_H__
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include "mmap_ring.h"
+#include "section_cache.h"
+#include "ts_packets.h"
+
+#define SWDMX_FILTER_SIZE 16
+#define SWDMX_MAX_PID 0x1fff
+
+typedef enum {
+	SWDMX_OUT_TS,		/* complete TS packets, DMX_OUT_TSDEMUX_TAP */
+	SWDMX_OUT_PES,		/* TS payload, starting with a PES header, DMX_OUT_TAP */
+	SWDMX_OUT_SECTION	/* complete sections, DMX_SET_FILTER */
+} swdmx_output_t;
+
+class SWDemux;
+
+class SWFilter
+{
+	friend class SWDemux;
+public:
+	SWFilter(SWDemux *d, swdmx_output_t type, int bufsize);
+	~SWFilter();
+	/* an eventfd that is readable when data or an error is pending, so
+	 * that the usual poll() in cDemux::Read() just works */
+	int fd;
+	bool setSection(uint16_t pid, const uint8_t *filter, const uint8_t *mask,
+			const uint8_t *mode, int len, bool crc, int timeout);
+	bool setPid(uint16_t pid);
+	bool addPid(uint16_t pid);
+	bool removePid(uint16_t pid);
+	void start(void);
+	void stop(void);
+	int read(uint8_t *buf, int len, bool block);
+	/* the filter's output, for zero-copy consumers */
+	cMmapRing *getRing(void) { return ring; };
+private:
+	SWDemux *dmx;
+	swdmx_output_t output;
+	std::vector<uint16_t> pids;
+	bool running;
+	bool pes_started;
+	/* section filter, see dvb_dmx_swfilter_sectionfilter() */
+	uint8_t filter_value[SWDMX_FILTER_SIZE];
+	uint8_t maskandmode[SWDMX_FILTER_SIZE];
+	uint8_t maskandnotmode[SWDMX_FILTER_SIZE];
+	bool doneq;
+	bool check_crc;
+	int timeout;		/* ms, 0 == none */
+	int64_t started;	/* CLOCK_MONOTONIC ms of start() */
+	bool got_data;
+	cMmapRing *ring;
+	cSectionCache *cache;	/* NULL unless the section cache is enabled */
+	pthread_mutex_t lock;
+	/* SWDMX_OUT_TS: consecutive packets of the current feed(), which
+	 * go into the ring with one write() */
+	const uint8_t *run;
+	int run_len;
+
+	bool match(const uint8_t *sec, int len);
+	void push(const uint8_t *data, int len);
+	void push_section(uint16_t pid, const uint8_t *sec, int len);
+	bool queue(const uint8_t *p);
+	void set_error(int err);
+	void reset(void);
+};
+
+class SWDemux
+{
+	friend class SWFilter;
+public:
+	/* returns the (shared, refcounted) demux for source, which can be
+	 *   a file name or FIFO, "fd:<n>" or "udp://[<addr>]:<port>".
+	 *   A regular file is read at the pace of its PCRs, as if it came
+	 *   from a tuner, or at HAL_SWDEMUX_RATE=<kbit/s> (0: unpaced).
+	 *   All other inputs are live and read as fast as they come,
+	 * or "share:<demux device>": one kernel DMX_OUT_TSDEMUX_TAP filter
+	 *   on that device, with only those PIDs added that some SWFilter
+	 *   is interested in. This way any number of cDemux section / PES
+	 *   filters on the same PID use only one kernel filter.
+	 *   With HAL_REC_HUB=1, the TS filters of the recordings are
+	 *   attached to it too: every recording gets its packets from
+	 *   the one read of the transponder, routed by PID into its ring. */
+	static SWDemux *get(const char *source);
+	void put(void);
+	/* feed TS data, need not start or end at a packet boundary */
+	void feed(const uint8_t *data, int len);
+private:
+	SWDemux(const std::string &source, int fd, bool kernel_share);
+	~SWDemux();
+	struct pid_data {
+		std::vector<SWFilter *> filters;
+		int nsec;		/* number of section filters */
+		int cc;			/* last continuity counter, -1 == unknown */
+		bool sec_sync;		/* section assembly is in sync */
+		int sec_fill;
+		uint8_t sec[4096 + 188];
+	};
+	std::string src;
+	int in_fd;
+	bool share;				/* in_fd is a kernel demux */
+	int kpids;				/* PIDs set on the kernel demux */
+	int refcount;
+	bool thread_running;			/* __atomic, polled by run() */
+	pthread_t thread;
+	int reactor_id;				/* > 0 if run by the DmxReactor */
+	int64_t next_timeout;			/* armed reactor timer */
+	uint8_t *rbuf;
+	/* reading a regular file at the pace of a live source */
+	bool paced;
+	unsigned int pace_rate;			/* kbit/s, 0 == by PCR */
+	int64_t pace_start;			/* ms */
+	uint64_t pace_bytes;			/* read since pace_start, with pace_rate */
+	int pcr_pid;				/* -1 == none seen yet */
+	int64_t pcr_first;			/* 90kHz, at pace_start, -1 == none */
+	int64_t pcr_last;
+	int64_t pace_until;			/* ms, no read before that */
+	pthread_mutex_t lock;
+	pid_data *pid_table[SWDMX_MAX_PID + 1];
+	std::vector<SWFilter *> filters;	/* all filters, for timeout checking */
+	TSPackets packets;
+	std::vector<SWFilter *> runs;		/* TS filters with a queued run */
+
+	void attach(SWFilter *f, uint16_t pid);
+	void detach(SWFilter *f, uint16_t pid);
+	void kernel_pid(uint16_t pid, bool add);
+	void set_error(int err);
+	void packet(const uint8_t *p);
+	static void packet_cb(void *priv, const uint8_t *p, int64_t pos, bool buffered);
+	void flush_runs(void);
+	void section_data(pid_data *pd, uint16_t pid, const uint8_t *p, int len, bool pusi);
+	void section_out(pid_data *pd, uint16_t pid, const uint8_t *sec, int len);
+	void check_timeouts(void);
+	void arm_timeout(int64_t when);
+	bool read_input(void);
+	void pace(const uint8_t *data, int len);
+	void run(void);
+	static void *run_thread(void *);
+	static void reactor_cb(void *priv, int fd, uint32_t events);
+};
+
+#endif
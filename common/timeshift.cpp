@@ -0,0 +1,231 @@
+/*
+ * circular timeshift file
+ *
+ * The file position of logical position pos is pos % size. The writer
+ * calls submit() before it overwrites anything, so the head moves before
+ * the old data are gone. A reader checks the head again after reading,
+ * which tells it whether the data it got were valid.
+ *
+ * License: GPLv2 or later
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "timeshift.h"
+#include "lt_debug.h"
+
+#define lt_debug(args...) _lt_debug(HAL_DEBUG_RECORD, this, args)
+#define lt_info(args...) _lt_info(HAL_DEBUG_RECORD, this, args)
+#define lt_info_c(args...) _lt_info(HAL_DEBUG_RECORD, NULL, args)
+
+#define PTS_MASK 0x1FFFFFFFFLL
+/* the file size is a multiple of this: whole packets and O_DIRECT blocks */
+#define SIZE_UNIT (188 * 4096)
+#define SIZE_MIN (16 * SIZE_UNIT)
+/* distance of the PCR entries */
+#define PCR_STEP 45000
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<TimeshiftFile *> registry;
+
+TimeshiftFile *TimeshiftFile::create(int fd, uint64_t size)
+{
+	char link[32];
+	char name[PATH_MAX];
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+	ssize_t len = readlink(link, name, sizeof(name) - 1);
+	if (len <= 0) {
+		lt_info_c("%s: cannot get the file name of fd %d (%m)\n", __func__, fd);
+		return NULL;
+	}
+	name[len] = 0;
+	size -= size % SIZE_UNIT;
+	if (size < SIZE_MIN)
+		size = SIZE_MIN;
+	/* the file has its final size from the start, the reader needs no
+	 * stat() and the writer does not extend it */
+	if (ftruncate(fd, size))
+		lt_info_c("%s: ftruncate %s: %m\n", __func__, name);
+	TimeshiftFile *ret = new TimeshiftFile(name, size);
+	pthread_mutex_lock(&registry_lock);
+	registry.push_back(ret);
+	pthread_mutex_unlock(&registry_lock);
+	lt_info_c("%s: %s, %lld MB\n", __func__, name, (long long)size >> 20);
+	return ret;
+}
+
+TimeshiftFile *TimeshiftFile::get(const char *filename)
+{
+	char name[PATH_MAX];
+	TimeshiftFile *ret = NULL;
+	if (!realpath(filename, name))
+		return NULL;
+	pthread_mutex_lock(&registry_lock);
+	for (std::vector<TimeshiftFile *>::iterator i = registry.begin(); i != registry.end(); ++i) {
+		if ((*i)->name == name) {
+			ret = *i;
+			ret->refcount++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&registry_lock);
+	return ret;
+}
+
+void TimeshiftFile::put(void)
+{
+	pthread_mutex_lock(&registry_lock);
+	if (--refcount > 0) {
+		pthread_mutex_unlock(&registry_lock);
+		return;
+	}
+	for (std::vector<TimeshiftFile *>::iterator i = registry.begin(); i != registry.end(); ++i) {
+		if (*i == this) {
+			registry.erase(i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&registry_lock);
+	delete this;
+}
+
+TimeshiftFile::TimeshiftFile(const std::string &_name, off_t _size)
+	: packets(packet_cb, this)
+{
+	name = _name;
+	size = _size;
+	refcount = 1;
+	head = 0;
+	tail = 0;
+	pcr_pid = -1;
+	pthread_mutex_init(&lock, NULL);
+}
+
+TimeshiftFile::~TimeshiftFile()
+{
+	pthread_mutex_destroy(&lock);
+}
+
+void TimeshiftFile::submit(off_t end)
+{
+	pthread_mutex_lock(&lock);
+	if (end - size > head) {
+		head = end - size;
+		while (!pcrs.empty() && pcrs.front().pos < head)
+			pcrs.pop_front();
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* call with lock held */
+void TimeshiftFile::packet(const uint8_t *p, off_t pos)
+{
+	if (p[0] != 0x47 || (p[1] & 0x80) || !(p[3] & 0x20) || p[4] < 7 || !(p[5] & 0x10))
+		return;
+	int pid = ((p[1] & 0x1f) << 8) | p[2];
+	if (pcr_pid < 0)
+		pcr_pid = pid;
+	if (pid != pcr_pid)
+		return;
+	int64_t pcr = ((int64_t)p[6] << 25) | (p[7] << 17) | (p[8] << 9) | (p[9] << 1) | (p[10] >> 7);
+	entry e;
+	e.pos = pos;
+	e.pcr = pcr;
+	if (!pcrs.empty()) {
+		int64_t last = pcrs.back().pcr;
+		int64_t diff = ((pcr - last) & PTS_MASK) ^ 0x100000000LL;
+		e.pcr = last + diff - 0x100000000LL;
+		if (e.pcr - last < PCR_STEP)
+			return;
+	}
+	pcrs.push_back(e);
+}
+
+void TimeshiftFile::written(const uint8_t *data, int len, off_t pos)
+{
+	pthread_mutex_lock(&lock);
+	packets.feed(data, len, pos);
+	if (pos + len > tail)
+		tail = pos + len;
+	pthread_mutex_unlock(&lock);
+}
+
+void TimeshiftFile::packet_cb(void *priv, const uint8_t *p, int64_t pos, bool)
+{
+	((TimeshiftFile *)priv)->packet(p, pos);
+}
+
+void TimeshiftFile::range(off_t *h, off_t *t)
+{
+	pthread_mutex_lock(&lock);
+	*h = head;
+	*t = tail;
+	pthread_mutex_unlock(&lock);
+}
+
+bool TimeshiftFile::times(int64_t *head_pts, int64_t *tail_pts)
+{
+	pthread_mutex_lock(&lock);
+	bool ret = !pcrs.empty();
+	if (ret) {
+		*head_pts = pcrs.front().pcr & PTS_MASK;
+		*tail_pts = pcrs.back().pcr & PTS_MASK;
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+off_t TimeshiftFile::find(int64_t pts)
+{
+	off_t ret = -1;
+	pthread_mutex_lock(&lock);
+	if (!pcrs.empty()) {
+		int64_t first = pcrs.front().pcr;
+		int64_t rel = (pts - first) & PTS_MASK;
+		if (rel >= 0x100000000LL)	/* "negative": before the head */
+			rel = 0;
+		size_t lo = 0, hi = pcrs.size();
+		while (hi - lo > 1) {
+			size_t mid = (lo + hi) / 2;
+			if (pcrs[mid].pcr - first <= rel)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		ret = pcrs[lo].pos;
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+ssize_t TimeshiftFile::read(int fd, uint8_t *buf, size_t len, off_t pos)
+{
+	off_t h, t;
+	range(&h, &t);
+	if (pos < h) {
+		errno = ERANGE;
+		return -1;
+	}
+	if (pos >= t)
+		return 0;
+	if ((off_t)len > t - pos)
+		len = t - pos;
+	off_t phys = pos % size;
+	if ((off_t)len > size - phys)
+		len = size - phys;	/* the rest with the next call */
+	ssize_t ret = pread(fd, buf, len, phys);
+	range(&h, &t);
+	if (pos < h) {
+		lt_debug("%s: pos %lld was overwritten while reading\n", __func__, (long long)pos);
+		errno = ERANGE;
+		return -1;
+	}
+	return ret;
+}
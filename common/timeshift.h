@@ -0,0 +1,75 @@
+/*
+ * circular timeshift file
+ *
+ * With cRecord::SetTimeshift(), a recording goes into a file of fixed
+ * size which is overwritten from the start when it is full, so that an
+ * all-day pause of live TV does not fill the disk. The positions in the
+ * file are "logical": the number of bytes recorded before, which never
+ * wraps. The writer publishes the range that can be read and a PCR
+ * timeline in memory, so that cPlayback (in the same process) neither
+ * has to probe the file for its length nor for the times.
+ *
+ * License: GPLv2 or later
+ */
+#ifndef __TIMESHIFT_H__
+#define __TIMESHIFT_H__
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <deque>
+#include <string>
+
+#include "ts_packets.h"
+
+class TimeshiftFile
+{
+public:
+	/* the writer: the recording in fd becomes a circular file of about
+	 * size bytes. NULL if that is not possible */
+	static TimeshiftFile *create(int fd, uint64_t size);
+	/* the reader: the running timeshift which is written to filename,
+	 * NULL if there is none */
+	static TimeshiftFile *get(const char *filename);
+	/* both: done with it */
+	void put(void);
+
+	/* the size of the file, a multiple of packets and disk blocks */
+	off_t getSize(void) { return size; };
+	/* writer: [pos, end) is about to be overwritten, with pos < end */
+	void submit(off_t end);
+	/* writer: data was written at logical position pos, in order */
+	void written(const uint8_t *data, int len, off_t pos);
+
+	/* reader: the data in [*head, *tail) can be read */
+	void range(off_t *head, off_t *tail);
+	/* reader: the PCR (90 kHz, 33 bit) at head and tail, false if unknown */
+	bool times(int64_t *head_pts, int64_t *tail_pts);
+	/* reader: the position of the last PCR at or before pts, -1 if unknown */
+	off_t find(int64_t pts);
+	/* reader: like pread() from logical position pos of the file fd.
+	 * Returns 0 at the tail and -1 with ERANGE if pos was overwritten,
+	 * even while reading */
+	ssize_t read(int fd, uint8_t *buf, size_t len, off_t pos);
+private:
+	struct entry {
+		off_t pos;
+		int64_t pcr;	/* without 33 bit wraparounds */
+	};
+	TimeshiftFile(const std::string &name, off_t size);
+	~TimeshiftFile();
+	std::string name;
+	off_t size;
+	int refcount;
+	pthread_mutex_t lock;
+	off_t head;
+	off_t tail;
+	std::deque<entry> pcrs;	/* one entry per half second */
+	int pcr_pid;
+	TSPackets packets;	/* of what was written() */
+
+	void packet(const uint8_t *p, off_t pos);
+	static void packet_cb(void *priv, const uint8_t *p, int64_t pos, bool buffered);
+};
+
+#endif
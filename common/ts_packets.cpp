@@ -0,0 +1,61 @@
+/*
+ * the 188 byte packets of a transport stream that comes in pieces of
+ * any size, for the parsers that look at every packet
+ *
+ * Complete packets are passed on in place, only one that is split
+ * between two feed()s is copied. After lost sync, ts_resync() looks for
+ * two sync bytes one packet apart.
+ *
+ * License: GPLv2 or later
+ */
+#include <cstring>
+
+#include "ts_packets.h"
+#include "ts_scan.h"
+
+TSPackets::TSPackets(packet_fn f, void *p)
+{
+	fn = f;
+	priv = p;
+	fill = 0;
+	pkt_pos = 0;
+}
+
+int TSPackets::feed(const uint8_t *data, int len, int64_t pos)
+{
+	const uint8_t *start = data;
+	const uint8_t *end = data + len;
+	int skipped = 0;
+	if (fill > 0) {
+		int n = 188 - fill;
+		if (n > len)
+			n = len;
+		memcpy(pkt + fill, data, n);
+		fill += n;
+		data += n;
+		if (fill == 188) {
+			fn(priv, pkt, pkt_pos, true);
+			fill = 0;
+		}
+	}
+	while (data < end) {
+		if (*data != 0x47) {
+			int s = ts_resync(data, end - data, 188);
+			if (s < 0) {
+				skipped += end - data;
+				break;
+			}
+			skipped += s;
+			data += s;
+		}
+		if (end - data < 188) {
+			fill = end - data;
+			pkt_pos = pos + (data - start);
+			memcpy(pkt, data, fill);
+			break;
+		}
+		fn(priv, data, pos + (data - start), false);
+		data += 188;
+	}
+	return skipped;
+}
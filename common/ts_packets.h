@@ -0,0 +1,33 @@
+/*
+ * the 188 byte packets of a transport stream that comes in pieces of
+ * any size, for the parsers that look at every packet
+ *
+ * License: GPLv2 or later
+ */
+#ifndef __TS_PACKETS_H__
+#define __TS_PACKETS_H__
+
+#include <inttypes.h>
+
+class TSPackets
+{
+public:
+	/* called for every packet. pos is its position in the stream. If
+	 * buffered, the packet was put together from two feed()s and p is
+	 * only valid until the next feed() */
+	typedef void (*packet_fn)(void *priv, const uint8_t *p, int64_t pos, bool buffered);
+	TSPackets(packet_fn fn, void *priv);
+	/* the data at stream position pos, in order. Bytes out of sync are
+	 * skipped, returns how many */
+	int feed(const uint8_t *data, int len, int64_t pos);
+	/* drop the partial packet, the next data start anew */
+	void reset(void) { fill = 0; };
+private:
+	packet_fn fn;
+	void *priv;
+	uint8_t pkt[188];	/* partial packet from the last feed() */
+	int fill;
+	int64_t pkt_pos;
+};
+
+#endif
@@ -0,0 +1,301 @@
+/*
+ * fast scanners for TS sync bytes and PES / ES start codes
+ *
+ * After a seek or a lost packet, finding the next packet or PES header
+ * one byte at a time is slow. These look at 16 (SSE2, NEON) or 32 (AVX2)
+ * positions at once. The implementation is selected at runtime on x86,
+ * NEON is used if the compiler targets it. HAL_TS_SCAN=<name> forces one.
+ *
+ * License: GPLv2 or later
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ts_scan.h"
+#include "lt_debug.h"
+
+#define lt_debug_c(args...) _lt_debug(HAL_DEBUG_DEMUX, NULL, args)
+#define lt_info_c(args...) _lt_info(HAL_DEBUG_DEMUX, NULL, args)
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_TS_SCAN_X86 1
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_TS_SCAN_NEON 1
+#include <arm_neon.h>
+#endif
+
+static int find_sync_c(const uint8_t *p, int len, int stride)
+{
+	int i;
+	for (i = 0; i + stride < len; i++) {
+		if (p[i] == 0x47 && p[i + stride] == 0x47)
+			return i;
+	}
+	return -1;
+}
+
+static int find_startcode_c(const uint8_t *p, int len)
+{
+	/* look at the third byte first: if it is not 0x01 or 0x00, the
+	 * start code cannot begin in the next two or three bytes either */
+	int i = 0;
+	while (i + 2 < len) {
+		if (p[i + 2] > 0x01)
+			i += 3;
+		else if (p[i + 2] == 0x00)
+			i++;
+		else if (p[i + 1] != 0x00)
+			i += 3;
+		else if (p[i] != 0x00)
+			i += 2;
+		else
+			return i;
+	}
+	return -1;
+}
+
+#ifdef HAVE_TS_SCAN_X86
+__attribute__((target("sse2")))
+static int find_sync_sse2(const uint8_t *p, int len, int stride)
+{
+	const __m128i s = _mm_set1_epi8(0x47);
+	int i;
+	for (i = 0; i + stride + 16 <= len; i += 16) {
+		__m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), s);
+		__m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + stride)), s);
+		int m = _mm_movemask_epi8(_mm_and_si128(a, b));
+		if (m)
+			return i + __builtin_ctz(m);
+	}
+	int r = find_sync_c(p + i, len - i, stride);
+	return (r < 0) ? r : i + r;
+}
+
+__attribute__((target("sse2")))
+static int find_startcode_sse2(const uint8_t *p, int len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+	int i;
+	for (i = 0; i + 2 + 16 <= len; i += 16) {
+		__m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), zero);
+		__m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 1)), zero);
+		__m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 2)), one);
+		int m = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), c));
+		if (m)
+			return i + __builtin_ctz(m);
+	}
+	int r = find_startcode_c(p + i, len - i);
+	return (r < 0) ? r : i + r;
+}
+
+__attribute__((target("avx2")))
+static int find_sync_avx2(const uint8_t *p, int len, int stride)
+{
+	const __m256i s = _mm256_set1_epi8(0x47);
+	int i;
+	for (i = 0; i + stride + 32 <= len; i += 32) {
+		__m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), s);
+		__m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + stride)), s);
+		unsigned int m = _mm256_movemask_epi8(_mm256_and_si256(a, b));
+		if (m)
+			return i + __builtin_ctz(m);
+	}
+	int r = find_sync_sse2(p + i, len - i, stride);
+	return (r < 0) ? r : i + r;
+}
+
+__attribute__((target("avx2")))
+static int find_startcode_avx2(const uint8_t *p, int len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi8(1);
+	int i;
+	for (i = 0; i + 2 + 32 <= len; i += 32) {
+		__m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), zero);
+		__m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 1)), zero);
+		__m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 2)), one);
+		unsigned int m = _mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(a, b), c));
+		if (m)
+			return i + __builtin_ctz(m);
+	}
+	int r = find_startcode_sse2(p + i, len - i);
+	return (r < 0) ? r : i + r;
+}
+#endif
+
+#ifdef HAVE_TS_SCAN_NEON
+/* NEON has no movemask: only check if anything matched in the 16 bytes
+ * and let the C version find out where */
+static inline int any_set(uint8x16_t v)
+{
+#ifdef __aarch64__
+	return vmaxvq_u8(v) != 0;
+#else
+	uint8x8_t o = vorr_u8(vget_low_u8(v), vget_high_u8(v));
+	return vget_lane_u64(vreinterpret_u64_u8(o), 0) != 0;
+#endif
+}
+
+static int find_sync_neon(const uint8_t *p, int len, int stride)
+{
+	const uint8x16_t s = vdupq_n_u8(0x47);
+	int i;
+	for (i = 0; i + stride + 16 <= len; i += 16) {
+		uint8x16_t a = vceqq_u8(vld1q_u8(p + i), s);
+		uint8x16_t b = vceqq_u8(vld1q_u8(p + i + stride), s);
+		if (any_set(vandq_u8(a, b)))
+			break;
+	}
+	int r = find_sync_c(p + i, len - i, stride);
+	return (r < 0) ? r : i + r;
+}
+
+static int find_startcode_neon(const uint8_t *p, int len)
+{
+	const uint8x16_t zero = vdupq_n_u8(0);
+	const uint8x16_t one = vdupq_n_u8(1);
+	int i;
+	for (i = 0; i + 2 + 16 <= len; i += 16) {
+		uint8x16_t a = vceqq_u8(vld1q_u8(p + i), zero);
+		uint8x16_t b = vceqq_u8(vld1q_u8(p + i + 1), zero);
+		uint8x16_t c = vceqq_u8(vld1q_u8(p + i + 2), one);
+		if (any_set(vandq_u8(vandq_u8(a, b), c)))
+			break;
+	}
+	int r = find_startcode_c(p + i, len - i);
+	return (r < 0) ? r : i + r;
+}
+#endif
+
+/* the first packet sync of any size, with the given find_sync() */
+static int sync_any(int (*fs)(const uint8_t *, int, int), const uint8_t *p, int len, int *stride)
+{
+	static const int sizes[] = { 188, 192, 204 };
+	int best = -1;
+	unsigned int i;
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		int s = sizes[i];
+		int from = 0;
+		int r;
+		/* only search before the best one found so far */
+		int end = (best < 0) ? len : best + 2 * s + 1;
+		if (end > len)
+			end = len;
+		while ((r = (end - from > s) ? fs(p + from, end - from, s) : -1) >= 0) {
+			r += from;
+			if (r + 2 * s >= len || p[r + 2 * s] == 0x47)
+				break;
+			from = r + 1;
+		}
+		if (r >= 0 && (best < 0 || r < best)) {
+			best = r;
+			*stride = s;
+		}
+	}
+	return best;
+}
+
+#define SYNC_ANY(x) \
+static int find_sync_any_##x(const uint8_t *p, int len, int *stride) \
+{ \
+	return sync_any(find_sync_##x, p, len, stride); \
+}
+SYNC_ANY(c)
+#ifdef HAVE_TS_SCAN_X86
+SYNC_ANY(sse2)
+SYNC_ANY(avx2)
+#endif
+#ifdef HAVE_TS_SCAN_NEON
+SYNC_ANY(neon)
+#endif
+
+#define IMPL(x) \
+do { \
+	impls[num_impls].name = #x; \
+	impls[num_impls].find_sync = find_sync_##x; \
+	impls[num_impls].find_sync_any = find_sync_any_##x; \
+	impls[num_impls++].find_startcode = find_startcode_##x; \
+} while (0)
+
+static struct ts_scan_impl impls[4];
+static int num_impls;
+static const struct ts_scan_impl *scan;
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+static void ts_scan_init(void)
+{
+	int i;
+	IMPL(c);
+#ifdef HAVE_TS_SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		IMPL(sse2);
+	if (__builtin_cpu_supports("avx2"))
+		IMPL(avx2);
+#endif
+#ifdef HAVE_TS_SCAN_NEON
+	IMPL(neon);
+#endif
+	/* the last one is the fastest */
+	scan = &impls[num_impls - 1];
+	const char *force = getenv("HAL_TS_SCAN");
+	if (force) {
+		for (i = 0; i < num_impls; i++) {
+			if (!strcmp(force, impls[i].name)) {
+				scan = &impls[i];
+				break;
+			}
+		}
+		if (i == num_impls)
+			lt_info_c("%s: HAL_TS_SCAN=%s not available\n", __func__, force);
+	}
+	lt_debug_c("%s: using %s\n", __func__, scan->name);
+}
+
+int ts_find_sync(const uint8_t *p, int len, int stride)
+{
+	pthread_once(&scan_once, ts_scan_init);
+	if (len <= stride)
+		return -1;
+	return scan->find_sync(p, len, stride);
+}
+
+int ts_resync(const uint8_t *p, int len, int stride)
+{
+	int r = ts_find_sync(p, len, stride);
+	if (r >= 0)
+		return r;
+	/* everything before the last packet has been checked already */
+	int start = (len > stride) ? len - stride : 0;
+	const uint8_t *s = (const uint8_t *)memchr(p + start, 0x47, len - start);
+	return s ? (int)(s - p) : -1;
+}
+
+int ts_find_sync_any(const uint8_t *p, int len, int *stride)
+{
+	pthread_once(&scan_once, ts_scan_init);
+	return scan->find_sync_any(p, len, stride);
+}
+
+int ts_find_startcode(const uint8_t *p, int len)
+{
+	pthread_once(&scan_once, ts_scan_init);
+	return scan->find_startcode(p, len);
+}
+
+int ts_scan_impls(const struct ts_scan_impl **list)
+{
+	pthread_once(&scan_once, ts_scan_init);
+	*list = impls;
+	return num_impls;
+}
+
+const char *ts_scan_name(void)
+{
+	pthread_once(&scan_once, ts_scan_init);
+	return scan->name;
+}
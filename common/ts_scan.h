@@ -0,0 +1,40 @@
+/*
+ * fast scanners for TS sync bytes and PES / ES start codes
+ *
+ * License: GPLv2 or later
+ */
+#ifndef __TS_SCAN_H__
+#define __TS_SCAN_H__
+#include <inttypes.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* offset of the first sync byte 0x47 in p which is followed by another
+ * one "stride" (188, 192 or 204) bytes later, -1 if there is none */
+int ts_find_sync(const uint8_t *p, int len, int stride);
+/* like ts_find_sync(), but if there is no such pair, a single 0x47 within
+ * the last "stride" bytes (which cannot be verified yet) is good enough */
+int ts_resync(const uint8_t *p, int len, int stride);
+/* find the first packet sync with any of the known packet sizes,
+ * verified by three sync bytes in a row where the buffer is long enough.
+ * Returns the offset and stores the packet size in *stride */
+int ts_find_sync_any(const uint8_t *p, int len, int *stride);
+/* offset of the first 00 00 01 start code prefix completely inside p,
+ * -1 if there is none */
+int ts_find_startcode(const uint8_t *p, int len);
+/* the implementation in use: "c", "sse2", "avx2" or "neon" */
+const char *ts_scan_name(void);
+
+/* the implementations usable on this CPU, for testing and benchmarking.
+ * The fastest one is used unless HAL_TS_SCAN=<name> is set. */
+struct ts_scan_impl {
+	const char *name;
+	int (*find_sync)(const uint8_t *p, int len, int stride);
+	int (*find_sync_any)(const uint8_t *p, int len, int *stride);
+	int (*find_startcode)(const uint8_t *p, int len);
+};
+int ts_scan_impls(const struct ts_scan_impl **list);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,147 @@
+/*
+ * per PID statistics of a transport stream, for cDemux::GetStats()
+ *
+ * Continuity counter errors and transport_error_indicator point to
+ * problems with the signal (or the tuner), while demux buffer overflows
+ * mean that the reader (recorder, decoder...) did not keep up.
+ *
+ * License: GPLv2 or later
+ */
+#include <time.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include <config.h>
+#if !HAVE_TRIPLEDRAGON
+#include "ts_stats.h"
+#include "hal_time.h"
+
+TSStats::TSStats()
+	: packets(packet_cb, this)
+{
+	memset(pids, 0, sizeof(pids));
+	window_start = now_ms();
+	overflows = 0;
+	pthread_mutex_init(&lock, NULL);
+}
+
+TSStats::~TSStats()
+{
+	for (int i = 0; i <= TS_STATS_ALL; i++)
+		free(pids[i]);
+	pthread_mutex_destroy(&lock);
+}
+
+/* call with lock held */
+TSStats::pid_stats *TSStats::get_pid(uint16_t pid)
+{
+	pid_stats *ps = pids[pid];
+	if (!ps) {
+		ps = (pid_stats *)calloc(1, sizeof(pid_stats));
+		if (!ps)
+			return NULL;
+		ps->cc = -1;
+		pids[pid] = ps;
+	}
+	return ps;
+}
+
+/* call with lock held */
+void TSStats::packet(const uint8_t *p)
+{
+	uint16_t pid = ((p[1] & 0x1f) << 8) | p[2];
+	pid_stats *all = get_pid(TS_STATS_ALL);
+	pid_stats *ps = get_pid(pid);
+	if (!all || !ps)
+		return;
+	ps->packets++;
+	ps->bytes += 188;
+	all->packets++;
+	all->bytes += 188;
+	if (p[1] & 0x80) { /* transport_error_indicator: nothing else can be trusted */
+		ps->tei++;
+		all->tei++;
+		return;
+	}
+	if (p[3] & 0xc0) {
+		ps->scrambled++;
+		all->scrambled++;
+	}
+	if (pid == 0x1fff) /* null packets have no meaningful counter */
+		return;
+	int afc = (p[3] >> 4) & 0x03;
+	int cc = p[3] & 0x0f;
+	if (!(afc & 0x01)) /* the counter only increments with payload */
+		return;
+	bool discontinuity = (afc & 0x02) && p[4] > 0 && (p[5] & 0x80);
+	/* one duplicate packet is allowed */
+	if (ps->cc >= 0 && !discontinuity && cc != ((ps->cc + 1) & 0x0f) && cc != ps->cc) {
+		ps->cc_errors++;
+		all->cc_errors++;
+	}
+	ps->cc = cc;
+}
+
+/* call with lock held */
+void TSStats::update_bitrates(int64_t now)
+{
+	int64_t elapsed = now - window_start;
+	if (elapsed < 1000)
+		return;
+	for (int i = 0; i <= TS_STATS_ALL; i++) {
+		pid_stats *ps = pids[i];
+		if (!ps)
+			continue;
+		ps->bitrate = (unsigned int)(ps->bytes * 8 * 1000 / elapsed);
+		ps->bytes = 0;
+	}
+	window_start = now;
+}
+
+void TSStats::feed(const uint8_t *data, int len)
+{
+	pthread_mutex_lock(&lock);
+	packets.feed(data, len, 0);
+	update_bitrates(now_ms());
+	pthread_mutex_unlock(&lock);
+}
+
+void TSStats::packet_cb(void *priv, const uint8_t *p, int64_t, bool)
+{
+	((TSStats *)priv)->packet(p);
+}
+
+void TSStats::tap(void *priv, const uint8_t *data, int len)
+{
+	if (data)
+		((TSStats *)priv)->feed(data, len);
+}
+
+void TSStats::overflow(void)
+{
+	pthread_mutex_lock(&lock);
+	overflows++;
+	pthread_mutex_unlock(&lock);
+}
+
+bool TSStats::get(uint16_t pid, dmx_pid_stats *stats)
+{
+	if (pid > TS_STATS_ALL)
+		return false;
+	pthread_mutex_lock(&lock);
+	/* if the data stopped, the bitrate must drop, too */
+	update_bitrates(now_ms());
+	pid_stats *ps = pids[pid];
+	if (ps) {
+		stats->packets = ps->packets;
+		stats->cc_errors = ps->cc_errors;
+		stats->tei = ps->tei;
+		stats->scrambled = ps->scrambled;
+		stats->bitrate = ps->bitrate;
+		stats->overflows = overflows;
+	}
+	pthread_mutex_unlock(&lock);
+	return ps != NULL;
+}
+#endif
@@ -0,0 +1,51 @@
+/*
+ * per PID statistics of a transport stream, for cDemux::GetStats()
+ *
+ * License: GPLv2 or later
+ */
+#ifndef __TS_STATS_H__
+#define __TS_STATS_H__
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "dmx_hal.h"
+#include "ts_packets.h"
+
+#define TS_STATS_ALL 0x2000
+
+class TSStats
+{
+public:
+	TSStats();
+	~TSStats();
+	/* TS data, need not start or end at a packet boundary */
+	void feed(const uint8_t *data, int len);
+	/* for cMmapRing::setTap(), priv is the TSStats */
+	static void tap(void *priv, const uint8_t *data, int len);
+	/* the kernel demux reported EOVERFLOW */
+	void overflow(void);
+	bool get(uint16_t pid, dmx_pid_stats *stats);
+private:
+	struct pid_stats {
+		uint64_t packets;
+		uint64_t cc_errors;
+		uint64_t tei;
+		uint64_t scrambled;
+		uint64_t bytes;		/* in the current bitrate window */
+		unsigned int bitrate;
+		int cc;			/* last continuity_counter, -1 == unknown */
+	};
+	pid_stats *pids[TS_STATS_ALL + 1];
+	int64_t window_start;
+	unsigned int overflows;
+	TSPackets packets;
+	pthread_mutex_t lock;
+
+	pid_stats *get_pid(uint16_t pid);
+	void packet(const uint8_t *p);
+	static void packet_cb(void *priv, const uint8_t *p, int64_t pos, bool buffered);
+	void update_bitrates(int64_t now);
+};
+
+#endif
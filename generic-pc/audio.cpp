@@ -25,6 +25,7 @@
 #include "audio_hal.h"
 #include "audio_priv.h"
 #include "dmx_hal.h"
+#include "mmap_ring.h"
 #include "lt_debug.h"
 
 #define lt_debug(args...) _lt_debug(HAL_DEBUG_AUDIO, this, args)
@@ -32,8 +33,6 @@
 
 /* ffmpeg buf 2k */
 #define INBUF_SIZE 0x0800
-/* my own buf 16k */
-#define DMX_BUF_SZ 0x4000
 
 cAudio * audioDecoder = NULL;
 ADec *adec = NULL;
@@ -54,20 +53,22 @@ cAudio::~cAudio(void)
 ADec::ADec(void)
 {
 	adevice = NULL;
-	dmxbuf = NULL;
-	bufpos = 0;
 	c = NULL;
 	thread_started = false;
-	if (!HAL_nodec)
-		dmxbuf = (uint8_t *)malloc(DMX_BUF_SZ);
-	bufpos = 0;
 	curr_pts = 0;
+	clk_off = AV_NOPTS_VALUE;
+	clk_end = 0;
+	/* libao cannot tell how much is buffered in the device, so the
+	 * output latency is a guess, HAL_AUDIO_LATENCY=<ms> overrides it */
+	latency = 90000*3/10; /* 300ms */
+	const char *tmp = getenv("HAL_AUDIO_LATENCY");
+	if (tmp)
+		latency = atoi(tmp) * 90;
 	ao_initialize();
 }
 
 ADec::~ADec(void)
 {
-	free(dmxbuf);
 	if (adevice)
 		ao_close(adevice);
 	adevice = NULL;
@@ -123,6 +124,7 @@ int ADec::Stop(void)
 		thread_started = false;
 		join();
 	}
+	__atomic_store_n(&clk_off, AV_NOPTS_VALUE, __ATOMIC_RELAXED);
 	lt_debug("%s <\n", __func__);
 	return 0;
 }
@@ -295,31 +297,59 @@ static int _my_read(void *, uint8_t *buf, int buf_size)
 	return adec->my_read(buf, buf_size);
 }
 
+/* copy straight from the demux ring into libavformat's buffer */
 int ADec::my_read(uint8_t *buf, int buf_size)
 {
+	cMmapRing *ring;
+	uint8_t *data;
+	int n = 0;
 	int tmp = 0;
-	if (audioDecoder && bufpos < DMX_BUF_SZ - 4096) {
-		while (bufpos < buf_size && ++tmp < 20) { /* retry max 20 times */
-			int ret = audioDemux->Read(dmxbuf + bufpos, DMX_BUF_SZ - bufpos, 10);
-			if (ret > 0)
-				bufpos += ret;
-			if (! thread_started)
-				break;
-		}
+	if (!audioDecoder || !(ring = (cMmapRing *)audioDemux->getBuffer()))
+		return 0;
+	while (n <= 0 && ++tmp < 20) { /* retry max 20 times */
+		n = ring->peek(&data, 10);
+		if (! thread_started)
+			break;
 	}
-	if (bufpos == 0)
+	if (n <= 0)
 		return 0;
-	//lt_info("%s buf_size %d bufpos %d th %d tmp %d\n", __func__, buf_size, bufpos, thread_started, tmp);
-	if (bufpos > buf_size) {
-		memcpy(buf, dmxbuf, buf_size);
-		memmove(dmxbuf, dmxbuf + buf_size, bufpos - buf_size);
-		bufpos -= buf_size;
-		return buf_size;
+	if (n > buf_size)
+		n = buf_size;
+	memcpy(buf, data, n);
+	ring->release(n);
+	return n;
+}
+
+int64_t ADec::getClock(void)
+{
+	int64_t off = __atomic_load_n(&clk_off, __ATOMIC_RELAXED);
+	if (off == AV_NOPTS_VALUE)
+		return AV_NOPTS_VALUE;
+	int64_t end = __atomic_load_n(&clk_end, __ATOMIC_RELAXED);
+	int64_t clock = clock_90k() + off;
+	/* after an underrun, the clock stops at the last sample */
+	return clock < end ? clock : end;
+}
+
+/* called after ao_play() returned: then the device buffer is full again,
+ * and what is heard now is what was written latency ago. In between,
+ * the clock runs with the system clock */
+void ADec::updateClock(int64_t pts, int64_t duration)
+{
+	int64_t old = __atomic_load_n(&clk_off, __ATOMIC_RELAXED);
+	if (pts == AV_NOPTS_VALUE) {
+		if (old == AV_NOPTS_VALUE)
+			return;
+		pts = __atomic_load_n(&clk_end, __ATOMIC_RELAXED);
 	}
-	memcpy(buf, dmxbuf, bufpos);
-	tmp = bufpos;
-	bufpos = 0;
-	return tmp;
+	int64_t end = pts + duration;
+	int64_t off = end - latency - clock_90k();
+	/* smooth the jitter of the ao_play() returns and follow the drift of
+	 * the sound card, jumps of the pts are taken at once */
+	if (old != AV_NOPTS_VALUE && llabs(off - old) < 90000/10)
+		off = old + (off - old) / 16;
+	__atomic_store_n(&clk_end, end, __ATOMIC_RELAXED);
+	__atomic_store_n(&clk_off, off, __ATOMIC_RELAXED);
 }
 
 void ADec::run()
@@ -349,6 +379,7 @@ void ADec::run()
 	char tmp[64] = "unknown";
 
 	curr_pts = 0;
+	__atomic_store_n(&clk_off, AV_NOPTS_VALUE, __ATOMIC_RELAXED);
 	av_init_packet(&avpkt);
 	inp = av_find_input_format("mpegts");
 	AVIOContext *pIOCtx = avio_alloc_context(inbuf, INBUF_SIZE, // internal Buffer and its size
@@ -459,6 +490,7 @@ void ADec::run()
 			int o_buf_sz = av_samples_get_buffer_size(&out_linesize, o_ch,
 								  obuf_sz, AV_SAMPLE_FMT_S16, 1);
 			ao_play(adevice, (char *)obuf, o_buf_sz);
+			updateClock(curr_pts, (int64_t)obuf_sz * 90000 / o_sr);
 		}
 		av_free_packet(&avpkt);
 	}
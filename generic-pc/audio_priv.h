@@ -19,6 +19,8 @@
 
 #include <OpenThreads/Thread>
 
+#include "hal_time.h"
+
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavutil/opt.h>
@@ -39,15 +41,22 @@ public:
 	void getAudioInfo(int &type, int &layer, int &freq, int &bitrate, int &mode);
 	int my_read(uint8_t *buf, int buf_size);
 	int64_t getPts() { return curr_pts; };
+	/* the pts of the audio that is heard now, AV_NOPTS_VALUE if none.
+	 * Lock free, for the GL thread */
+	int64_t getClock(void);
 private:
 	bool thread_started;
 	int64_t curr_pts;
 	void run();
+	/* the clock is clock_90k() + clk_off, but not beyond clk_end, the
+	 * end of what was written. Both __atomic */
+	int64_t clk_off;
+	int64_t clk_end;
+	int64_t latency;	/* of the output, in 90kHz units */
+	void updateClock(int64_t pts, int64_t duration);
 
 	ao_device *adevice;
 	ao_sample_format sformat;
-	uint8_t *dmxbuf;
-	int bufpos;
 	AVCodecContext *c;
 };
 
@@ -31,10 +31,22 @@
 #include <cstring>
 #include <cstdio>
 #include <string>
+#include <list>
 #include <unistd.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
 #include "dmx_hal.h"
 #include "lt_debug.h"
+#include "sw_demux.h"
+#include "mmap_ring.h"
+#include "dmx_reactor.h"
+#include "section_cache.h"
+#include "crc32.h"
+#include "ts_stats.h"
+#include "dmx_bufsize.h"
+#include "hal_time.h"
 
 /* needed for getSTC :-( */
 #include "video_priv.h"
@@ -42,6 +54,7 @@ extern VDec *vdec;
 
 #define lt_debug(args...) _lt_debug(TRIPLE_DEBUG_DEMUX, this, args)
 #define lt_info(args...) _lt_info(TRIPLE_DEBUG_DEMUX, this, args)
+#define lt_debug_c(args...) _lt_debug(TRIPLE_DEBUG_DEMUX, NULL, args)
 #define lt_info_c(args...) _lt_info(TRIPLE_DEBUG_DEMUX, NULL, args)
 
 #define dmx_err(_errfmt, _errstr, _revents) do { \
@@ -64,12 +77,17 @@ static const char *DMX_T[] = {
 	"DMX_PCR"
 };
 
-/* map the device numbers. for now only demux0 is used */
-static const char *devname[] = {
-	"/dev/dvb/adapter0/demux0",
-	"/dev/dvb/adapter0/demux0",
-	"/dev/dvb/adapter0/demux0"
-};
+/* this is the number of different cDemux() units, not the number of
+ * /dev/dvb/.../demuxX devices! */
+#define NUM_DEMUX 3
+/* the current source of each cDemux unit, an index into dmx_dev */
+static int dmx_source[NUM_DEMUX] = { 0, 0, 0 };
+/* the demux devices, see dmx_init_devices() */
+static std::vector<std::string> dmx_dev;
+/* all cDemux instances, for SetSource() */
+static std::list<cDemux *> dmx_list;
+/* protects all of the above and the filter setup of all instances */
+static OpenThreads::Mutex dmx_lock;
 
 /* uuuugly */
 static int dmx_tp_count = 0;
@@ -77,9 +95,98 @@ static int dmx_tp_count = 0;
 
 extern bool HAL_nodec;
 
+/* the sources are all /dev/dvb/adapterX/demuxY, in that order, or the list
+ * from HAL_DMX_DEVICES=/dev/dvb/adapter1/demux0,/dev/dvb/adapter0/demux0...
+ * The units start on source 0, or as given in HAL_DMX_SOURCE=0,1,1.
+ * call with dmx_lock held */
+static void dmx_init_devices(void)
+{
+	if (!dmx_dev.empty())
+		return;
+	const char *env = getenv("HAL_DMX_DEVICES");
+	if (env)
+	{
+		std::string devs(env);
+		size_t pos = 0;
+		while (pos <= devs.size())
+		{
+			size_t end = devs.find(',', pos);
+			if (end == std::string::npos)
+				end = devs.size();
+			if (end > pos)
+				dmx_dev.push_back(devs.substr(pos, end - pos));
+			pos = end + 1;
+		}
+	}
+	else
+	{
+		char dev[32];
+		for (int a = 0; a < 8; a++)
+			for (int d = 0; d < 4; d++)
+			{
+				snprintf(dev, sizeof(dev), "/dev/dvb/adapter%d/demux%d", a, d);
+				if (access(dev, F_OK) == 0)
+					dmx_dev.push_back(dev);
+			}
+	}
+	if (dmx_dev.empty())
+		dmx_dev.push_back("/dev/dvb/adapter0/demux0");
+	for (unsigned int i = 0; i < dmx_dev.size(); i++)
+		lt_info_c("%s: source %d: %s\n", __func__, i, dmx_dev[i].c_str());
+
+	env = getenv("HAL_DMX_SOURCE");
+	for (int unit = 0; env && *env && unit < NUM_DEMUX; unit++)
+	{
+		char *end;
+		long src = strtol(env, &end, 10);
+		if (end == env)
+			break;
+		if (src >= 0 && src < (long)dmx_dev.size())
+			dmx_source[unit] = src;
+		else
+			lt_info_c("%s: HAL_DMX_SOURCE: unit %d: source %ld out of range\n", __func__, unit, src);
+		env = (*end == ',') ? end + 1 : end;
+	}
+}
+
+/* export HAL_SWDEMUX=/path/to/file.ts (or a FIFO, "fd:<n>", "udp://:1234")
+ * to use the userspace demux instead of the kernel's demux device. A file
+ * is read at the pace of its PCR, or HAL_SWDEMUX_RATE=<kbit/s>.
+ * export HAL_DMX_SHARE=1 to let all section and PES filters on the same
+ * PID share one kernel filter, demuxed in userspace */
+typedef struct dmx_pdata {
+	SWDemux *sw;
+	SWFilter *swf;
+	cMmapRing *ring;	/* created by getBuffer() or for the reactor */
+	int reactor_id;
+	bool nonblock;
+	cSectionCache *cache;	/* kernel section filters only, see section_cache.h */
+	bool sw_crc;		/* check the section CRC here, not in the driver */
+	TSStats *stats;		/* DMX_TP_CHANNEL only */
+	DmxBufSize *bufsize;	/* kernel filters only, see dmx_bufsize.h */
+	/* what is set up on the kernel demux, to move it in SetSource() */
+	int source;
+	int filter;		/* FILTER_* */
+	struct dmx_sct_filter_params s_flt;	/* without DMX_IMMEDIATE_START */
+	struct dmx_pes_filter_params p_flt;
+	bool running;
+} dmx_pdata;
+enum { FILTER_NONE = 0, FILTER_SECTION, FILTER_PES };
+#define P ((dmx_pdata *)pdata)
+
+/* for cMmapRing::setTap(): everything the producer reads from the demux */
+static void dmx_tap(void *priv, const uint8_t *data, int len)
+{
+	dmx_pdata *p = (dmx_pdata *)priv;
+	if (data && p->stats)
+		p->stats->feed(data, len);
+	if (p->bufsize)
+		p->bufsize->event(len);
+}
+
 cDemux::cDemux(int n)
 {
-	if (n < 0 || n > 2)
+	if (n < 0 || n >= NUM_DEMUX)
 	{
 		lt_info("%s ERROR: n invalid (%d)\n", __FUNCTION__, n);
 		num = 0;
@@ -87,17 +194,29 @@ cDemux::cDemux(int n)
 	else
 		num = n;
 	fd = -1;
+	pdata = calloc(1, sizeof(dmx_pdata));
+	dmx_type = DMX_INVALID;
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(dmx_lock);
+	dmx_list.push_back(this);
 }
 
 cDemux::~cDemux()
 {
 	lt_debug("%s #%d fd: %d\n", __FUNCTION__, num, fd);
 	Close();
+	dmx_lock.lock();
+	dmx_list.remove(this);
+	dmx_lock.unlock();
+	free(pdata);
+	pdata = NULL;
 }
 
 bool cDemux::Open(DMX_CHANNEL_TYPE pes_type, void * /*hVideoBuffer*/, int uBufferSize)
 {
-	int devnum = num;
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(dmx_lock);
+	dmx_init_devices();
+	int devnum = dmx_source[num];
+	const char *devname = dmx_dev[devnum].c_str();
 	int flags = O_RDWR|O_CLOEXEC;
 	if (fd > -1)
 		lt_info("%s FD ALREADY OPENED? fd = %d\n", __FUNCTION__, fd);
@@ -106,19 +225,62 @@ bool cDemux::Open(DMX_CHANNEL_TYPE pes_type, void * /*hVideoBuffer*/, int uBuffe
 	if (pes_type != DMX_PSI_CHANNEL)
 		flags |= O_NONBLOCK;
 
-	fd = open(devname[devnum], flags);
+	if (dmx_type == DMX_VIDEO_CHANNEL)
+		uBufferSize = 0x100000;		/* 1MB */
+	if (dmx_type == DMX_AUDIO_CHANNEL)
+		uBufferSize = 0x10000;		/* 64k */
+
+	std::string share;
+	const char *swsource = getenv("HAL_SWDEMUX");
+	/* export HAL_REC_HUB=1 to have all recordings from one demux device
+	 * share one kernel TS filter, which is read only once */
+	if (!swsource &&
+	    ((getenv("HAL_DMX_SHARE") && (dmx_type == DMX_PSI_CHANNEL || dmx_type == DMX_PES_CHANNEL)) ||
+	     (getenv("HAL_REC_HUB") && dmx_type == DMX_TP_CHANNEL)))
+	{
+		share = std::string("share:") + devname;
+		swsource = share.c_str();
+	}
+	P->nonblock = !!(flags & O_NONBLOCK);
+	if (swsource)
+	{
+		swdmx_output_t out = SWDMX_OUT_TS;
+		if (dmx_type == DMX_PSI_CHANNEL)
+			out = SWDMX_OUT_SECTION;
+		else if (dmx_type == DMX_PES_CHANNEL)
+			out = SWDMX_OUT_PES;
+		P->sw = SWDemux::get(swsource);
+		if (!P->sw)
+			return false;
+		if (dmx_type == DMX_TP_CHANNEL)
+			P->stats = new TSStats();
+		P->swf = new SWFilter(P->sw, out, uBufferSize);
+		if (P->stats)
+			P->swf->getRing()->setTap(dmx_tap, P);
+		fd = P->swf->fd;
+		buffersize = uBufferSize;
+		lt_debug("%s #%d pes_type: %s(%d), uBufferSize: %d swdemux fd: %d\n", __func__,
+			 num, DMX_T[pes_type], pes_type, uBufferSize, fd);
+		return true;
+	}
+
+	/* export HAL_DMX_REACTOR=1 to have all demux fds read by one thread */
+	DmxReactor *reactor = DmxReactor::get();
+	if (reactor)
+		flags |= O_NONBLOCK;
+	fd = open(devname, flags);
 	if (fd < 0)
 	{
-		lt_info("%s %s: %m\n", __FUNCTION__, devname[devnum]);
+		lt_info("%s %s: %m\n", __FUNCTION__, devname);
 		return false;
 	}
+	if (dmx_type == DMX_TP_CHANNEL)
+		P->stats = new TSStats();
+	P->source = devnum;
+	P->filter = FILTER_NONE;
+	P->running = false;
 	lt_debug("%s #%d pes_type: %s(%d), uBufferSize: %d fd: %d\n", __func__,
 		 num, DMX_T[pes_type], pes_type, uBufferSize, fd);
-
-	if (dmx_type == DMX_VIDEO_CHANNEL)
-		uBufferSize = 0x100000;		/* 1MB */
-	if (dmx_type == DMX_AUDIO_CHANNEL)
-		uBufferSize = 0x10000;		/* 64k */
 #if 0
 	if (!pesfds.empty())
 	{
@@ -129,6 +291,13 @@ bool cDemux::Open(DMX_CHANNEL_TYPE pes_type, void * /*hVideoBuffer*/, int uBuffe
 	if (ioctl(fd, DMX_SET_SOURCE, &n) < 0)
 		lt_info("%s DMX_SET_SOURCE %d failed! (%m)\n", __func__, n);
 #endif
+	/* export HAL_DMX_BUFSIZE=<min>:<max> (kB) to adapt the buffer size to the load */
+	P->bufsize = DmxBufSize::create(uBufferSize);
+	if (P->bufsize)
+	{
+		P->bufsize->setFd(fd);
+		uBufferSize = P->bufsize->getSize();
+	}
 	if (uBufferSize > 0)
 	{
 		/* probably uBufferSize == 0 means "use default size". TODO: find a reasonable default */
@@ -136,6 +305,24 @@ bool cDemux::Open(DMX_CHANNEL_TYPE pes_type, void * /*hVideoBuffer*/, int uBuffe
 			lt_info("%s DMX_SET_BUFFER_SIZE failed (%m)\n", __func__);
 	}
 	buffersize = uBufferSize;
+	if (reactor)
+	{
+		/* the reactor reads fd into the ring, Read() waits on the ring */
+		cMmapRing *ring = new cMmapRing(buffersize);
+		ring->setSections(dmx_type == DMX_PSI_CHANNEL);
+		if (P->stats || P->bufsize)
+			ring->setTap(dmx_tap, P);
+		P->reactor_id = (ring->getSize() > 0) ? reactor->addRing(fd, ring) : -1;
+		if (P->reactor_id > 0)
+			P->ring = ring;
+		else
+		{
+			lt_info("%s: cannot use the demux reactor\n", __func__);
+			delete ring;
+			if (dmx_type == DMX_PSI_CHANNEL)
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+		}
+	}
 
 	return true;
 }
@@ -148,9 +335,37 @@ void cDemux::Close(void)
 		lt_info("%s #%d: not open!\n", __FUNCTION__, num);
 		return;
 	}
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(dmx_lock);
 	pesfds.clear();
-	ioctl(fd, DMX_STOP);
-	close(fd);
+	P->filter = FILTER_NONE;
+	if (P->reactor_id > 0)
+	{
+		DmxReactor::get()->remove(P->reactor_id);
+		P->reactor_id = 0;
+	}
+	if (P->ring)
+	{
+		delete P->ring;
+		P->ring = NULL;
+	}
+	delete P->cache;
+	P->cache = NULL;
+	if (P->swf)
+	{
+		delete P->swf;
+		P->sw->put();
+		P->swf = NULL;
+		P->sw = NULL;
+	}
+	else
+	{
+		ioctl(fd, DMX_STOP);
+		close(fd);
+	}
+	delete P->stats;
+	P->stats = NULL;
+	delete P->bufsize;
+	P->bufsize = NULL;
 	fd = -1;
 	if (dmx_type == DMX_TP_CHANNEL)
 	{
@@ -171,7 +386,18 @@ bool cDemux::Start(bool)
 		lt_info("%s #%d: not open!\n", __FUNCTION__, num);
 		return false;
 	}
-	ioctl(fd, DMX_START);
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(dmx_lock);
+	P->running = true;
+	if (P->swf)
+		P->swf->start();
+	else if (P->bufsize)
+		P->bufsize->start();
+	else
+		ioctl(fd, DMX_START);
+	if (P->ring)
+		P->ring->reset();
+	if (P->cache)
+		P->cache->Clear();
 	return true;
 }
 
@@ -183,7 +409,14 @@ bool cDemux::Stop(void)
 		lt_info("%s #%d: not open!\n", __FUNCTION__, num);
 		return false;
 	}
-	ioctl(fd, DMX_STOP);
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(dmx_lock);
+	P->running = false;
+	if (P->swf)
+		P->swf->stop();
+	else if (P->bufsize)
+		P->bufsize->stop();
+	else
+		ioctl(fd, DMX_STOP);
 	return true;
 }
 
@@ -195,6 +428,18 @@ int cDemux::Read(unsigned char *buff, int len, int timeout)
 			__FUNCTION__, num, fd, DMX_T[dmx_type], len, timeout);
 #endif
 	int rc;
+	int64_t end = 0;
+	if ((P->cache || P->sw_crc) && timeout > 0)
+		end = now_ms() + timeout;
+ again:
+	if (P->ring)
+	{
+		/* the ring is filled from fd, so fd must not be read directly */
+		rc = P->ring->read(buff, len, timeout > 0 ? timeout : (P->nonblock ? 0 : -1));
+		if (rc < 0)
+			dmx_err("read: %s", strerror(errno), 0);
+		goto out;
+	}
 	struct pollfd ufds;
 	ufds.fd = fd;
 	ufds.events = POLLIN|POLLPRI|POLLERR;
@@ -235,11 +480,37 @@ int cDemux::Read(unsigned char *buff, int len, int timeout)
 		}
 	}
 
-	rc = ::read(fd, buff, len);
+	if (P->swf)
+		rc = P->swf->read(buff, len, !P->nonblock);
+	else
+	{
+		rc = ::read(fd, buff, len);
+		/* with a ring or the swdemux, the producer feeds the stats */
+		if (P->stats)
+		{
+			if (rc > 0)
+				P->stats->feed(buff, rc);
+			else if (rc < 0 && errno == EOVERFLOW)
+				P->stats->overflow();
+		}
+		if (P->bufsize)
+			P->bufsize->event(rc < 0 ? -errno : rc, len);
+	}
 	//fprintf(stderr, "fd %d ret: %d\n", fd, rc);
 	if (rc < 0)
 		dmx_err("read: %s", strerror(errno), 0);
-
+ out:
+	if (rc > 0 && ((P->sw_crc && dvb_crc32(buff, rc)) || (P->cache && P->cache->Seen(pid, buff, rc))))
+	{
+		/* a broken section or an unchanged repeat, wait for the next one */
+		if (end)
+		{
+			timeout = end - now_ms();
+			if (timeout <= 0)
+				return 0;
+		}
+		goto again;
+	}
 	return rc;
 }
 
@@ -352,9 +623,41 @@ bool cDemux::sectionFilter(unsigned short _pid, const unsigned char * const filt
 	fprintf(stderr,"mask: ");for(int i=0;i<DMX_FILTER_SIZE;i++)fprintf(stderr,"%02hhx ",s_flt.filter.mask  [i]);fprintf(stderr,"\n");
 	fprintf(stderr,"mode: ");for(int i=0;i<DMX_FILTER_SIZE;i++)fprintf(stderr,"%02hhx ",s_flt.filter.mode  [i]);fprintf(stderr,"\n");
 #endif
-	ioctl (fd, DMX_STOP);
+	if (P->swf)
+		return P->swf->setSection(pid, filter, mask, negmask, len,
+					  !!(s_flt.flags & DMX_CHECK_CRC), s_flt.timeout);
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(dmx_lock);
+	P->filter = FILTER_NONE;
+	if (P->bufsize)
+		P->bufsize->stop();
+	else
+		ioctl(fd, DMX_STOP);
+	/* export HAL_DMX_SW_CRC=1 if the driver's CRC check is broken or slow */
+	P->sw_crc = false;
+	if ((s_flt.flags & DMX_CHECK_CRC) && getenv("HAL_DMX_SW_CRC"))
+	{
+		s_flt.flags &= ~DMX_CHECK_CRC;
+		P->sw_crc = true;
+	}
+	if (P->ring)
+		P->ring->reset();
+	if (cSectionCache::Enabled())
+	{
+		if (!P->cache)
+			P->cache = new cSectionCache();
+		P->cache->Clear();
+	}
+	/* a pending resize needs the filter stopped, start() does it */
+	if (P->bufsize)
+		s_flt.flags &= ~DMX_IMMEDIATE_START;
 	if (ioctl(fd, DMX_SET_FILTER, &s_flt) < 0)
 		return false;
+	if (P->bufsize)
+		P->bufsize->start();
+	P->s_flt = s_flt;
+	P->s_flt.flags &= ~DMX_IMMEDIATE_START;
+	P->filter = FILTER_SECTION;
+	P->running = true;
 
 	return true;
 }
@@ -410,7 +713,21 @@ bool cDemux::pesFilter(const unsigned short _pid)
 		lt_info("%s #%d invalid dmx_type %d!\n", __func__, num, dmx_type);
 		return false;
 	}
-	return (ioctl(fd, DMX_SET_PES_FILTER, &p_flt) >= 0);
+	if (P->swf)
+		return P->swf->setPid(pid);
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(dmx_lock);
+	if (P->ring)
+		P->ring->reset();
+	/* DMX_SET_PES_FILTER stops the filter */
+	if (P->bufsize)
+		P->bufsize->stop();
+	P->running = false;
+	P->filter = FILTER_NONE;
+	if (ioctl(fd, DMX_SET_PES_FILTER, &p_flt) < 0)
+		return false;
+	P->p_flt = p_flt;
+	P->filter = FILTER_PES;
+	return true;
 }
 
 void cDemux::SetSyncMode(AVSYNC_TYPE /*mode*/)
@@ -418,10 +735,40 @@ void cDemux::SetSyncMode(AVSYNC_TYPE /*mode*/)
 	lt_debug("%s #%d\n", __FUNCTION__, num);
 }
 
+/* returns a cMmapRing, see mmap_ring.h. Once it is used, Read() also
+ * reads from the ring */
 void *cDemux::getBuffer()
 {
 	lt_debug("%s #%d\n", __FUNCTION__, num);
-	return NULL;
+	if (fd < 0)
+		return NULL;
+	if (P->swf)
+		return P->swf->getRing();
+	if (!P->ring)
+	{
+		cMmapRing *ring = new cMmapRing(buffersize);
+		if (ring->getSize() == 0)
+		{
+			delete ring;
+			return NULL;
+		}
+		ring->setSource(fd);
+		ring->setSections(dmx_type == DMX_PSI_CHANNEL);
+		if (P->stats || P->bufsize)
+			ring->setTap(dmx_tap, P);
+		P->ring = ring;
+	}
+	return P->ring;
+}
+
+bool cDemux::GetStats(unsigned short _pid, dmx_pid_stats *stats)
+{
+	if (!P->stats || !P->stats->get(_pid, stats))
+		return false;
+	cMmapRing *ring = P->swf ? P->swf->getRing() : P->ring;
+	if (ring)
+		stats->overflows += ring->getOverflows();
+	return true;
 }
 
 void *cDemux::getChannel()
@@ -442,10 +789,14 @@ bool cDemux::addPid(unsigned short Pid)
 	}
 	if (fd == -1)
 		lt_info("%s bucketfd not yet opened? pid=%hx\n", __FUNCTION__, Pid);
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(dmx_lock);
 	pfd.fd = fd; /* dummy */
 	pfd.pid = Pid;
 	pesfds.push_back(pfd);
-	ret = (ioctl(fd, DMX_ADD_PID, &Pid));
+	if (P->swf)
+		ret = P->swf->addPid(Pid) ? 0 : -1;
+	else
+		ret = (ioctl(fd, DMX_ADD_PID, &Pid));
 	if (ret < 0)
 		lt_info("%s: DMX_ADD_PID (%m)\n", __func__);
 	return (ret != -1);
@@ -458,11 +809,14 @@ void cDemux::removePid(unsigned short Pid)
 		lt_info("%s pes_type %s not implemented yet! pid=%hx\n", __FUNCTION__, DMX_T[dmx_type], Pid);
 		return;
 	}
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(dmx_lock);
 	for (std::vector<pes_pids>::iterator i = pesfds.begin(); i != pesfds.end(); ++i)
 	{
 		if ((*i).pid == Pid) {
 			lt_debug("removePid: removing demux fd %d pid 0x%04x\n", fd, Pid);
-			if (ioctl(fd, DMX_REMOVE_PID, Pid) < 0)
+			if (P->swf)
+				P->swf->removePid(Pid);
+			else if (ioctl(fd, DMX_REMOVE_PID, Pid) < 0)
 				lt_info("%s: (DMX_REMOVE_PID, 0x%04hx): %m\n", __func__, Pid);
 			pesfds.erase(i);
 			return; /* TODO: what if the same PID is there multiple times */
@@ -488,14 +842,102 @@ int cDemux::getUnit(void)
 	return num;
 }
 
+/* connect unit to another demux device. The filters which are already
+ * running there move along: the new device is set up completely before
+ * it replaces the old one under the same fd, so the users of the fd
+ * (Read(), the ring, the reactor) just continue with the new data */
 bool cDemux::SetSource(int unit, int source)
 {
-	lt_info_c("%s(%d, %d): not implemented yet\n", __func__, unit, source);
+	if (unit >= NUM_DEMUX || unit < 0) {
+		lt_info_c("%s: unit (%d) out of range, NUM_DEMUX %d\n", __func__, unit, NUM_DEMUX);
+		return false;
+	}
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(dmx_lock);
+	dmx_init_devices();
+	if (source < 0 || source >= (int)dmx_dev.size()) {
+		lt_info_c("%s(%d, %d) ERROR: source %d out of range!\n", __func__, unit, source, source);
+		return false;
+	}
+	lt_debug_c("%s(%d, %d) => %d to %d\n", __func__, unit, source, dmx_source[unit], source);
+	dmx_source[unit] = source;
+
+	for (std::list<cDemux *>::iterator i = dmx_list.begin(); i != dmx_list.end(); ++i)
+	{
+		cDemux *d = *i;
+		dmx_pdata *p = (dmx_pdata *)d->pdata;
+		if (d->num != unit || d->fd < 0 || p->source == source)
+			continue;
+		if (p->swf)
+		{
+			/* the userspace demux has no idea of sources */
+			lt_info_c("%s: #%d type %s uses the swdemux, not moved\n", __func__, unit, DMX_T[d->dmx_type]);
+			continue;
+		}
+		const char *devname = dmx_dev[source].c_str();
+		int nfd = open(devname, O_RDWR|O_CLOEXEC|(fcntl(d->fd, F_GETFL) & O_NONBLOCK));
+		if (nfd < 0)
+		{
+			lt_info_c("%s: %s: %m\n", __func__, devname);
+			continue;
+		}
+		int size = p->bufsize ? p->bufsize->getSize() : d->buffersize;
+		if (size > 0 && ioctl(nfd, DMX_SET_BUFFER_SIZE, size) < 0)
+			lt_info_c("%s DMX_SET_BUFFER_SIZE failed (%m)\n", __func__);
+		bool ok = true;
+		if (p->filter == FILTER_SECTION)
+			ok = (ioctl(nfd, DMX_SET_FILTER, &p->s_flt) >= 0);
+		else if (p->filter == FILTER_PES)
+		{
+			ok = (ioctl(nfd, DMX_SET_PES_FILTER, &p->p_flt) >= 0);
+			for (std::vector<pes_pids>::iterator j = d->pesfds.begin(); ok && j != d->pesfds.end(); ++j)
+				if ((*j).pid != p->p_flt.pid)
+					ok = (ioctl(nfd, DMX_ADD_PID, &(*j).pid) >= 0);
+		}
+		if (ok && p->filter != FILTER_NONE && p->running)
+			ok = (ioctl(nfd, DMX_START) >= 0);
+		if (!ok)
+		{
+			lt_info_c("%s: cannot move #%d type %s pid 0x%04hx to %s (%m)\n", __func__,
+				  unit, DMX_T[d->dmx_type], d->pid, devname);
+			close(nfd);
+			continue;
+		}
+		/* the epoll set holds the old file, not the fd number */
+		DmxReactor *reactor = DmxReactor::get();
+		if (p->reactor_id > 0)
+			reactor->remove(p->reactor_id);
+		if (dup3(nfd, d->fd, O_CLOEXEC) < 0)
+			lt_info_c("%s: dup3: %m\n", __func__);
+		else
+			p->source = source;
+		close(nfd);
+		if (p->reactor_id > 0)
+		{
+			p->reactor_id = reactor->addRing(d->fd, p->ring);
+			if (p->reactor_id <= 0)
+			{
+				/* getBuffer() might have handed out the ring, so keep
+				 * it, but let it read fd itself like one without the
+				 * reactor does */
+				lt_info_c("%s: #%d: cannot use the demux reactor\n", __func__, unit);
+				p->ring->setSource(d->fd);
+			}
+		}
+		if (p->cache)
+			p->cache->Clear();
+		lt_info_c("%s: #%d type %s fd %d moved to %s\n", __func__, unit, DMX_T[d->dmx_type], d->fd,
+			  dmx_dev[p->source].c_str());
+	}
 	return true;
 }
 
 int cDemux::GetSource(int unit)
 {
-	lt_info_c("%s(%d): not implemented yet\n", __func__, unit);
-	return 0;
+	if (unit >= NUM_DEMUX || unit < 0) {
+		lt_info_c("%s: unit (%d) out of range, NUM_DEMUX %d\n", __func__, unit, NUM_DEMUX);
+		return -1;
+	}
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(dmx_lock);
+	lt_debug_c("%s(%d) => %d\n", __func__, unit, dmx_source[unit]);
+	return dmx_source[unit];
 }
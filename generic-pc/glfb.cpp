@@ -23,6 +23,7 @@
 */
 
 #include <vector>
+#include <algorithm>
 
 #include <sys/types.h>
 #include <signal.h>
@@ -97,9 +98,16 @@ GLFbPC::GLFbPC(int x, int y, std::vector<unsigned char> &buf): mReInit(true), mS
 	xscale = 1.0;
 	const char *tmp = getenv("GLFB_FULLSCREEN");
 	mFullscreen = !!(tmp);
+	mShader = false;	/* set up in the GL thread */
 
 	mState.blit = true;
-	last_apts = 0;
+	mState.yuv = false;
+	mState.program = 0;
+	yuv_cs = 0;
+	mVClock = 0;
+	mVClockSet = false;
+	mDropped = 0;
+	mTimer = false;
 
 	/* linux framebuffer compat mode */
 	si.bits_per_pixel = 32;
@@ -213,6 +221,11 @@ void GLFramebuffer::run()
 			glutSpecialFunc(GLFbPC::specialcb);
 			glutReshapeFunc(GLFbPC::resizecb);
 			glfb_priv->setupGLObjects(); /* needs GLEW prototypes */
+			/* GLFB_RGB: let the decoder convert to RGB as before */
+			if (GLEW_VERSION_2_0 && !getenv("GLFB_RGB"))
+				glfb_priv->mShader = glfb_priv->setupShader();
+			lt_info("GLFB: video colorspace conversion by %s\n",
+				glfb_priv->mShader ? "shader" : "swscale");
 			glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_CONTINUE_EXECUTION);
 			glutMainLoop();
 			glfb_priv->releaseGLObjects();
@@ -279,12 +292,107 @@ void GLFbPC::setupGLObjects()
 }
 
 
+/* the video planes are luminance textures (NV12: UV as luminance / alpha)
+ * which are combined with the matrix and offset for the colorspace, see
+ * setYUVMatrix(). Only a fragment shader, the vertices and texture
+ * coordinates come from the fixed function pipeline */
+static const char *yuv_shader =
+	"uniform sampler2D ytex;\n"
+	"uniform sampler2D utex;\n"
+	"uniform sampler2D vtex;\n"
+	"uniform bool nv12;\n"
+	"uniform mat3 matrix;\n"
+	"uniform vec3 offset;\n"
+	"void main()\n"
+	"{\n"
+	"	vec3 yuv;\n"
+	"	yuv.x = texture2D(ytex, gl_TexCoord[0].st).r;\n"
+	"	if (nv12)\n"
+	"		yuv.yz = texture2D(utex, gl_TexCoord[0].st).ra;\n"
+	"	else {\n"
+	"		yuv.y = texture2D(utex, gl_TexCoord[0].st).r;\n"
+	"		yuv.z = texture2D(vtex, gl_TexCoord[0].st).r;\n"
+	"	}\n"
+	"	gl_FragColor = vec4(matrix * (yuv - offset), 1.0);\n"
+	"}\n";
+
+bool GLFbPC::setupShader()
+{
+	char log[1024];
+	GLint ok = 0;
+	GLuint shader = glCreateShader(GL_FRAGMENT_SHADER);
+	glShaderSource(shader, 1, &yuv_shader, NULL);
+	glCompileShader(shader);
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+	if (!ok) {
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		lt_info("GLFB: compiling the YUV shader failed: %s\n", log);
+		glDeleteShader(shader);
+		return false;
+	}
+	mState.program = glCreateProgram();
+	glAttachShader(mState.program, shader);
+	glLinkProgram(mState.program);
+	glDeleteShader(shader); /* stays attached */
+	glGetProgramiv(mState.program, GL_LINK_STATUS, &ok);
+	if (!ok) {
+		glGetProgramInfoLog(mState.program, sizeof(log), NULL, log);
+		lt_info("GLFB: linking the YUV shader failed: %s\n", log);
+		glDeleteProgram(mState.program);
+		mState.program = 0;
+		return false;
+	}
+	glUseProgram(mState.program);
+	glUniform1i(glGetUniformLocation(mState.program, "ytex"), 0);
+	glUniform1i(glGetUniformLocation(mState.program, "utex"), 1);
+	glUniform1i(glGetUniformLocation(mState.program, "vtex"), 2);
+	glUseProgram(0);
+
+	glGenTextures(3, mState.yuvtex);
+	for (int i = 0; i < 3; i++) {
+		glBindTexture(GL_TEXTURE_2D, mState.yuvtex[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		/* no chroma from the opposite edge */
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return true;
+}
+
+/* Y'CbCr -> R'G'B' for BT.601 or BT.709, limited (16-235 / 16-240) or
+ * full range. The shader subtracts the offset and multiplies */
+void GLFbPC::setYUVMatrix(bool bt709, bool full_range, bool nv12)
+{
+	float kr = bt709 ? 0.2126 : 0.299;
+	float kb = bt709 ? 0.0722 : 0.114;
+	float kg = 1.0 - kr - kb;
+	float ys = full_range ? 1.0 : 255.0 / 219.0;
+	float cs = full_range ? 1.0 : 255.0 / 224.0;
+	float m[9] = {	/* row major */
+		ys, 0.0,				cs * 2 * (1 - kr),
+		ys, -cs * 2 * kb * (1 - kb) / kg,	-cs * 2 * kr * (1 - kr) / kg,
+		ys, cs * 2 * (1 - kb),			0.0
+	};
+	float o[3] = { full_range ? 0.0f : 16.0f / 255, 128.0f / 255, 128.0f / 255 };
+	glUseProgram(mState.program);
+	glUniformMatrix3fv(glGetUniformLocation(mState.program, "matrix"), 1, GL_TRUE, m);
+	glUniform3fv(glGetUniformLocation(mState.program, "offset"), 1, o);
+	glUniform1i(glGetUniformLocation(mState.program, "nv12"), nv12);
+	glUseProgram(0);
+}
+
 void GLFbPC::releaseGLObjects()
 {
 	glDeleteBuffers(1, &mState.pbo);
 	glDeleteBuffers(1, &mState.displaypbo);
 	glDeleteTextures(1, &mState.osdtex);
 	glDeleteTextures(1, &mState.displaytex);
+	if (mState.program) {
+		glDeleteProgram(mState.program);
+		glDeleteTextures(3, mState.yuvtex);
+	}
 }
 
 
@@ -293,6 +401,12 @@ void GLFbPC::releaseGLObjects()
 	glfb_priv->render();
 }
 
+/* static */ void GLFbPC::timercb(int)
+{
+	glfb_priv->mTimer = false;
+	glutPostRedisplay();
+}
+
 
 /* static */ void GLFbPC::keyboardcb(unsigned char key, int /*x*/, int /*y*/)
 {
@@ -335,7 +449,8 @@ void GLFbPC::releaseGLObjects()
 	write(glfb_priv->input_fd, &ev, sizeof(ev));
 }
 
-int sleep_us = 30000;
+/* redraw at least this often for the OSD, in ms */
+#define RENDER_IDLE_MS 30
 
 void GLFbPC::render()
 {
@@ -388,7 +503,7 @@ void GLFbPC::render()
 	if (!mFullscreen && (*mX != glutGet(GLUT_WINDOW_WIDTH) || *mY != glutGet(GLUT_WINDOW_HEIGHT)))
 		glutReshapeWindow(*mX, *mY);
 
-	bltDisplayBuffer(); /* decoded video stream */
+	int wait = bltDisplayBuffer(); /* decoded video stream */
 	if (mState.blit) {
 		/* only blit manually after fb->blit(), this helps to find missed blit() calls */
 		mState.blit = false;
@@ -449,8 +564,18 @@ void GLFbPC::render()
 				break;
 		}
 	}
-	glBindTexture(GL_TEXTURE_2D, mState.displaytex);
-	drawSquare(zoom, xscale);
+	if (mState.yuv) {
+		glUseProgram(mState.program);
+		for (int i = 2; i >= 0; i--) { /* ends with unit 0 active */
+			glActiveTexture(GL_TEXTURE0 + i);
+			glBindTexture(GL_TEXTURE_2D, mState.yuvtex[i]);
+		}
+		drawSquare(zoom, xscale);
+		glUseProgram(0);
+	} else {
+		glBindTexture(GL_TEXTURE_2D, mState.displaytex);
+		drawSquare(zoom, xscale);
+	}
 	glBindTexture(GL_TEXTURE_2D, mState.osdtex);
 	drawSquare(1.0, -100);
 
@@ -460,9 +585,12 @@ void GLFbPC::render()
 	GLuint err = glGetError();
 	if (err != 0)
 		lt_info("GLFB::%s: GLError:%d 0x%04x\n", __func__, err, err);
-	if (sleep_us > 0)
-		usleep(sleep_us);
-	glutPostRedisplay();
+	/* sleep until the next frame is due, resizes etc. also call render(),
+	 * but there is only one timer */
+	if (!mTimer) {
+		mTimer = true;
+		glutTimerFunc(wait, timercb, 0);
+	}
 }
 
 /* static */ void GLFbPC::resizecb(int w, int h)
@@ -558,22 +686,63 @@ void GLFbPC::bltOSDBuffer()
 	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
 
-void GLFbPC::bltDisplayBuffer()
+/* a frame is shown when the clock reaches its pts: the clock of the audio
+ * being heard, or without audio, the system clock set to the first frame.
+ * If the next frame is due as well, the current one is late and dropped;
+ * if no frame is due, the last one stays (is repeated) */
+int GLFbPC::bltDisplayBuffer()
 {
 	if (!vdec) /* cannot start yet */
-		return;
+		return RENDER_IDLE_MS;
 	static bool warn = true;
-	VDec::SWFramebuffer *buf = vdec->getDecBuf();
+	VDec::SWFramebuffer *buf = vdec->peekDecBuf(0);
 	if (!buf) {
 		if (warn)
 			lt_info("GLFB::%s did not get a buffer...\n", __func__);
 		warn = false;
-		return;
+		return RENDER_IDLE_MS;
 	}
 	warn = true;
+
+	const int64_t slack = 90000/500; /* 2ms early is still in time */
+	int64_t clock = adec ? adec->getClock() : AV_NOPTS_VALUE;
+	bool audio = (clock != AV_NOPTS_VALUE);
+	if (!audio) {
+		clock = clock_90k() + mVClock;
+		/* first frame, or a jump: start the video clock at this frame */
+		if (buf->pts() != AV_NOPTS_VALUE &&
+		    (!mVClockSet || llabs(buf->pts() - clock) > 90000 * 5)) {
+			mVClock = buf->pts() - clock_90k();
+			clock = buf->pts();
+			mVClockSet = true;
+		}
+	} else
+		mVClockSet = false;
+
+	int64_t pts = buf->pts();
+	int64_t diff = 0;
+	/* a still picture, or out of sync by far: show it now */
+	if (pts != AV_NOPTS_VALUE && llabs(pts - clock) <= 90000 * 5)
+		diff = pts - clock;
+	if (diff > slack)
+		return std::min<int64_t>((diff + 89) / 90, RENDER_IDLE_MS);
+	VDec::SWFramebuffer *next;
+	while ((next = vdec->peekDecBuf(1)) && next->pts() != AV_NOPTS_VALUE &&
+	       next->pts() - clock <= slack && next->pts() - clock > -90000 * 5) {
+		vdec->dropDecBuf();
+		mDropped++;
+		lt_debug("GLFB::%s: dropped late frame, pts 0x%" PRIx64 " (%d)\n",
+			__func__, pts, mDropped);
+		pts = next->pts();
+	}
+	int wait = RENDER_IDLE_MS;
+	if (next && next->pts() != AV_NOPTS_VALUE && next->pts() - clock < 90000 * 5)
+		wait = std::max<int64_t>(0, std::min<int64_t>((next->pts() - clock + 89) / 90, RENDER_IDLE_MS));
+
+	buf = vdec->getDecBuf();
 	int w = buf->width(), h = buf->height();
 	if (w == 0 || h == 0)
-		return;
+		return wait;
 
 	AVRational a = buf->AR();
 	if (a.den != 0 && a.num != 0 && av_cmp_q(a, _mVA)) {
@@ -584,37 +753,41 @@ void GLFbPC::bltDisplayBuffer()
 	}
 
 	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mState.displaypbo);
-	glBufferData(GL_PIXEL_UNPACK_BUFFER, buf->size(), &(*buf)[0], GL_STREAM_DRAW_ARB);
-
-	glBindTexture(GL_TEXTURE_2D, mState.displaytex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+	if (buf->format() == VDec::SWFramebuffer::RGB32) {
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, buf->size(), &(*buf)[0], GL_STREAM_DRAW_ARB);
+		glBindTexture(GL_TEXTURE_2D, mState.displaytex);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+		mState.yuv = false;
+	} else {
+		/* planes as laid out by avpicture_fill(), no padding */
+		bool nv12 = (buf->format() == VDec::SWFramebuffer::NV12);
+		int cw = (w + 1) / 2, ch = (h + 1) / 2;
+		char *u = (char *)0 + w * h;
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, w * h + cw * ch * 2, &(*buf)[0], GL_STREAM_DRAW_ARB);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glBindTexture(GL_TEXTURE_2D, mState.yuvtex[0]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, w, h, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, 0);
+		glBindTexture(GL_TEXTURE_2D, mState.yuvtex[1]);
+		if (nv12)
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE_ALPHA, cw, ch, 0, GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, u);
+		else {
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, cw, ch, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, u);
+			glBindTexture(GL_TEXTURE_2D, mState.yuvtex[2]);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, cw, ch, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, u + cw * ch);
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		/* only update the uniforms if something changed */
+		int cs = buf->bt709() | buf->fullRange() << 1 | nv12 << 2;
+		if (!mState.yuv || cs != yuv_cs)
+			setYUVMatrix(buf->bt709(), buf->fullRange(), nv12);
+		yuv_cs = cs;
+		mState.yuv = true;
+	}
 
 	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
-	/* "rate control" mechanism starts here...
-	 * this implementation is pretty naive and not working too well, but
-	 * better this than nothing... :-) */
-	int64_t apts = 0;
-	int64_t vpts = buf->pts();
-	if (adec)
-		apts = adec->getPts();
-	if (apts != last_apts) {
-		int rate, dummy1, dummy2;
-		if (apts < vpts)
-			sleep_us = (sleep_us * 2 + (vpts - apts)*10/9) / 3;
-		else if (sleep_us > 1000)
-			sleep_us -= 1000;
-		last_apts = apts;
-		vdec->getPictureInfo(dummy1, dummy2, rate);
-		if (rate > 0)
-			rate = 2000000 / rate; /* limit to half the frame rate */
-		else
-			rate = 50000; /* minimum 20 fps */
-		if (sleep_us > rate)
-			sleep_us = rate;
-		else if (sleep_us < 1)
-			sleep_us = 1;
-	}
-	lt_debug("vpts: 0x%" PRIx64 " apts: 0x%" PRIx64 " diff: %6.3f sleep_us %d buf %d\n",
-			buf->pts(), apts, (buf->pts() - apts)/90000.0, sleep_us, vdec->buf_num);
+	lt_debug("vpts: 0x%" PRIx64 " clock: 0x%" PRIx64 " (%s) diff: %6.3f next in %d ms, queued %d\n",
+			buf->pts(), clock, audio ? "audio" : "video", (buf->pts() - clock)/90000.0,
+			wait, vdec->queued());
+	return wait;
 }
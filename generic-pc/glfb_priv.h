@@ -62,6 +62,7 @@ private:
 	int mCrop;			/* DISPLAY_AR_MODE */
 
 	bool mFullscreen;		/* fullscreen? */
+	bool mShader;			/* YUV video is converted by a fragment shader */
 	bool mReInit;			/* setup things for GL */
 	OpenThreads::Mutex mReInitLock;
 	bool mShutDown;			/* if set main loop is left */
@@ -74,10 +75,14 @@ private:
 	std::map<unsigned char, int> mKeyMap;
 	std::map<int, int> mSpecialMap;
 	int input_fd;
-	int64_t last_apts;
+	int64_t mVClock;		/* without audio: pts - clock_90k() */
+	bool mVClockSet;
+	unsigned int mDropped;		/* late video frames */
+	bool mTimer;			/* the next render() is scheduled */
 	void run();
 
 	static void rendercb();		/* callback for GLUT */
+	static void timercb(int);
 	void render();			/* actual render function */
 	static void keyboardcb(unsigned char key, int x, int y);
 	static void specialcb(int key, int x, int y);
@@ -90,6 +95,9 @@ private:
 	void setupOSDBuffer();		/* create the OSD buffer */
 #endif
 	void setupGLObjects();		/* PBOs, textures and stuff */
+	bool setupShader();		/* YUV -> RGB program */
+	void setYUVMatrix(bool bt709, bool full_range, bool nv12);
+	int yuv_cs;			/* what setYUVMatrix() was called with */
 	void releaseGLObjects();
 	void drawSquare(float size, float x_factor = 1);	/* do not be square */
 
@@ -100,10 +108,13 @@ private:
 		GLuint pbo;		/* PBO we use for transfer to texture */
 		GLuint displaytex;	/* holds the display texture */
 		GLuint displaypbo;
+		GLuint yuvtex[3];	/* Y, U, V planes (U = UV for NV12) */
+		GLuint program;		/* converts yuvtex */
+		bool yuv;		/* the video is in yuvtex, not in displaytex */
 		bool blit;
 	} mState;
 
 	void bltOSDBuffer();
-	void bltDisplayBuffer();
+	int bltDisplayBuffer();		/* returns ms until the next frame is due */
 };
 #endif
@@ -35,11 +35,10 @@ extern "C" {
 
 /* ffmpeg buf 32k */
 #define INBUF_SIZE 0x8000
-/* my own buf 256k */
-#define DMX_BUF_SZ 0x20000
 
 #include "video_hal.h"
 #include "dmx_hal.h"
+#include "mmap_ring.h"
 #include "glfb_priv.h"
 #include "video_priv.h"
 #include "lt_debug.h"
@@ -55,9 +54,6 @@ int system_rev = 0;
 
 extern bool HAL_nodec;
 
-static uint8_t *dmxbuf;
-static int bufpos;
-
 static const AVRational aspect_ratios[6] = {
 	{  1, 1 },
 	{  4, 3 },
@@ -78,15 +74,27 @@ cVideo::cVideo(int, void *, void *, unsigned int)
 VDec::VDec()
 {
 	av_register_all();
-	if (!HAL_nodec)
-		dmxbuf = (uint8_t *)malloc(DMX_BUF_SZ);
-	bufpos = 0;
 	thread_running = false;
 	w_h_changed = false;
 	dec_w = dec_h = 0;
-	buf_num = 0;
 	buf_in = 0;
 	buf_out = 0;
+	buf_drop = 0;
+	last = NULL;
+	disp_pts = 0;
+	disp_geo = 0;
+	sem_init(&buf_free, 0, 0);
+	buf_max = VDEC_FRAMES;
+	const char *tmp = getenv("HAL_VDEC_FRAMES");
+	if (tmp) {
+		/* at least one each to decode, queue and display */
+		buf_max = atoi(tmp);
+		if (buf_max < 3)
+			buf_max = 3;
+		if (buf_max > VDEC_MAXFRAMES)
+			buf_max = VDEC_MAXFRAMES;
+		lt_info("%s: %d frames\n", __func__, buf_max);
+	}
 	pig_x = pig_y = pig_w = pig_h = 0;
 	display_aspect = DISPLAY_AR_16_9;
 	display_crop = DISPLAY_AR_MODE_LETTERBOX;
@@ -95,7 +103,7 @@ VDec::VDec()
 
 VDec::~VDec(void)
 {
-	free(dmxbuf);
+	sem_destroy(&buf_free);
 }
 
 cVideo::~cVideo(void)
@@ -132,17 +140,16 @@ int cVideo::getAspectRatio(void)
 
 int VDec::getAspectRatio(void)
 {
-	buf_m.lock();
 	int ret = 0;
 	int w, h, ar;
 	AVRational a;
-	if (buf_num == 0)
-		goto out;
-	a = buffers[buf_out].AR();
-	w = buffers[buf_out].width();
-	h = buffers[buf_out].height();
+	uint64_t geo = __atomic_load_n(&disp_geo, __ATOMIC_RELAXED);
+	w = geo >> 48;
+	h = (geo >> 32) & 0xffff;
+	a.num = (geo >> 16) & 0xffff;
+	a.den = geo & 0xffff;
 	if (a.den == 0 || h == 0)
-		goto out;
+		return 0;
 	ar = w * 100 * a.num / h / a.den;
 	if (ar < 100 || ar > 225) /* < 4:3, > 20:9 */
 		; /* ret = 0: N/A */
@@ -154,8 +161,6 @@ int VDec::getAspectRatio(void)
 		ret = 3;
 	else
 		ret = 4;	/* 20:9 */
- out:
-	buf_m.unlock();
 	return ret;
 }
 
@@ -188,6 +193,7 @@ int VDec::Stop(bool)
 	lt_debug("%s running %d >\n", __func__, thread_running);
 	if (thread_running) {
 		thread_running = false;
+		sem_post(&buf_free);	/* in case it waits for a frame */
 		OpenThreads::Thread::join();
 	}
 	lt_debug("%s running %d <\n", __func__, thread_running);
@@ -321,11 +327,13 @@ void VDec::ShowPicture(const char *fname)
 		struct SwsContext *convert = sws_getContext(c->width, c->height, c->pix_fmt,
 							    c->width, c->height, PIX_FMT_RGB32,
 							    SWS_BICUBIC, 0, 0, 0);
+		SWFramebuffer *f = NULL;
 		if (!convert)
 			lt_info("%s: ERROR setting up SWS context\n", __func__);
-		else {
-			buf_m.lock();
-			SWFramebuffer *f = &buffers[buf_in];
+		else if (!(f = getFreeBuf())) {
+			lt_info("%s: no free frame\n", __func__);
+			sws_freeContext(convert);
+		} else {
 			if (f->size() < need)
 				f->resize(need);
 			avpicture_fill((AVPicture *)rgbframe, &(*f)[0], PIX_FMT_RGB32,
@@ -335,19 +343,11 @@ void VDec::ShowPicture(const char *fname)
 			sws_freeContext(convert);
 			f->width(c->width);
 			f->height(c->height);
+			f->format(SWFramebuffer::RGB32);
 			f->pts(AV_NOPTS_VALUE);
 			AVRational a = av_guess_sample_aspect_ratio(avfc, avfc->streams[stream_id], frame);
 			f->AR(a);
-			buf_in++;
-			buf_in %= VDEC_MAXBUFS;
-			buf_num++;
-			if (buf_num > (VDEC_MAXBUFS - 1)) {
-				lt_info("%s: buf_num overflow\n", __func__);
-				buf_out++;
-				buf_out %= VDEC_MAXBUFS;
-				buf_num--;
-			}
-			buf_m.unlock();
+			queueBuf(f);
 		}
 	}
 	av_free_packet(&avpkt);
@@ -413,43 +413,194 @@ int VDec::SetStreamType(VIDEO_FORMAT v)
 	return 0;
 }
 
+VDec::SWFramebuffer *VDec::peekDecBuf(int n)
+{
+	unsigned int in = __atomic_load_n(&buf_in, __ATOMIC_ACQUIRE);
+	unsigned int drop = __atomic_load_n(&buf_drop, __ATOMIC_ACQUIRE);
+	unsigned int out = buf_out;
+	if (out != in && (int)(drop - out) > 0) {
+		while (out != in && (int)(drop - out) > 0)
+			unrefBuf(queue[out++ % VDEC_MAXFRAMES]);
+		__atomic_store_n(&buf_out, out, __ATOMIC_RELEASE);
+	}
+	if (in - out <= (unsigned int)n)
+		return NULL;
+	return queue[(out + n) % VDEC_MAXFRAMES];
+}
+
+void VDec::dropDecBuf(void)
+{
+	SWFramebuffer *p = peekDecBuf(0);
+	if (!p)
+		return;
+	__atomic_store_n(&buf_out, buf_out + 1, __ATOMIC_RELEASE);
+	unrefBuf(p);
+}
+
 VDec::SWFramebuffer *VDec::getDecBuf(void)
 {
-	buf_m.lock();
-	if (buf_num == 0) {
-		buf_m.unlock();
+	SWFramebuffer *p = peekDecBuf(0);
+	if (!p)
 		return NULL;
+	__atomic_store_n(&buf_out, buf_out + 1, __ATOMIC_RELEASE);
+	/* the reference of the queue now belongs to last */
+	SWFramebuffer *old = __atomic_exchange_n(&last, p, __ATOMIC_ACQ_REL);
+	if (old)
+		unrefBuf(old);
+
+	AVRational a = p->AR();
+	if (a.num > 0xffff || a.den > 0xffff)
+		av_reduce(&a.num, &a.den, a.num, a.den, 0xffff);
+	uint64_t geo = (uint64_t)(p->width() & 0xffff) << 48 | (uint64_t)(p->height() & 0xffff) << 32 |
+		(uint64_t)(a.num & 0xffff) << 16 | (a.den & 0xffff);
+	__atomic_store_n(&disp_pts, p->pts(), __ATOMIC_RELAXED);
+	__atomic_store_n(&disp_geo, geo, __ATOMIC_RELAXED);
+	return p;
+}
+
+int VDec::queued(void)
+{
+	return __atomic_load_n(&buf_in, __ATOMIC_RELAXED) - __atomic_load_n(&buf_out, __ATOMIC_RELAXED);
+}
+
+/* instead of dropping frames when the renderer is behind, the decoder
+ * waits here, and so does not read from the demux */
+VDec::SWFramebuffer *VDec::getFreeBuf(void)
+{
+	bool dec = thread_running;	/* else ShowPicture(): give up after 1s */
+	for (int i = 0; dec || i < 10; i++) {
+		for (int j = 0; j < buf_max; j++) {
+			int free = 0;
+			if (__atomic_compare_exchange_n(&buffers[j].mRefs, &free, 1, false,
+							__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return &buffers[j];
+		}
+		if (dec && !thread_running)
+			break;
+		/* one post per released frame, a stale one only costs a loop */
+		struct timespec t;
+		clock_gettime(CLOCK_REALTIME, &t);
+		t.tv_nsec += 100000000;
+		if (t.tv_nsec >= 1000000000) {
+			t.tv_sec++;
+			t.tv_nsec -= 1000000000;
+		}
+		sem_timedwait(&buf_free, &t);
 	}
-	SWFramebuffer *p = &buffers[buf_out];
-	buf_out++;
-	buf_num--;
-	buf_out %= VDEC_MAXBUFS;
+	return NULL;
+}
+
+void VDec::queueBuf(SWFramebuffer *f)
+{
+	buf_m.lock();
+	unsigned int in = buf_in;
+	queue[in % VDEC_MAXFRAMES] = f;
+	/* the frame's data and metadata are visible before the new index */
+	__atomic_store_n(&buf_in, in + 1, __ATOMIC_RELEASE);
 	buf_m.unlock();
-	return p;
 }
 
+void VDec::unrefBuf(SWFramebuffer *f)
+{
+	if (__atomic_sub_fetch(&f->mRefs, 1, __ATOMIC_ACQ_REL) == 0)
+		sem_post(&buf_free);
+}
+
+VDec::SWFramebuffer *VDec::refLast(void)
+{
+	for (int i = 0; i < 10; i++) {
+		SWFramebuffer *f = __atomic_load_n(&last, __ATOMIC_ACQUIRE);
+		if (!f)
+			return NULL;
+		/* only if it is still referenced, a free frame may be reused */
+		int refs = __atomic_load_n(&f->mRefs, __ATOMIC_RELAXED);
+		while (refs > 0 && !__atomic_compare_exchange_n(&f->mRefs, &refs, refs + 1, false,
+								__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			;
+		if (refs == 0)
+			continue;
+		/* the renderer holds it as long as it is last */
+		if (__atomic_load_n(&last, __ATOMIC_ACQUIRE) == f)
+			return f;
+		unrefBuf(f);
+	}
+	return NULL;
+}
+
+void VDec::flushBufs(void)
+{
+	buf_m.lock();
+	__atomic_store_n(&buf_drop, buf_in, __ATOMIC_RELEASE);
+	buf_m.unlock();
+}
+
+/* frame threading delays the output by one frame per thread. The audio
+ * clock waits for the output latency of the audio device anyway, but more
+ * delay than that leaves the first frames behind the audio */
+#define VDEC_MAX_THREAD_DELAY 300 /* ms */
+
+/* HAL_VDEC_THREADS=n decoder threads, default (0) is one per CPU, but
+ * with frame threading not more than fit into VDEC_MAX_THREAD_DELAY.
+ * HAL_VDEC_THREAD_TYPE=frame or slice, default is both and the codec
+ * uses what it supports. Frame threading is faster, but adds a frame
+ * of delay per thread */
+static void set_threads(AVCodecContext *c, AVStream *st)
+{
+	int threads = 0;
+	int max = 16; /* more do not help, only use memory */
+	const char *tmp = getenv("HAL_VDEC_THREADS");
+	if (tmp)
+		threads = atoi(tmp);
+	c->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+	tmp = getenv("HAL_VDEC_THREAD_TYPE");
+	if (tmp && !strcmp(tmp, "frame"))
+		c->thread_type = FF_THREAD_FRAME;
+	else if (tmp && !strcmp(tmp, "slice"))
+		c->thread_type = FF_THREAD_SLICE;
+	if (c->thread_type & FF_THREAD_FRAME) {
+		/* the frame duration in ms, 40 (25fps) if not known yet */
+		int dur = 40;
+		if (st->r_frame_rate.num > 0 && st->r_frame_rate.den > 0)
+			dur = 1000 * st->r_frame_rate.den / st->r_frame_rate.num;
+		else if (c->time_base.num > 0 && c->time_base.den > 0 && c->ticks_per_frame > 0)
+			dur = 1000 * c->time_base.num * c->ticks_per_frame / c->time_base.den;
+		if (dur < 1)
+			dur = 1;
+		/* (threads - 1) * dur < VDEC_MAX_THREAD_DELAY */
+		if (max > 1 + (VDEC_MAX_THREAD_DELAY - 1) / dur)
+			max = 1 + (VDEC_MAX_THREAD_DELAY - 1) / dur;
+		if ((threads - 1) * dur >= VDEC_MAX_THREAD_DELAY)
+			lt_info_c("%s: HAL_VDEC_THREADS=%d: frame threading delays the video by %d ms (>= %d ms)\n",
+				__func__, threads, (threads - 1) * dur, VDEC_MAX_THREAD_DELAY);
+	}
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads < 1)
+			threads = 1;
+		if (threads > max)
+			threads = max;
+	}
+	c->thread_count = threads;
+}
+
+/* copy straight from the demux ring into libavformat's buffer */
 static int my_read(void *, uint8_t *buf, int buf_size)
 {
+	cMmapRing *ring;
+	uint8_t *data;
+	int n = 0;
 	int tmp = 0;
-	if (videoDecoder && bufpos < DMX_BUF_SZ - 4096) {
-		while (bufpos < buf_size && ++tmp < 20) { /* retry max 20 times */
-			int ret = videoDemux->Read(dmxbuf + bufpos, DMX_BUF_SZ - bufpos, 20);
-			if (ret > 0)
-				bufpos += ret;
-		}
-	}
-	if (bufpos == 0)
+	if (!videoDecoder || !(ring = (cMmapRing *)videoDemux->getBuffer()))
 		return 0;
-	if (bufpos > buf_size) {
-		memcpy(buf, dmxbuf, buf_size);
-		memmove(dmxbuf, dmxbuf + buf_size, bufpos - buf_size);
-		bufpos -= buf_size;
-		return buf_size;
-	}
-	memcpy(buf, dmxbuf, bufpos);
-	tmp = bufpos;
-	bufpos = 0;
-	return tmp;
+	while (n <= 0 && ++tmp < 20) /* retry max 20 times */
+		n = ring->peek(&data, 20);
+	if (n <= 0)
+		return 0;
+	if (n > buf_size)
+		n = buf_size;
+	memcpy(buf, data, n);
+	ring->release(n);
+	return n;
 }
 
 void VDec::run(void)
@@ -467,10 +618,7 @@ void VDec::run(void)
 	time_t warn_r = 0; /* last read error */
 	time_t warn_d = 0; /* last decode error */
 
-	bufpos = 0;
-	buf_num = 0;
-	buf_in = 0;
-	buf_out = 0;
+	flushBufs();
 	dec_r = 0;
 
 	av_init_packet(&avpkt);
@@ -510,10 +658,14 @@ void VDec::run(void)
 		lt_info("%s: Codec for %s not found\n", __func__, avcodec_get_name(c->codec_id));
 		goto out;
 	}
+	set_threads(c, avfc->streams[0]);
 	if (avcodec_open2(c, codec, NULL) < 0) {
 		lt_info("%s: Could not open codec\n", __func__);
 		goto out;
 	}
+	lt_info("%s: %d thread(s), %s\n", __func__, c->thread_count,
+		(c->active_thread_type & FF_THREAD_FRAME) ? "frame threading" :
+		(c->active_thread_type & FF_THREAD_SLICE) ? "slice threading" : "no threading");
 	frame = avcodec_alloc_frame();
 	rgbframe = avcodec_alloc_frame();
 	if (!frame || !rgbframe) {
@@ -543,22 +695,51 @@ void VDec::run(void)
 		if (avpkt.size > len)
 			lt_info("%s: WARN: pkt->size %d != len %d\n", __func__, avpkt.size, len);
 		if (got_frame) {
-			unsigned int need = avpicture_get_size(PIX_FMT_RGB32, c->width, c->height);
-			convert = sws_getCachedContext(convert,
-						       c->width, c->height, c->pix_fmt,
-						       c->width, c->height, PIX_FMT_RGB32,
-						       SWS_BICUBIC, 0, 0, 0);
-			if (!convert)
+			/* if the GL side can convert it, only copy the planes, that is
+			 * cheaper than sws_scale and less than half of the upload */
+			enum PixelFormat fmt = PIX_FMT_RGB32;
+			SWFramebuffer::fmt ffmt = SWFramebuffer::RGB32;
+			if (glfb_priv && glfb_priv->mShader) {
+				switch (c->pix_fmt) {
+				case PIX_FMT_YUV420P:
+				case PIX_FMT_YUVJ420P:
+					fmt = PIX_FMT_YUV420P;
+					ffmt = SWFramebuffer::YUV420P;
+					break;
+				case PIX_FMT_NV12:
+					fmt = PIX_FMT_NV12;
+					ffmt = SWFramebuffer::NV12;
+					break;
+				default:
+					break;
+				}
+			}
+			unsigned int need = avpicture_get_size(fmt, c->width, c->height);
+			if (fmt == PIX_FMT_RGB32)
+				convert = sws_getCachedContext(convert,
+							       c->width, c->height, c->pix_fmt,
+							       c->width, c->height, PIX_FMT_RGB32,
+							       SWS_BICUBIC, 0, 0, 0);
+			SWFramebuffer *f = NULL;
+			if (fmt == PIX_FMT_RGB32 && !convert)
 				lt_info("%s: ERROR setting up SWS context\n", __func__);
-			else {
-				buf_m.lock();
-				SWFramebuffer *f = &buffers[buf_in];
+			else if ((f = getFreeBuf())) {
+				/* the frame is ours, no need to lock */
 				if (f->size() < need)
 					f->resize(need);
-				avpicture_fill((AVPicture *)rgbframe, &(*f)[0], PIX_FMT_RGB32,
+				avpicture_fill((AVPicture *)rgbframe, &(*f)[0], fmt,
 						c->width, c->height);
-				sws_scale(convert, frame->data, frame->linesize, 0, c->height,
-						rgbframe->data, rgbframe->linesize);
+				if (fmt == PIX_FMT_RGB32)
+					sws_scale(convert, frame->data, frame->linesize, 0, c->height,
+							rgbframe->data, rgbframe->linesize);
+				else
+					av_picture_copy((AVPicture *)rgbframe, (AVPicture *)frame, fmt,
+							c->width, c->height);
+				/* untagged streams: HD is BT.709, SD is BT.601 */
+				bool bt709 = c->colorspace == AVCOL_SPC_BT709 ||
+					(c->colorspace == AVCOL_SPC_UNSPECIFIED && c->height > 576);
+				bool full = c->pix_fmt == PIX_FMT_YUVJ420P || c->color_range == AVCOL_RANGE_JPEG;
+				f->format(ffmt, bt709, full);
 				if (dec_w != c->width || dec_h != c->height) {
 					lt_info("%s: pic changed %dx%d -> %dx%d\n", __func__,
 							dec_w, dec_h, c->width, c->height);
@@ -569,25 +750,17 @@ void VDec::run(void)
 				f->width(c->width);
 				f->height(c->height);
 				int64_t vpts = av_frame_get_best_effort_timestamp(frame);
-				/* a/v delay determined experimentally :-) */
-				if (v_format == VIDEO_FORMAT_MPEG2)
-					vpts += 90000*4/10; /* 400ms */
-				else
-					vpts += 90000*3/10; /* 300ms */
+				/* a/v delay determined experimentally :-) the output
+				 * latency of the audio (300ms) is part of its clock now.
+				 * The decoding delay (threads) does not matter any more,
+				 * frames are shown when the clock reaches their pts */
+				if (v_format == VIDEO_FORMAT_MPEG2 && vpts != AV_NOPTS_VALUE)
+					vpts += 90000/10; /* 100ms */
 				f->pts(vpts);
 				AVRational a = av_guess_sample_aspect_ratio(avfc, avfc->streams[0], frame);
 				f->AR(a);
-				buf_in++;
-				buf_in %= VDEC_MAXBUFS;
-				buf_num++;
-				if (buf_num > (VDEC_MAXBUFS - 1)) {
-					lt_info("%s: buf_num overflow\n", __func__);
-					buf_out++;
-					buf_out %= VDEC_MAXBUFS;
-					buf_num--;
-				}
 				dec_r = c->time_base.den/(c->time_base.num * c->ticks_per_frame);
-				buf_m.unlock();
+				queueBuf(f);
 			}
 			lt_debug("%s: time_base: %d/%d, ticks: %d rate: %d pts 0x%" PRIx64 "\n", __func__,
 					c->time_base.num, c->time_base.den, c->ticks_per_frame, dec_r,
@@ -604,20 +777,19 @@ void VDec::run(void)
 	avformat_close_input(&avfc);
 	av_free(pIOCtx->buffer);
 	av_free(pIOCtx);
-	/* reset output buffers */
-	bufpos = 0;
-	buf_num = 0;
-	buf_in = 0;
-	buf_out = 0;
+	/* drop what was not displayed */
+	flushBufs();
+	__atomic_store_n(&disp_pts, 0, __ATOMIC_RELAXED);
 	lt_info("======================== end decoder thread ================================\n");
 }
 
-static bool swscale(unsigned char *src, unsigned char *dst, int sw, int sh, int dw, int dh)
+static bool swscale(unsigned char *src, unsigned char *dst, int sw, int sh, int dw, int dh,
+		    enum PixelFormat sfmt = PIX_FMT_RGB32)
 {
 	bool ret = false;
 	struct SwsContext *scale = NULL;
 	AVFrame *sframe, *dframe;
-	scale = sws_getCachedContext(scale, sw, sh, PIX_FMT_RGB32, dw, dh, PIX_FMT_RGB32, SWS_BICUBIC, 0, 0, 0);
+	scale = sws_getCachedContext(scale, sw, sh, sfmt, dw, dh, PIX_FMT_RGB32, SWS_BICUBIC, 0, 0, 0);
 	if (!scale) {
 		lt_info_c("%s: ERROR setting up SWS context\n", __func__);
 		return false;
@@ -628,7 +800,7 @@ static bool swscale(unsigned char *src, unsigned char *dst, int sw, int sh, int
 		lt_info_c("%s: could not alloc sframe (%p) or dframe (%p)\n", __func__, sframe, dframe);
 		goto out;
 	}
-	avpicture_fill((AVPicture *)sframe, &(src[0]), PIX_FMT_RGB32, sw, sh);
+	avpicture_fill((AVPicture *)sframe, &(src[0]), sfmt, sw, sh);
 	avpicture_fill((AVPicture *)dframe, &(dst[0]), PIX_FMT_RGB32, dw, dh);
 	sws_scale(scale, sframe->data, sframe->linesize, 0, sh, dframe->data, dframe->linesize);
  out:
@@ -642,7 +814,7 @@ bool VDec::GetScreenImage(unsigned char * &data, int &xres, int &yres, bool get_
 {
 	lt_info("%s: data 0x%p xres %d yres %d vid %d osd %d scale %d\n",
 		__func__, data, xres, yres, get_video, get_osd, scale_to_video);
-	SWFramebuffer video;
+	SWFramebuffer *video = NULL;
 	std::vector<unsigned char> *osd = NULL;
 	std::vector<unsigned char> s_osd; /* scaled OSD */
 	int vid_w = 0, vid_h = 0;
@@ -651,15 +823,22 @@ bool VDec::GetScreenImage(unsigned char * &data, int &xres, int &yres, bool get_
 	xres = osd_w;
 	yres = osd_h;
 	if (get_video) {
-		buf_m.lock();
-		video = buffers[buf_out];
-		buf_m.unlock();
-		vid_w = video.width();
-		vid_h = video.height();
+		/* keep the frame on screen from being reused instead of copying it */
+		video = refLast();
+		if (!video) {
+			lt_info("%s: no video frame\n", __func__);
+			if (!get_osd)
+				return false;
+			get_video = false;
+		}
+	}
+	if (get_video) {
+		vid_w = video->width();
+		vid_h = video->height();
 		if (scale_to_video || !get_osd) {
 			xres = vid_w;
 			yres = vid_h;
-			AVRational a = video.AR();
+			AVRational a = video->AR();
 			/* TODO: this does not consider display_aspect and display_crop */
 			if (a.num > 0 && a.den > 0)
 				xres = vid_w * a.num / a.den;
@@ -669,15 +848,21 @@ bool VDec::GetScreenImage(unsigned char * &data, int &xres, int &yres, bool get_
 		osd = glfb_priv->getOSDBuffer();
 	unsigned int need = avpicture_get_size(PIX_FMT_RGB32, xres, yres);
 	data = (unsigned char *)realloc(data, need); /* will be freed by caller */
-	if (data == NULL)	/* out of memory? */
-		return false;
-
-	if (get_video) {
-		if (vid_w != xres || vid_h != yres) /* scale video into data... */
-			swscale(&video[0], data, vid_w, vid_h, xres, yres);
+	if (data && get_video) {
+		enum PixelFormat vfmt = PIX_FMT_RGB32;
+		if (video->format() == SWFramebuffer::YUV420P)
+			vfmt = PIX_FMT_YUV420P;
+		else if (video->format() == SWFramebuffer::NV12)
+			vfmt = PIX_FMT_NV12;
+		if (vid_w != xres || vid_h != yres || vfmt != PIX_FMT_RGB32) /* scale / convert video into data... */
+			swscale(&(*video)[0], data, vid_w, vid_h, xres, yres, vfmt);
 		else /* get_video and no fancy scaling needed */
-			memcpy(data, &video[0], xres * yres * sizeof(uint32_t));
+			memcpy(data, &(*video)[0], xres * yres * sizeof(uint32_t));
 	}
+	if (video)
+		unrefBuf(video);
+	if (data == NULL)	/* out of memory? */
+		return false;
 
 	if (get_osd && (osd_w != xres || osd_h != yres)) {
 		/* rescale osd */
@@ -716,14 +901,10 @@ bool VDec::GetScreenImage(unsigned char * &data, int &xres, int &yres, bool get_
 	return true;
 }
 
+/* of the picture on screen */
 int64_t VDec::GetPTS(void)
 {
-	int64_t pts = 0;
-	buf_m.lock();
-	if (buf_num != 0)
-		pts = buffers[buf_out].pts();
-	buf_m.unlock();
-	return pts;
+	return __atomic_load_n(&disp_pts, __ATOMIC_RELAXED);
 }
 
 void cVideo::SetDemux(cDemux *)
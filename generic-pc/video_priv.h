@@ -19,13 +19,17 @@
 
 #include <OpenThreads/Thread>
 #include <OpenThreads/Mutex>
+#include <semaphore.h>
 
 #include "video_hal.h"
 extern "C" {
 #include <libavutil/rational.h>
 }
 
-#define VDEC_MAXBUFS 0x40
+/* decoded frames in the pool: the one being decoded, those waiting to be
+ * displayed and the one on screen. HAL_VDEC_FRAMES=n changes the default */
+#define VDEC_FRAMES 4
+#define VDEC_MAXFRAMES 16
 class VDec : public OpenThreads::Thread
 {
 	friend class GLFbPC;
@@ -34,23 +38,42 @@ class VDec : public OpenThreads::Thread
 		/* called from GL thread */
 		class SWFramebuffer : public std::vector<unsigned char>
 		{
+			friend class VDec;
 		public:
-			SWFramebuffer() : mWidth(0), mHeight(0) {}
+			/* RGB32, or the planes of the decoded picture without
+			 * padding (Y, then U and V or interleaved UV) which
+			 * GLFbPC converts to RGB in a shader */
+			enum fmt { RGB32, YUV420P, NV12 };
+			SWFramebuffer() : mWidth(0), mHeight(0), mFmt(RGB32), mBT709(false), mFullRange(false), mRefs(0) {}
 			void width(int w) { mWidth = w; }
 			void height(int h) { mHeight = h; }
 			void pts(uint64_t p) { mPts = p; }
 			void AR(AVRational a) { mAR = a; }
+			void format(fmt f, bool bt709 = false, bool full_range = false)
+				{ mFmt = f; mBT709 = bt709; mFullRange = full_range; }
 			int width() const { return mWidth; }
 			int height() const { return mHeight; }
 			int64_t pts() const { return mPts; }
 			AVRational AR() const { return mAR; }
+			fmt format() const { return mFmt; }
+			bool bt709() const { return mBT709; }	/* else BT.601 */
+			bool fullRange() const { return mFullRange; }
 		private:
 			int mWidth;
 			int mHeight;
 			int64_t mPts;
 			AVRational mAR;
+			fmt mFmt;
+			bool mBT709;
+			bool mFullRange;
+			int mRefs;	/* 0 == free, __atomic */
 		};
-		int buf_in, buf_out, buf_num;
+		/* queue[] is a single producer / single consumer ring: only the
+		 * decoder (or ShowPicture(), serialized by buf_m) advances buf_in
+		 * and only the renderer buf_out. They are never wrapped, the
+		 * difference is the number of queued frames */
+		unsigned int buf_in, buf_out;
+		unsigned int buf_drop;	/* the renderer drops frames before this */
 	public:
 		/* constructor & destructor */
 		VDec(void);
@@ -81,11 +104,36 @@ class VDec : public OpenThreads::Thread
 		void ShowPicture(const char * fname);
 		void Pig(int x, int y, int w, int h);
 		bool GetScreenImage(unsigned char * &data, int &xres, int &yres, bool get_video = true, bool get_osd = false, bool scale_to_video = false);
+		/* the next frame to display, valid until the next call. Never
+		 * blocks, called from the GL thread */
 		SWFramebuffer *getDecBuf(void);
+		/* also GL thread: look at the n-th queued frame without taking
+		 * it, valid until getDecBuf() / dropDecBuf() */
+		SWFramebuffer *peekDecBuf(int n);
+		/* skip the next frame, it is too late */
+		void dropDecBuf(void);
+		int queued(void);
 		int64_t GetPTS(void);
 	private:
 		void run();
-		SWFramebuffer buffers[VDEC_MAXBUFS];
+		/* a frame of the pool for the decoder, waits until one is free */
+		SWFramebuffer *getFreeBuf(void);
+		/* pass a frame from getFreeBuf() to the renderer */
+		void queueBuf(SWFramebuffer *f);
+		void unrefBuf(SWFramebuffer *f);
+		/* a reference to the frame on screen, or NULL */
+		SWFramebuffer *refLast(void);
+		/* let the renderer drop what is queued now */
+		void flushBufs(void);
+		SWFramebuffer buffers[VDEC_MAXFRAMES];	/* the pool, buf_max used */
+		SWFramebuffer *queue[VDEC_MAXFRAMES];	/* decoded, not yet displayed */
+		SWFramebuffer *last;			/* displayed, __atomic */
+		int buf_max;
+		sem_t buf_free;				/* posted when a frame is released */
+		/* of the frame on screen, for other threads: pts and
+		 * width, height, aspect ratio in 16 bits each */
+		int64_t disp_pts;
+		uint64_t disp_geo;
 		int dec_w, dec_h;
 		int dec_r;
 		bool w_h_changed;
@@ -56,6 +56,18 @@ typedef struct
 	unsigned short pid;
 } pes_pids;
 
+/* see cDemux::GetStats() */
+typedef struct
+{
+	uint64_t packets;	/* TS packets received */
+	uint64_t cc_errors;	/* continuity_counter discontinuities */
+	uint64_t tei;		/* packets with transport_error_indicator set */
+	uint64_t scrambled;	/* packets with transport_scrambling_control != 0 */
+	unsigned int bitrate;	/* bit/s during the last second */
+	unsigned int overflows;	/* demux buffer overflows, i.e. data lost because
+				   the reader did not keep up (for the whole demux) */
+} dmx_pid_stats;
+
 class cRecord;
 class cPlayback;
 class cDemux
@@ -77,6 +89,9 @@ public:
 	bool addPid(unsigned short pid);
 	void getSTC(int64_t * STC);
 	int getUnit(void);
+	/* counters of a DMX_TP_CHANNEL, for all data that passed through it
+	 * since Open(). pid 0x2000 == all PIDs. false if not available */
+	bool GetStats(unsigned short pid, dmx_pid_stats *stats);
 	static bool SetSource(int unit, int source);
 	static int GetSource(int unit);
 	cDemux(int num = 0);
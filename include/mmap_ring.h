@@ -0,0 +1,97 @@
+/*
+ * mirrored ring buffer for zero-copy access to demux data
+ *
+ * License: GPLv2 or later
+ */
+#ifndef __mmap_ring_hal__
+#define __mmap_ring_hal__
+
+#include <inttypes.h>
+#include <pthread.h>
+
+/* sees all data that is put into the ring, see setTap(). data == NULL
+ * means that reading the source failed, len is -errno then */
+typedef void (*mmap_ring_tap_t)(void *priv, const uint8_t *data, int len);
+
+/*
+ * a ring buffer which is mapped twice, back to back, so that all data
+ * (and all free space) is always contiguous in memory. This is what
+ * cDemux::getBuffer() returns, use it like that:
+ *
+ *	cMmapRing *ring = (cMmapRing *)dmx->getBuffer();
+ *	uint8_t *data;
+ *	int len = ring->peek(&data, 100);
+ *	if (len > 0) {
+ *		... work with data[0] ... data[len - 1] in place ...
+ *		ring->release(len);
+ *	}
+ *
+ * There is one consumer (peek / release) and one producer. The producer
+ * is either somebody calling reserve / commit (or write), or, if a source
+ * fd is set, peek() itself, which then read()s directly into the ring.
+ */
+class cMmapRing
+{
+public:
+	/* size is rounded up to a multiple of 64kB, check getSize() > 0 */
+	cMmapRing(int size);
+	~cMmapRing();
+	int getSize(void) { return size; };
+	/* an eventfd which is readable when data or an error is pending */
+	int getFd(void) { return efd; };
+	/* let peek() read from fd when it has room */
+	void setSource(int fd) { src_fd = fd; };
+	/* the data are sections: read() returns at most one section */
+	void setSections(bool on) { sections = on; };
+	/* call tap for all new data, in the producer's context */
+	void setTap(mmap_ring_tap_t fn, void *priv) { tap = fn; tap_priv = priv; };
+
+	/* consumer: waits up to timeout ms (-1 == forever) until at least
+	 * min bytes are available and returns the number of bytes at *data,
+	 * or -1 and errno on error. Errors other than from the source fd
+	 * flush the ring. */
+	int peek(uint8_t **data, int timeout, int min = 1);
+	void release(int len);
+	/* the copying version for cDemux::Read(): like read(2), but returns
+	 * 0 if nothing arrived within timeout ms (if timeout != 0) */
+	int read(uint8_t *buf, int len, int timeout);
+
+	/* producer: returns the contiguous free space at *data */
+	int reserve(uint8_t **data);
+	void commit(int len);
+	/* all or nothing. false (and EOVERFLOW for the consumer) if full */
+	bool write(const uint8_t *data, int len);
+
+	int getFill(void);
+	/* how often data was lost because the ring was full */
+	unsigned int getOverflows(void) { return overflows; };
+	void setError(int err);
+	/* like setError(), for errors of the fd the producer reads from */
+	void srcError(int err);
+	void reset(void);
+	/* wake up and fail all peek()s, wait until they have returned */
+	void shutdown(void);
+private:
+	uint8_t *base;
+	int size;
+	int rpos;
+	int fill;
+	int error;
+	int readers;
+	bool closing;
+	int efd;
+	int src_fd;
+	bool sections;
+	int sec_left;		/* unread bytes of the current section */
+	mmap_ring_tap_t tap;
+	void *tap_priv;
+	unsigned int overflows;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	void signal(void);
+	void clear_event(void);
+	int pull(int timeout);
+};
+
+#endif
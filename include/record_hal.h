@@ -17,10 +17,36 @@
 #ifndef __record_hal__
 #define __record_hal__
 
+#include <cstdlib>
+#include <inttypes.h>
+#include <time.h>
+
 #define REC_STATUS_OK 0
 #define REC_STATUS_SLOW 1
 #define REC_STATUS_OVERFLOW 2
 
+/* write latency histogram: bucket i counts the writes which took less
+ * than 1 << (2 * i) ms (1, 4, 16... 4096), the last one all slower ones */
+#define REC_STATS_BUCKETS 8
+/* the times of the last overflows that are kept */
+#define REC_STATS_EVENTS 8
+
+/* see cRecord::GetStats() */
+typedef struct
+{
+	uint64_t bytes_read;	/* from the demux (after SPTS) */
+	uint64_t bytes_written;	/* to the file */
+	unsigned int bitrate;	/* bit/s read during the last second */
+	unsigned int latency[REC_STATS_BUCKETS];	/* completed writes */
+	unsigned int latency_max;	/* ms, of the slowest write */
+	int buffer_size;	/* bytes, size of the demux ring buffer */
+	int64_t buffer_max;	/* bytes, the most that was waiting for the disk:
+				   ring plus HAL_REC_SPILL, so it can exceed buffer_size */
+	unsigned int overflows;	/* the buffer ran full, the disk was too slow */
+	time_t overflow_time[REC_STATS_EVENTS];	/* of the last ones, newest first */
+	unsigned int lost;	/* the demux buffer overflowed: data are missing */
+} rec_stats;
+
 class RecData;
 class cRecord
 {
@@ -32,9 +58,22 @@ public:
 	bool Start(int fd, unsigned short vpid, unsigned short *apids, int numapids, uint64_t ch = 0);
 	bool Stop(void);
 	bool AddPid(unsigned short pid);
+	/* REC_STATUS_*. With HAL_REC_SPILL, *buffered is how many seconds of
+	 * the recording are in memory, waiting for the disk */
 	int  GetStatus();
+	int  GetStatus(int *buffered);
+	/* sets the status back to REC_STATUS_OK and all counters of
+	 * GetStats() to 0 */
 	void ResetStatus();
+	/* counters since Start() or ResetStatus(). With HAL_REC_STATS=<s>,
+	 * they are also logged every s seconds. false if not available */
+	bool GetStats(rec_stats *stats);
 	bool ChangePids(unsigned short vpid, unsigned short *apids, int numapids);
+	/* call before Start(): record into a circular file of about size
+	 * bytes for timeshift, which cPlayback can play while it is written.
+	 * 0 == a normal recording. false if the cPlayback of the platform
+	 * cannot play such a file (currently only the tripledragon can) */
+	bool SetTimeshift(uint64_t size);
 private:
 	RecData *pd;
 };
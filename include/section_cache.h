@@ -0,0 +1,41 @@
+/*
+ * version aware PSI / SI section cache
+ *
+ * License: GPLv2 or later
+ */
+#ifndef __section_cache_hal__
+#define __section_cache_hal__
+
+#include <inttypes.h>
+#include <map>
+
+/*
+ * If enabled (HAL_DMX_SECTION_CACHE=1 or cSectionCache::Enable(true)),
+ * every section filter only delivers a section again if its version
+ * (or its content) changed since the last time the filter delivered it.
+ * Starting or changing the filter forgets what it has delivered.
+ * Sections without section_syntax_indicator (TDT, TOT...) are always
+ * delivered.
+ *
+ * As a side effect, the current version of every table seen by any filter
+ * is known and can be queried with GetVersion().
+ */
+class cSectionCache
+{
+public:
+	static void Enable(bool on);
+	static bool Enabled(void);
+	/* version_number of the current table, or -1 if not seen yet */
+	static int GetVersion(unsigned short pid, unsigned char table_id, unsigned short table_id_extension);
+
+	/* the state of one filter */
+	cSectionCache() {};
+	/* true if this filter already delivered exactly this section */
+	bool Seen(uint16_t pid, const uint8_t *sec, int len);
+	void Clear(void) { sections.clear(); };
+private:
+	/* (pid, table_id, table_id_extension, section_number) => (version, CRC) */
+	std::map<uint64_t, uint64_t> sections;
+};
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ * TS streaming server, a recording to the network
+ *
+ * cStream sends some PIDs of a demux to all TCP clients which connect
+ * to its port, either with a HTTP GET request (any path) or without any
+ * request as a raw TS stream. With HAL_REC_HUB, the data come from the
+ * same kernel demux read as those of the recordings. The data are copied
+ * once into a pipe, the clients get them by tee() / splice() from there.
+ *
+ * License: GPLv2 or later
+ */
+#ifndef __stream_hal__
+#define __stream_hal__
+
+class StreamData;
+class cStream
+{
+public:
+	cStream(int num = 0);
+	~cStream();
+
+	/* serve vpid and apids on TCP port (all addresses) */
+	bool Start(int port, unsigned short vpid, unsigned short *apids, int numapids);
+	bool Stop(void);
+	bool AddPid(unsigned short pid);
+	/* the number of connected clients */
+	int  GetClients(void);
+private:
+	StreamData *pd;
+};
+#endif
@@ -62,6 +62,7 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <time.h>
 
 #include <cstring>
 #include <cstdio>
@@ -71,6 +72,14 @@
 #include <OpenThreads/ScopedLock>
 #include "dmx_hal.h"
 #include "lt_debug.h"
+#include "sw_demux.h"
+#include "mmap_ring.h"
+#include "dmx_reactor.h"
+#include "section_cache.h"
+#include "crc32.h"
+#include "ts_stats.h"
+#include "dmx_bufsize.h"
+#include "hal_time.h"
 
 #include "video_priv.h"
 /* needed for getSTC... */
@@ -119,12 +128,33 @@ static const char *devname[NUM_DEMUXDEV] = {
 /* did we already DMX_SET_SOURCE on that demux device? */
 static bool init[NUM_DEMUXDEV] = { false, false, false };
 
+/* export HAL_DMX_SHARE=1 to let all section and PES filters on the same
+ * PID share one kernel filter, demuxed in userspace */
 typedef struct dmx_pdata {
 	int last_source;
 	OpenThreads::Mutex *mutex;
+	bool share;
+	SWDemux *sw;
+	SWFilter *swf;
+	cMmapRing *ring;	/* created by getBuffer() or for the reactor */
+	int reactor_id;		/* 0: not yet registered, -1: failed */
+	cSectionCache *cache;	/* kernel section filters only, see section_cache.h */
+	bool sw_crc;		/* check the section CRC here, not in the driver */
+	TSStats *stats;		/* DMX_TP_CHANNEL only */
+	DmxBufSize *bufsize;	/* kernel filters only, see dmx_bufsize.h */
 } dmx_pdata;
 #define P ((dmx_pdata *)pdata)
 
+/* for cMmapRing::setTap(): everything the producer reads from the demux */
+static void dmx_tap(void *priv, const uint8_t *data, int len)
+{
+	dmx_pdata *p = (dmx_pdata *)priv;
+	if (data && p->stats)
+		p->stats->feed(data, len);
+	if (p->bufsize)
+		p->bufsize->event(len);
+}
+
 cDemux::cDemux(int n)
 {
 	if (n < 0 || n >= NUM_DEMUX)
@@ -160,6 +190,21 @@ bool cDemux::Open(DMX_CHANNEL_TYPE pes_type, void * /*hVideoBuffer*/, int uBuffe
 
 	dmx_type = pes_type;
 	buffersize = uBufferSize;
+	/* export HAL_REC_HUB=1 to have all recordings from one demux device
+	 * share one kernel TS filter, which is read only once.
+	 * HAL_SWDEMUX=<source> feeds the section, PES and TS demuxes from a
+	 * file, FIFO, "fd:<n>" or "udp://:<port>" instead, as on generic-pc.
+	 * The decoders stay with the hardware */
+	P->share = (getenv("HAL_SWDEMUX") &&
+		(dmx_type == DMX_PSI_CHANNEL || dmx_type == DMX_PES_CHANNEL || dmx_type == DMX_TP_CHANNEL)) ||
+		(getenv("HAL_DMX_SHARE") &&
+		(dmx_type == DMX_PSI_CHANNEL || dmx_type == DMX_PES_CHANNEL)) ||
+		(getenv("HAL_REC_HUB") && dmx_type == DMX_TP_CHANNEL);
+	if (dmx_type == DMX_TP_CHANNEL && !P->stats)
+		P->stats = new TSStats();
+	/* export HAL_DMX_BUFSIZE=<min>:<max> (kB) to adapt the buffer size to the load */
+	if (!P->share && !P->bufsize)
+		P->bufsize = DmxBufSize::create(uBufferSize);
 
 	/* return code is unchecked anyway... */
 	return true;
@@ -216,6 +261,101 @@ static bool _open(cDemux *thiz, int num, int &fd, int &last_source, DMX_CHANNEL_
 	return true;
 }
 
+/* the HAL_DMX_SHARE version of _open(): attach to the shared demux of the
+ * current source and use the SWFilter's eventfd instead of a demux fd */
+static bool _open_shared(cDemux *thiz, int num, int &fd, dmx_pdata *p, DMX_CHANNEL_TYPE dmx_type, int buffersize)
+{
+	int devnum = dmx_source[num];
+	if (p->swf) {
+		if (p->last_source == devnum)
+			return true;
+		lt_debug_z("%s #%d: source changed %d->%d\n", __func__, num, p->last_source, devnum);
+		delete p->swf;
+		p->sw->put();
+		p->swf = NULL;
+		p->sw = NULL;
+		fd = -1;
+	}
+	const char *swsource = getenv("HAL_SWDEMUX");
+	if (!init[devnum] && !swsource)
+	{
+		int n = DMX_SOURCE_FRONT0 + devnum;
+		int tmpfd = open(devname[devnum], O_RDWR|O_CLOEXEC);
+		lt_info_z("%s: setting %s to source %d\n", __func__, devname[devnum], n);
+		if (tmpfd < 0 || ioctl(tmpfd, DMX_SET_SOURCE, &n) < 0)
+			lt_info_z("%s DMX_SET_SOURCE failed!\n", __func__);
+		else
+			init[devnum] = true;
+		if (tmpfd > -1)
+			close(tmpfd);
+	}
+	std::string src = swsource ? swsource : std::string("share:") + devname[devnum];
+	p->sw = SWDemux::get(src.c_str());
+	if (!p->sw)
+		return false;
+	swdmx_output_t out = SWDMX_OUT_TS;
+	if (dmx_type == DMX_PSI_CHANNEL)
+		out = SWDMX_OUT_SECTION;
+	else if (dmx_type == DMX_PES_CHANNEL)
+		out = SWDMX_OUT_PES;
+	p->swf = new SWFilter(p->sw, out, buffersize);
+	if (p->stats)
+		p->swf->getRing()->setTap(dmx_tap, p);
+	fd = p->swf->fd;
+	lt_debug_z("%s #%d pes_type: %s(%d), uBufferSize: %d shared fd: %d\n", __func__,
+		 num, DMX_T[dmx_type], dmx_type, buffersize, fd);
+	p->last_source = devnum;
+	return true;
+}
+
+/* the common part of sectionFilter() and pesFilter(): get the right kind
+ * of fd for the current source. export HAL_DMX_REACTOR=1 to have all demux
+ * fds read into their rings by one thread */
+static void _open_filter(cDemux *thiz, int num, int &fd, dmx_pdata *p, DMX_CHANNEL_TYPE dmx_type, int buffersize)
+{
+	if (p->share)
+	{
+		_open_shared(thiz, num, fd, p, dmx_type, buffersize);
+		return;
+	}
+	DmxReactor *reactor = DmxReactor::get();
+	if (reactor && p->reactor_id > 0 && p->last_source != dmx_source[num])
+	{
+		/* _open() will close the fd */
+		reactor->remove(p->reactor_id);
+		p->reactor_id = 0;
+	}
+	_open(thiz, num, fd, p->last_source, dmx_type, p->bufsize ? p->bufsize->getSize() : buffersize);
+	if (fd < 0)
+		return;
+	if (p->bufsize)
+		p->bufsize->setFd(fd);
+	if (reactor && p->reactor_id == 0)
+	{
+		if (!p->ring)
+		{
+			p->ring = new cMmapRing(buffersize);
+			p->ring->setSections(dmx_type == DMX_PSI_CHANNEL);
+			if (p->stats || p->bufsize)
+				p->ring->setTap(dmx_tap, p);
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		p->reactor_id = (p->ring->getSize() > 0) ? reactor->addRing(fd, p->ring) : -1;
+		if (p->reactor_id < 0)
+		{
+			lt_info_z("%s: cannot use the demux reactor\n", __func__);
+			delete p->ring;
+			p->ring = NULL;
+			if (dmx_type == DMX_PSI_CHANNEL)
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+		}
+	}
+	else if (p->ring)	/* fd might have changed with the source */
+		p->ring->setSource(fd);
+	if (p->ring)
+		p->ring->reset();
+}
+
 void cDemux::Close(void)
 {
 	lt_debug("%s #%d, fd = %d\n", __FUNCTION__, num, fd);
@@ -226,8 +366,32 @@ void cDemux::Close(void)
 	}
 
 	pesfds.clear();
-	ioctl(fd, DMX_STOP);
-	close(fd);
+	if (P->reactor_id > 0)
+		DmxReactor::get()->remove(P->reactor_id);
+	P->reactor_id = 0;
+	if (P->ring)
+	{
+		delete P->ring;
+		P->ring = NULL;
+	}
+	delete P->cache;
+	P->cache = NULL;
+	if (P->swf)
+	{
+		delete P->swf;
+		P->sw->put();
+		P->swf = NULL;
+		P->sw = NULL;
+	}
+	else
+	{
+		ioctl(fd, DMX_STOP);
+		close(fd);
+	}
+	delete P->stats;
+	P->stats = NULL;
+	delete P->bufsize;
+	P->bufsize = NULL;
 	fd = -1;
 }
 
@@ -238,7 +402,16 @@ bool cDemux::Start(bool)
 		lt_info("%s #%d: not open!\n", __FUNCTION__, num);
 		return false;
 	}
-	ioctl(fd, DMX_START);
+	if (P->swf)
+		P->swf->start();
+	else if (P->bufsize)
+		P->bufsize->start();
+	else
+		ioctl(fd, DMX_START);
+	if (P->ring)
+		P->ring->reset();
+	if (P->cache)
+		P->cache->Clear();
 	return true;
 }
 
@@ -249,7 +422,12 @@ bool cDemux::Stop(void)
 		lt_info("%s #%d: not open!\n", __FUNCTION__, num);
 		return false;
 	}
-	ioctl(fd, DMX_STOP);
+	if (P->swf)
+		P->swf->stop();
+	else if (P->bufsize)
+		P->bufsize->stop();
+	else
+		ioctl(fd, DMX_STOP);
 	return true;
 }
 
@@ -280,6 +458,24 @@ int cDemux::Read(unsigned char *buff, int len, int timeout)
 	if (dmx_type == DMX_PSI_CHANNEL && timeout <= 0)
 		to = 60 * 1000;
 
+	int64_t end = 0;
+	if ((P->cache || P->sw_crc) && to > 0)
+		end = now_ms() + to;
+ again:
+	if (P->ring)
+	{
+		/* the ring is filled from fd, so fd must not be read directly */
+		rc = P->ring->read(buff, len, to);
+		if (rc == 0 && timeout == 0 && to > 0)
+		{
+			dmx_err("timed out for timeout=0!, %s", "", 0);
+			return -1;
+		}
+		if (rc < 0)
+			dmx_err("read: %s", strerror(errno), 0);
+		goto out;
+	}
+
 	if (to > 0)
 	{
  retry:
@@ -333,11 +529,41 @@ int cDemux::Read(unsigned char *buff, int len, int timeout)
 		return -1;
 	}
 
-	rc = ::read(fd, buff, len);
+	if (P->swf)
+		rc = P->swf->read(buff, len, dmx_type == DMX_PSI_CHANNEL);
+	else
+	{
+		rc = ::read(fd, buff, len);
+		/* with a ring, the producer feeds the stats */
+		if (P->stats)
+		{
+			if (rc > 0)
+				P->stats->feed(buff, rc);
+			else if (rc < 0 && errno == EOVERFLOW)
+				P->stats->overflow();
+		}
+		if (P->bufsize)
+			P->bufsize->event(rc < 0 ? -errno : rc, len);
+	}
 	//fprintf(stderr, "fd %d ret: %d\n", fd, rc);
 	if (rc < 0)
 		dmx_err("read: %s", strerror(errno), 0);
-
+ out:
+	if (rc > 0 && ((P->sw_crc && dvb_crc32(buff, rc)) || (P->cache && P->cache->Seen(pid, buff, rc))))
+	{
+		/* a broken section or an unchanged repeat, wait for the next one */
+		if (end)
+		{
+			to = end - now_ms();
+			if (to <= 0)
+			{
+				if (timeout == 0)
+					dmx_err("timed out for timeout=0!, %s", "", 0);
+				return (timeout == 0) ? -1 : 0;
+			}
+		}
+		goto again;
+	}
 	return rc;
 }
 
@@ -349,7 +575,7 @@ bool cDemux::sectionFilter(unsigned short _pid, const unsigned char * const filt
 	memset(&s_flt, 0, sizeof(s_flt));
 	pid = _pid;
 
-	_open(this, num, fd, P->last_source, dmx_type, buffersize);
+	_open_filter(this, num, fd, P, dmx_type, buffersize);
 
 	if (len > DMX_FILTER_SIZE)
 	{
@@ -454,9 +680,33 @@ bool cDemux::sectionFilter(unsigned short _pid, const unsigned char * const filt
 	fprintf(stderr,"mask: ");for(int i=0;i<FILTER_LENGTH;i++)fprintf(stderr,"%02hhx ",s_flt.mask  [i]);fprintf(stderr,"\n");
 	fprintf(stderr,"posi: ");for(int i=0;i<FILTER_LENGTH;i++)fprintf(stderr,"%02hhx ",s_flt.positive[i]);fprintf(stderr,"\n");
 #endif
-	ioctl (fd, DMX_STOP);
+	if (P->swf)
+		return P->swf->setSection(pid, filter, mask, negmask, len,
+					  !!(s_flt.flags & DMX_CHECK_CRC), s_flt.timeout);
+	if (P->bufsize)
+		P->bufsize->stop();
+	else
+		ioctl(fd, DMX_STOP);
+	/* export HAL_DMX_SW_CRC=1 if the driver's CRC check is broken or slow */
+	P->sw_crc = false;
+	if ((s_flt.flags & DMX_CHECK_CRC) && getenv("HAL_DMX_SW_CRC"))
+	{
+		s_flt.flags &= ~DMX_CHECK_CRC;
+		P->sw_crc = true;
+	}
+	if (cSectionCache::Enabled())
+	{
+		if (!P->cache)
+			P->cache = new cSectionCache();
+		P->cache->Clear();
+	}
+	/* a pending resize needs the filter stopped, start() does it */
+	if (P->bufsize)
+		s_flt.flags &= ~DMX_IMMEDIATE_START;
 	if (ioctl(fd, DMX_SET_FILTER, &s_flt) < 0)
 		return false;
+	if (P->bufsize)
+		P->bufsize->start();
 
 	return true;
 }
@@ -477,7 +727,7 @@ bool cDemux::pesFilter(const unsigned short _pid)
 
 	lt_debug("%s #%d pid: 0x%04hx fd: %d type: %s\n", __FUNCTION__, num, pid, fd, DMX_T[dmx_type]);
 
-	_open(this, num, fd, P->last_source, dmx_type, buffersize);
+	_open_filter(this, num, fd, P, dmx_type, buffersize);
 
 	memset(&p_flt, 0, sizeof(p_flt));
 	p_flt.pid = pid;
@@ -510,6 +760,18 @@ bool cDemux::pesFilter(const unsigned short _pid)
 		lt_info("%s #%d invalid dmx_type %d!\n", __func__, num, dmx_type);
 		return false;
 	}
+	if (P->swf)
+		return P->swf->setPid(pid);
+	if (P->bufsize)
+	{
+		/* see sectionFilter() */
+		P->bufsize->stop();
+		p_flt.flags &= ~DMX_IMMEDIATE_START;
+		if (ioctl(fd, DMX_SET_PES_FILTER, &p_flt) < 0)
+			return false;
+		P->bufsize->start();
+		return true;
+	}
 	return (ioctl(fd, DMX_SET_PES_FILTER, &p_flt) >= 0);
 }
 
@@ -518,10 +780,40 @@ void cDemux::SetSyncMode(AVSYNC_TYPE /*mode*/)
 	lt_debug("%s #%d\n", __FUNCTION__, num);
 }
 
+/* returns a cMmapRing, see mmap_ring.h. Once it is used, Read() also
+ * reads from the ring */
 void *cDemux::getBuffer()
 {
 	lt_debug("%s #%d\n", __FUNCTION__, num);
-	return NULL;
+	if (fd < 0)
+		return NULL;
+	if (P->swf)
+		return P->swf->getRing();
+	if (!P->ring)
+	{
+		cMmapRing *ring = new cMmapRing(buffersize);
+		if (ring->getSize() == 0)
+		{
+			delete ring;
+			return NULL;
+		}
+		ring->setSource(fd);
+		ring->setSections(dmx_type == DMX_PSI_CHANNEL);
+		if (P->stats || P->bufsize)
+			ring->setTap(dmx_tap, P);
+		P->ring = ring;
+	}
+	return P->ring;
+}
+
+bool cDemux::GetStats(unsigned short _pid, dmx_pid_stats *stats)
+{
+	if (!P->stats || !P->stats->get(_pid, stats))
+		return false;
+	cMmapRing *ring = P->swf ? P->swf->getRing() : P->ring;
+	if (ring)
+		stats->overflows += ring->getOverflows();
+	return true;
 }
 
 void *cDemux::getChannel()
@@ -540,13 +832,21 @@ bool cDemux::addPid(unsigned short Pid)
 		lt_info("%s pes_type %s not implemented yet! pid=%hx\n", __FUNCTION__, DMX_T[dmx_type], Pid);
 		return false;
 	}
-	_open(this, num, fd, P->last_source, dmx_type, buffersize);
+	if (P->share)
+		_open_shared(this, num, fd, P, dmx_type, buffersize);
+	else
+		_open(this, num, fd, P->last_source, dmx_type, P->bufsize ? P->bufsize->getSize() : buffersize);
+	if (P->bufsize)
+		P->bufsize->setFd(fd);
 	if (fd == -1)
 		lt_info("%s bucketfd not yet opened? pid=%hx\n", __FUNCTION__, Pid);
 	pfd.fd = fd; /* dummy */
 	pfd.pid = Pid;
 	pesfds.push_back(pfd);
-	ret = (ioctl(fd, DMX_ADD_PID, &Pid));
+	if (P->swf)
+		ret = P->swf->addPid(Pid) ? 0 : -1;
+	else
+		ret = (ioctl(fd, DMX_ADD_PID, &Pid));
 	if (ret < 0)
 		lt_info("%s: DMX_ADD_PID (%m)\n", __func__);
 	return (ret != -1);
@@ -563,7 +863,9 @@ void cDemux::removePid(unsigned short Pid)
 	{
 		if ((*i).pid == Pid) {
 			lt_debug("removePid: removing demux fd %d pid 0x%04x\n", fd, Pid);
-			if (ioctl(fd, DMX_REMOVE_PID, Pid) < 0)
+			if (P->swf)
+				P->swf->removePid(Pid);
+			else if (ioctl(fd, DMX_REMOVE_PID, Pid) < 0)
 				lt_info("%s: (DMX_REMOVE_PID, 0x%04hx): %m\n", __func__, Pid);
 			pesfds.erase(i);
 			return; /* TODO: what if the same PID is there multiple times */
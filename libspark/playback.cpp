@@ -13,6 +13,7 @@
 #include "audio_hal.h"
 #include "video_lib.h"
 #include "lt_debug.h"
+#include "ts_scan.h"
 #define lt_debug(args...) _lt_debug(TRIPLE_DEBUG_PLAYBACK, this, args)
 #define lt_info(args...)  _lt_info(TRIPLE_DEBUG_PLAYBACK, this, args)
 #define lt_info_c(args...) _lt_info(TRIPLE_DEBUG_PLAYBACK, NULL, args)
@@ -938,8 +939,11 @@ ssize_t cPlayback::read_ts()
 		buf = inbuf + inbuf_sync + i;
 		if (*buf != 0x47)
 		{
-			synccnt++;
-			i++;
+			int s = ts_resync(buf, inbuf_pos - inbuf_sync - i, 188);
+			if (s < 0)
+				s = inbuf_pos - inbuf_sync - i;
+			synccnt += s;
+			i += s;
 			continue;
 		}
 		if (synccnt)
@@ -1296,36 +1300,39 @@ off_t cPlayback::mp_seekSync(off_t pos)
 		return ret;
 	}
 
-	/* TODO: use bigger buffer here, too and handle EOF / next splitfile */
-	while (read(in_fd, pkt, 1) > 0)
+	/* read up to 100 packets and look for two sync bytes one packet apart,
+	 * continue with the next file in the list at EOF */
+	uint8_t tsbuf[101 * 188];
+	ssize_t have = 0, r;
+	bool retry = false;
+	while (have < (ssize_t)sizeof(tsbuf))
 	{
-		//-- check every byte until sync word reached --
-		npos++;
-		if (*pkt == 0x47)
+		r = read(in_fd, tsbuf + have, sizeof(tsbuf) - have);
+		if (r < 0)
 		{
-			//-- if found double check for next sync word --
-			if (read(in_fd, pkt, 188) == 188)
-			{
-				if(pkt[188-1] == 0x47)
-				{
-					ret = mf_lseek(npos - 1); // assume sync ok
-					pthread_mutex_unlock(&currpos_mutex);
-					if (ret < 0)
-						lt_info("%s:%d lseek ret < 0 (%m)\n", __FUNCTION__, __LINE__);
-					return ret;
-				}
-				else
-				{
-					ret = mf_lseek(npos); // oops, next pkt doesn't start with sync
-					if (ret < 0)
-						lt_info("%s:%d lseek ret < 0 (%m)\n", __FUNCTION__, __LINE__);
-				}
-			}
-		}
-
-		//-- check probe limits --
-		if (npos > (pos + 100 * 188))
+			if (errno == EINTR)
+				continue;
+			lt_info("%s read failed: %m\n", __FUNCTION__);
 			break;
+		}
+		if (r == 0) // EOF?
+		{
+			if (retry || mf_lseek(pos + have) < 0) /* next file in list? */
+				break;
+			retry = true;
+			continue;
+		}
+		retry = false;
+		have += r;
+	}
+	int s = ts_find_sync(tsbuf, have, 188);
+	if (s >= 0)
+	{
+		ret = mf_lseek(pos + s);
+		pthread_mutex_unlock(&currpos_mutex);
+		if (ret < 0)
+			lt_info("%s:%d lseek ret < 0 (%m)\n", __FUNCTION__, __LINE__);
+		return ret;
 	}
 
 	//-- on error stay on actual position --
@@ -1336,19 +1343,7 @@ off_t cPlayback::mp_seekSync(off_t pos)
 
 static int sync_ts(uint8_t *p, int len)
 {
-	int count;
-	if (len < 189)
-		return -1;
-
-	count = 0;
-	while (*p != 0x47 || *(p + 188) != 0x47)
-	{
-		count++;
-		p++;
-		if (count + 188 > len)
-			return -1;
-	}
-	return count;
+	return ts_find_sync(p, len, 188);
 }
 
 /* get the pts value from a TS or PES packet
@@ -1426,23 +1421,17 @@ int64_t cPlayback::get_pts(uint8_t *p, bool pes, int bufsize)
 static int mp_syncPES(uint8_t *buf, int len, bool quiet)
 {
 	int ret = 0;
+	int s;
 	while (ret < len - 4)
 	{
-		if (buf[ret + 2] != 0x01)
+		/* the stream ID must be inside the buffer, too */
+		s = ts_find_startcode(buf + ret, len - 2 - ret);
+		if (s < 0)
 		{
-			ret++;
-			continue;
-		}
-		if (buf[ret + 1] != 0x00)
-		{
-			ret += 2;
-			continue;
-		}
-		if (buf[ret] != 0x00)
-		{
-			ret += 3;
-			continue;
+			ret = len - 4;
+			break;
 		}
+		ret += s;
 		/* all stream IDs are > 0x80 */
 		if ((buf[ret + 3] & 0x80) != 0x80)
 		{
@@ -17,10 +17,12 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <malloc.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <inttypes.h>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
 #include <pthread.h>
@@ -28,12 +30,23 @@
 
 #include "record_hal.h"
 #include "dmx_hal.h"
+#include "mmap_ring.h"
+#include "rec_index.h"
+#include "rec_spill.h"
+#include "rec_stats.h"
+#include "rec_spts.h"
 #include "lt_debug.h"
+#include "hal_time.h"
 #define lt_debug(args...) _lt_debug(TRIPLE_DEBUG_RECORD, this, args)
 #define lt_info(args...) _lt_info(TRIPLE_DEBUG_RECORD, this, args)
 
 #define BUFSIZE (2 << 20) /* 2MB */
-static const int bufsize = BUFSIZE;
+/* the number of queued writes, each up to BUFSIZE / AIO_MAX */
+#define AIO_MAX 4
+/* with O_DIRECT, offset and length of all writes must be a multiple of this */
+#define DIRECT_ALIGN 4096
+/* with O_DIRECT, the file is extended in steps of this size */
+#define PREALLOC (64 << 20) /* 64MB */
 
 typedef enum {
 	RECORD_RUNNING,
@@ -47,24 +60,44 @@ typedef enum {
 class RecData
 {
 public:
-	RecData(int num) {
+	RecData(cRecord *r, int num) {
+		rec = r;
 		dmx = NULL;
-		buf = NULL;
 		record_thread_running = false;
 		file_fd = -1;
 		exit_flag = RECORD_STOPPED;
 		dmx_num = num;
 		state = REC_STATUS_OK;
+		index = NULL;
+		spts = NULL;
+		spill = NULL;
+		buffered = 0;
+		vpid = 0;
+		pmt_pid = -1;
+		pthread_mutex_init(&pid_lock, NULL);
 	}
+	~RecData() {
+		pthread_mutex_destroy(&pid_lock);
+	}
+	cRecord *rec;		/* for AddPid() from the record thread */
 	int file_fd;
 	int dmx_num;
 	cDemux *dmx;
-	uint8_t *buf;
 	pthread_t record_thread;
 	bool record_thread_running;
 	record_state_t exit_flag;
 	int state;
+	RecIndexWriter *index;	/* see rec_index.h */
+	RecSpts *spts;		/* see rec_spts.h */
+	RecSpill *spill;	/* see rec_spill.h */
+	int buffered;		/* seconds, for GetStatus() */
+	RecStats stats;		/* see rec_stats.h */
+	unsigned short vpid;	/* pesFilter() does not put it into pesfds */
+	int pmt_pid;		/* added for the SPTS rewriter, -1 == not yet */
+	pthread_mutex_t pid_lock;	/* the record thread adds the PMT PID */
 	void RecordThread();
+	void SptsPids(const std::vector<pes_pids> &pids);
+	int Pump(cMmapRing *src, int timeout);
 };
 
 
@@ -79,7 +112,7 @@ void *execute_record_thread(void *c)
 cRecord::cRecord(int num)
 {
 	lt_info("%s %d\n", __func__, num);
-	pd = new RecData(num);
+	pd = new RecData(this, num);
 }
 
 cRecord::~cRecord()
@@ -106,7 +139,7 @@ void cRecord::Close(void)
 }
 #endif
 
-bool cRecord::Start(int fd, unsigned short vpid, unsigned short *apids, int numpids, uint64_t)
+bool cRecord::Start(int fd, unsigned short vpid, unsigned short *apids, int numpids, uint64_t ch)
 {
 	lt_info("%s: fd %d, vpid 0x%03x\n", __func__, fd, vpid);
 	int i;
@@ -114,21 +147,40 @@ bool cRecord::Start(int fd, unsigned short vpid, unsigned short *apids, int nump
 	if (!pd->dmx)
 		pd->dmx = new cDemux(pd->dmx_num);
 
-	pd->dmx->Open(DMX_TP_CHANNEL, NULL, 2*1024*1024);
+	pd->dmx->Open(DMX_TP_CHANNEL, NULL, BUFSIZE);
 	pd->dmx->pesFilter(vpid);
+	pd->vpid = vpid;
+	pd->pmt_pid = -1;
 
 	for (i = 0; i < numpids; i++)
 		pd->dmx->addPid(apids[i]);
 
+	/* export HAL_REC_SPTS=1 for recordings with only this service in
+	 * PAT and PMT. The service ID is in the lower bits of the channel ID */
+	pd->spts = RecSpts::create(ch & 0xffff, BUFSIZE);
+	if (pd->spts)
+	{
+		/* the PAT is needed to find the PMT, whose PID the record
+		 * thread adds once the rewriter knows it */
+		AddPid(0);
+		pd->SptsPids(pd->dmx->pesfds);
+	}
+	/* export HAL_REC_SPILL=<MB> to keep up to that much of all
+	 * recordings in memory while the disk is too slow */
+	pd->spill = RecSpill::create(BUFSIZE);
+	pd->buffered = 0;
+	pd->stats.reset();
+
 	pd->file_fd = fd;
+	pd->index = RecIndexWriter::create(fd, vpid);
 	pd->exit_flag = RECORD_RUNNING;
 	if (posix_fadvise(pd->file_fd, 0, 0, POSIX_FADV_DONTNEED))
 		perror("posix_fadvise");
 
-	pd->buf = (uint8_t *)malloc(bufsize);
-	if (!pd->buf) {
-		i = errno;
-		lt_info("%s: unable to allocate read buffer of %d bytes (%m)\n", __func__, bufsize);
+	/* the demux' ring buffer is written to disk in place */
+	if (!pd->dmx->getBuffer()) {
+		i = ENOMEM;
+		lt_info("%s: unable to get the demux ring buffer\n", __func__);
 	}
 	else
 		i = pthread_create(&pd->record_thread, 0, execute_record_thread, pd);
@@ -139,8 +191,12 @@ bool cRecord::Start(int fd, unsigned short vpid, unsigned short *apids, int nump
 		lt_info("%s: error creating thread! (%m)\n", __func__);
 		delete pd->dmx;
 		pd->dmx = NULL;
-		free(pd->buf);
-		pd->buf = NULL;
+		delete pd->index;
+		pd->index = NULL;
+		delete pd->spts;
+		pd->spts = NULL;
+		delete pd->spill;
+		pd->spill = NULL;
 		return false;
 	}
 	pd->record_thread_running = true;
@@ -158,10 +214,13 @@ bool cRecord::Stop(void)
 	if (pd->record_thread_running)
 		pthread_join(pd->record_thread, NULL);
 	pd->record_thread_running = false;
-
-	if (pd->buf)
-		free(pd->buf);
-	pd->buf = NULL;
+	delete pd->index;
+	pd->index = NULL;
+	delete pd->spts;
+	pd->spts = NULL;
+	delete pd->spill;
+	pd->spill = NULL;
+	pd->buffered = 0;
 
 	/* We should probably do that from the destructor... */
 	if (!pd->dmx)
@@ -190,9 +249,11 @@ bool cRecord::ChangePids(unsigned short /*vpid*/, unsigned short *apids, int num
 		lt_info("%s: DMX = NULL\n", __func__);
 		return false;
 	}
+	/* the video PID is the pesFilter() of Start() and not in pesfds,
+	 * changing it is not supported */
+	pthread_mutex_lock(&pd->pid_lock);
 	pids = dmx->pesfds;
-	/* the first PID is the video pid, so start with the second PID... */
-	for (std::vector<pes_pids>::const_iterator i = pids.begin() + 1; i != pids.end(); ++i) {
+	for (std::vector<pes_pids>::const_iterator i = pids.begin(); i != pids.end(); ++i) {
 		found = false;
 		pid = (*i).pid;
 		for (j = 0; j < numapids; j++) {
@@ -201,12 +262,13 @@ bool cRecord::ChangePids(unsigned short /*vpid*/, unsigned short *apids, int num
 				break;
 			}
 		}
-		if (!found)
+		/* keep PAT and PMT */
+		if (!found && !(pd->spts && (pid == 0 || pid == pd->pmt_pid)))
 			dmx->removePid(pid);
 	}
 	for (j = 0; j < numapids; j++) {
 		found = false;
-		for (std::vector<pes_pids>::const_iterator i = pids.begin() + 1; i != pids.end(); ++i) {
+		for (std::vector<pes_pids>::const_iterator i = pids.begin(); i != pids.end(); ++i) {
 			if ((*i).pid == apids[j]) {
 				found = true;
 				break;
@@ -215,6 +277,8 @@ bool cRecord::ChangePids(unsigned short /*vpid*/, unsigned short *apids, int num
 		if (!found)
 			dmx->addPid(apids[j]);
 	}
+	pd->SptsPids(pd->dmx->pesfds);
+	pthread_mutex_unlock(&pd->pid_lock);
 	return true;
 }
 
@@ -227,49 +291,157 @@ bool cRecord::AddPid(unsigned short pid)
 		lt_info("%s: DMX = NULL\n", __func__);
 		return false;
 	}
+	pthread_mutex_lock(&pd->pid_lock);
 	pids = dmx->pesfds;
 	for (std::vector<pes_pids>::const_iterator i = pids.begin(); i != pids.end(); ++i) {
-		if ((*i).pid == pid)
+		if ((*i).pid == pid) {
+			pthread_mutex_unlock(&pd->pid_lock);
 			return true; /* or is it an error to try to add the same PID twice? */
+		}
 	}
-	return dmx->addPid(pid);
+	bool ret = dmx->addPid(pid);
+	pd->SptsPids(pd->dmx->pesfds);
+	pthread_mutex_unlock(&pd->pid_lock);
+	return ret;
+}
+
+bool cRecord::SetTimeshift(uint64_t size)
+{
+	/* no cPlayback here (eplayer3, generic-pc, raspi, azbox) can follow a
+	 * circular file, so only the tripledragon records one (timeshift.h) */
+	lt_info("%s: %lld: not supported by the player on this platform\n", __func__, (long long)size);
+	return false;
+}
+
+/* tell the SPTS rewriter what is recorded now */
+void RecData::SptsPids(const std::vector<pes_pids> &pids)
+{
+	if (!spts)
+		return;
+	std::vector<uint16_t> p;
+	if (vpid)
+		p.push_back(vpid);
+	for (std::vector<pes_pids>::const_iterator i = pids.begin(); i != pids.end(); ++i)
+		p.push_back((*i).pid);
+	spts->setPids(p);
+}
+
+/* move the demux data through the SPTS rewriter and the spill buffer,
+ * whichever are used. Returns like RecSpts::pump() */
+int RecData::Pump(cMmapRing *src, int timeout)
+{
+	int ret = 0;
+	cMmapRing *dmx_ring = src;
+	if (spts)
+	{
+		ret = spts->pump(src, timeout);
+		if (ret < 0 && errno != EAGAIN)
+			return ret;
+		/* the PAT told where the PMT is: record it too */
+		int pmt = spts->getPmtPid();
+		if (pmt >= 0 && pmt != pmt_pid) {
+			lt_info("%s: adding PMT PID 0x%04x\n", __func__, pmt);
+			pmt_pid = pmt;
+			rec->AddPid(pmt);
+		}
+		src = spts->getRing();
+		timeout = 0;
+	}
+	if (spill)
+	{
+		/* what went into ring and memory is new */
+		cMmapRing *ring = spill->getRing();
+		int64_t before = ring->getFill() + spill->pending();
+		bool full = spill->isFull();
+		ret = spill->pump(src, timeout);
+		stats.read(ring->getFill() + spill->pending() - before);
+		if (!full && spill->isFull())
+			stats.overflow();
+		buffered = spill->seconds();
+		/* the disk has caught up and nothing was lost */
+		if (state == REC_STATUS_SLOW && !spill->pending() && !dmx_ring->getOverflows())
+			state = REC_STATUS_OK;
+	}
+	return ret;
 }
 
 void RecData::RecordThread()
 {
 	lt_info("%s: begin\n", __func__);
 	hal_set_threadname("hal:record");
-	const int readsize = bufsize / 16;
-	int buf_pos = 0;
-	int queued = 0;
-	struct aiocb a;
-
+	cMmapRing *src = (cMmapRing *)dmx->getBuffer();
+	/* with SPTS and / or the spill buffer, their copy of the demux data
+	 * is written */
+	cMmapRing *ring = spill ? spill->getRing() : spts ? spts->getRing() : src;
+	const bool copy = spts || spill;
+	const int bufsize = ring->getSize();
+	/* the rewriter needs some room to insert PAT and PMT */
+	const int full = (spts && !spill) ? bufsize - REC_SPTS_RESERVE - 188 : bufsize;
+	/* glibc runs the aio requests of one fd one after the other, so a
+	 * slow write (the disk spinning up, a flush...) still holds up the
+	 * ones behind it. Queueing several just means the data are written
+	 * in place from the ring, without moving them to its start, and
+	 * what comes in meanwhile is collected into bigger writes */
+	const int chunk = bufsize / AIO_MAX;
+	uint8_t *data = NULL;
+	int avail = 0;
+	int queued = 0;		/* bytes in the aio slots */
+	struct aiocb a[AIO_MAX];
+	int64_t started[AIO_MAX];	/* for the latency statistics */
+	int head = 0;		/* the oldest write, the ring is released in order */
+	int inflight = 0;
+	off_t offset;
+	bool direct = false;
+	bool prealloc = true;
+	off_t alloc_end = 0;	/* preallocated up to here */
+
+	/* the writes can complete in any order, so they need explicit offsets */
 	int val = fcntl(file_fd, F_GETFL);
-	if (fcntl(file_fd, F_SETFL, val|O_APPEND))
+	if ((val & O_APPEND) && fcntl(file_fd, F_SETFL, val & ~O_APPEND))
 		lt_info("%s: O_APPEND? (%m)\n", __func__);
+	offset = lseek(file_fd, 0, SEEK_END);
+	if (offset < 0)
+		offset = 0;
+	/* export HAL_REC_DIRECT=1 to write the recording past the page cache.
+	 * Writes are then always whole blocks from the (page aligned) ring,
+	 * only the last bytes are written normally at the end */
+	if (getenv("HAL_REC_DIRECT"))
+	{
+		if (offset % DIRECT_ALIGN)
+			lt_info("%s: file offset %lld is not aligned, not using O_DIRECT\n", __func__, (long long)offset);
+		else if (fcntl(file_fd, F_SETFL, (val & ~O_APPEND) | O_DIRECT))
+			lt_info("%s: O_DIRECT: %m\n", __func__);
+		else
+			direct = true;
+		alloc_end = offset;
+	}
 
-	memset(&a, 0, sizeof(a));
-	a.aio_fildes = file_fd;
-	a.aio_sigevent.sigev_notify = SIGEV_NONE;
+	memset(a, 0, sizeof(a));
+	for (int i = 0; i < AIO_MAX; i++)
+	{
+		a[i].aio_fildes = file_fd;
+		a[i].aio_sigevent.sigev_notify = SIGEV_NONE;
+	}
 
 	dmx->Start();
 	int overflow_count = 0;
 	bool overflow = false;
 	int r = 0;
-	while (exit_flag == RECORD_RUNNING)
+	bool failed = false;
+	bool stopped = false;
+	while (true)
 	{
-		if (buf_pos < bufsize)
+		if (exit_flag == RECORD_RUNNING && avail < full)
 		{
 			if (overflow_count) {
 				lt_info("%s: Overflow cleared after %d iterations\n", __func__, overflow_count);
 				overflow_count = 0;
 			}
-			int toread = bufsize - buf_pos;
-			if (toread > readsize)
-				toread = readsize;
-			ssize_t s = dmx->Read(buf + buf_pos, toread, 50);
-			lt_debug("%s: buf_pos %6d s %6d / %6d\n", __func__,
-				buf_pos, (int)s, bufsize - buf_pos);
+			/* wait for data which is not yet queued for writing */
+			int s = -1;
+			if (!copy || Pump(src, 50) >= 0 || errno == EAGAIN)
+				s = ring->peek(&data, copy ? 0 : 50, queued + 1);
+			lt_debug("%s: avail %6d s %6d / %6d\n", __func__, avail, s, bufsize);
 			if (s < 0)
 			{
 				if (errno != EAGAIN && (errno != EOVERFLOW || !overflow))
@@ -277,84 +449,204 @@ void RecData::RecordThread()
 					lt_info("%s: read failed: %m\n", __func__);
 					exit_flag = RECORD_FAILED_READ;
 					state = REC_STATUS_OVERFLOW;
-					break;
 				}
 			}
 			else
 			{
 				overflow = false;
-				buf_pos += s;
+				if (s > avail && !spill)
+					stats.read(s - avail);
+				avail = s;
 			}
+			stats.fill(avail + (spill ? spill->pending() : 0), bufsize);
+			stats.lost(src->getOverflows());
 		}
 		else
 		{
-			if (!overflow)
-				overflow_count = 0;
-			overflow = true;
-			if (!(overflow_count % 10))
-				lt_info("%s: buffer full! Overflow? (%d)\n", __func__, ++overflow_count);
-			state = REC_STATUS_SLOW;
+			if (exit_flag == RECORD_RUNNING)
+			{
+				if (!overflow)
+				{
+					overflow_count = 0;
+					/* with the spill buffer, when that is full */
+					if (!spill)
+						stats.overflow();
+				}
+				overflow = true;
+				if (!(overflow_count % 10))
+					lt_info("%s: buffer full! Overflow? (%d)\n", __func__, ++overflow_count);
+				state = REC_STATUS_SLOW;
+				/* keep the demux buffer empty, as long as there is memory */
+				if (spill)
+					Pump(src, 0);
+			}
+			/* nothing to read: wait for the oldest write */
+			if (inflight)
+			{
+				const struct aiocb *list[1] = { &a[head] };
+				struct timespec ts = { 0, 50000000 };
+				aio_suspend(list, 1, &ts);
+			}
 		}
-		r = aio_error(&a);
-		if (r == EINPROGRESS)
+
+		/* reap the finished writes, oldest first */
+		while (inflight)
 		{
-			lt_debug("%s: aio in progress, free: %d\n", __func__, bufsize - buf_pos);
-			continue;
+			struct aiocb *cb = &a[head];
+			r = aio_error(cb);
+			if (r == EINPROGRESS)
+				break;
+			// not calling aio_return causes a memory leak  --martii
+			r = aio_return(cb);
+			if (r < 0)
+			{
+				errno = aio_error(cb);
+				lt_info("%s: aio_return = %d (%m)\n", __func__, r);
+				failed = true;
+				r = cb->aio_nbytes;	/* drop it */
+			}
+			else if (r < (int)cb->aio_nbytes && !failed)
+			{
+				/* short write: write the rest in the same slot */
+				lt_debug("%s: short write %d of %d\n", __func__, r, (int)cb->aio_nbytes);
+				cb->aio_buf = (uint8_t *)cb->aio_buf + r;
+				cb->aio_nbytes -= r;
+				cb->aio_offset += r;
+				stats.written(r, started[head]);
+				started[head] = now_us();
+				ring->release(r);
+				data += r;
+				avail -= r;
+				queued -= r;
+				if (aio_write(cb) == 0)
+					break;
+				lt_info("%s: aio_write (%m)\n", __func__);
+				failed = true;
+				r = cb->aio_nbytes;
+			}
+			else
+			{
+				lt_debug("%s: aio_return = %d, free: %d\n", __func__, r, bufsize - avail);
+				stats.written(r, started[head]);
+			}
+			ring->release(r);
+			data += r;
+			avail -= r;
+			queued -= r;
+			head = (head + 1) % AIO_MAX;
+			inflight--;
+			if (!direct && posix_fadvise(file_fd, 0, 0, POSIX_FADV_DONTNEED))
+				perror("posix_fadvise");
 		}
-		// not calling aio_return causes a memory leak  --martii
-		r = aio_return(&a);
-		if (r < 0)
-		{
+		if (failed && exit_flag == RECORD_RUNNING)
 			exit_flag = RECORD_FAILED_FILE;
-			lt_debug("%s: aio_return = %d (%m)\n", __func__, r);
-			break;
-		}
-		else
-			lt_debug("%s: aio_return = %d, free: %d\n", __func__, r, bufsize - buf_pos);
-		if (posix_fadvise(file_fd, 0, 0, POSIX_FADV_DONTNEED))
-			perror("posix_fadvise");
-		if (queued)
+
+		/* queue new data. small pieces only if the disk is idle, else
+		 * they are collected for one bigger write */
+		while (!failed && inflight < AIO_MAX && avail > queued &&
+		       (inflight == 0 || avail - queued >= chunk || exit_flag != RECORD_RUNNING))
 		{
-			memmove(buf, buf + queued, buf_pos - queued);
-			buf_pos -= queued;
+			struct aiocb *cb = &a[(head + inflight) % AIO_MAX];
+			int n = avail - queued;
+			if (n > chunk)
+				n = chunk;
+			if (direct && ((uintptr_t)(data + queued) % DIRECT_ALIGN))
+			{
+				/* only if the ring was used before, but then it does not work */
+				lt_info("%s: ring buffer not aligned, not using O_DIRECT\n", __func__);
+				fcntl(file_fd, F_SETFL, fcntl(file_fd, F_GETFL) & ~O_DIRECT);
+				direct = false;
+			}
+			if (direct)
+			{
+				n &= ~(DIRECT_ALIGN - 1);
+				if (n == 0)
+					break;
+				if (prealloc && offset + n > alloc_end)
+				{
+					/* big extents, even with several recordings at once */
+					if (fallocate(file_fd, FALLOC_FL_KEEP_SIZE, alloc_end, PREALLOC) == 0)
+						alloc_end += PREALLOC;
+					else
+					{
+						lt_info("%s: fallocate: %m\n", __func__);
+						prealloc = false;
+					}
+				}
+			}
+			cb->aio_buf = data + queued;
+			cb->aio_nbytes = n;
+			cb->aio_offset = offset;
+			started[(head + inflight) % AIO_MAX] = now_us();
+			r = aio_write(cb);
+			if (r)
+			{
+				lt_info("%s: aio_write %d (%m)\n", __func__, r);
+				failed = true;
+				if (exit_flag == RECORD_RUNNING)
+					exit_flag = RECORD_FAILED_FILE;
+				break;
+			}
+			if (index)
+				index->feed(data + queued, n, offset);
+			offset += n;
+			queued += n;
+			inflight++;
 		}
-		queued = buf_pos;
-		a.aio_buf = buf;
-		a.aio_nbytes = queued;
-		r = aio_write(&a);
-		if (r)
+		stats.dump(this);
+		if (exit_flag != RECORD_RUNNING)
 		{
-			lt_info("%s: aio_write %d (%m)\n", __func__, r);
-			exit_flag = RECORD_FAILED_FILE;
-			break;
+			if (!stopped)
+			{
+				/* no new data from now on, write out what is there */
+				dmx->Stop();
+				stopped = true;
+			}
+			/* the rest from SPTS and the spill buffer, as room gets free */
+			if (copy && !failed && Pump(src, 0) > 0)
+			{
+				int s = ring->peek(&data, 0, 1);
+				if (s > avail && !spill)
+					stats.read(s - avail);
+				if (s > 0)
+					avail = s;
+			}
+			lt_debug("%s: run-out write, avail %d queued %d\n", __func__, avail, queued);
+			/* with O_DIRECT, a partial block is left */
+			if (!inflight && (failed || (avail < (direct ? DIRECT_ALIGN : 1) && !(spill && spill->pending()))))
+				break;
 		}
 	}
-	dmx->Stop();
-	while (true) /* write out the unwritten buffer content */
+	if (direct)
 	{
-		lt_debug("%s: run-out write, buf_pos %d\n", __func__, buf_pos);
-		r = aio_error(&a);
-		if (r == EINPROGRESS)
+		fcntl(file_fd, F_SETFL, fcntl(file_fd, F_GETFL) & ~O_DIRECT);
+		if (avail > 0 && !failed)
 		{
-			usleep(50000);
-			continue;
-		}
-		r = aio_return(&a);
-		if (r < 0)
-		{
-			exit_flag = RECORD_FAILED_FILE;
-			lt_info("%s: aio_result: %d (%m)\n", __func__, r);
-			break;
+			int64_t start = now_us();
+			r = pwrite(file_fd, data, avail, offset);
+			if (r != avail)
+			{
+				lt_info("%s: tail write %d of %d (%m)\n", __func__, r, avail);
+				exit_flag = RECORD_FAILED_FILE;
+			}
+			else
+			{
+				stats.written(avail, start);
+				if (index)
+					index->feed(data, avail, offset);
+				ring->release(avail);
+				offset += avail;
+				avail = 0;
+			}
 		}
-		if (!queued)
-			break;
-		memmove(buf, buf + queued, buf_pos - queued);
-		buf_pos -= queued;
-		queued = buf_pos;
-		a.aio_buf = buf;
-		a.aio_nbytes = queued;
-		r = aio_write(&a);
 	}
+	/* give back the preallocated space after the end of the file, also
+	 * if O_DIRECT was given up on the way: truncating to the current
+	 * size does that */
+	if (alloc_end > offset && ftruncate(file_fd, offset))
+		lt_info("%s: ftruncate: %m\n", __func__);
+	/* the position of the caller's fd should be where it was with O_APPEND */
+	lseek(file_fd, offset, SEEK_SET);
 
 #if 0
 	// TODO: do we need to notify neutrino about failing recording?
@@ -376,6 +668,13 @@ void RecData::RecordThread()
 
 int cRecord::GetStatus()
 {
+	return GetStatus(NULL);
+}
+
+int cRecord::GetStatus(int *buffered)
+{
+	if (buffered)
+		*buffered = pd ? pd->buffered : 0;
 	if (pd)
 		return pd->state;
 	return REC_STATUS_OK; /* should not happen */
@@ -383,5 +682,12 @@ int cRecord::GetStatus()
 
 void cRecord::ResetStatus()
 {
-	return;
+	pd->state = REC_STATUS_OK;
+	pd->stats.reset();
+}
+
+bool cRecord::GetStats(rec_stats *stats)
+{
+	pd->stats.get(stats);
+	return true;
 }
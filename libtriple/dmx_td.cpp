@@ -548,6 +548,13 @@ void *cDemux::getBuffer()
 	return NULL;
 }
 
+/* the hardware only measures the bandwidth of the whole stream, see
+ * P->measure. No per PID statistics. */
+bool cDemux::GetStats(unsigned short, dmx_pid_stats *)
+{
+	return false;
+}
+
 void *cDemux::getChannel()
 {
 	lt_debug("%s #%d\n", __FUNCTION__, num);
@@ -17,6 +17,9 @@
 #include "video_hal.h"
 #include "video_priv.h"
 #include "lt_debug.h"
+#include "ts_scan.h"
+#include "rec_index.h"
+#include "timeshift.h"
 #define lt_debug(args...) _lt_debug(TRIPLE_DEBUG_PLAYBACK, this, args)
 #define lt_info(args...)  _lt_info(TRIPLE_DEBUG_PLAYBACK, this, args)
 #define lt_info_c(args...) _lt_info(TRIPLE_DEBUG_PLAYBACK, NULL, args)
@@ -104,6 +107,7 @@ public:
 	int mf_close(void);
 	off_t mf_lseek(off_t pos);
 	off_t mf_getsize(void);
+	ssize_t mf_read(uint8_t *buf, size_t len);
 	int curr_fileno;
 	off_t curr_pos;
 	off_t last_size;
@@ -128,7 +132,11 @@ public:
 	filetype_t filetype;
 	playstate_t playstate;
 
+	RecIndex *index; /* the recording's index file, if there is one */
+	TimeshiftFile *tshift; /* a circular timeshift file that is being written */
+	off_t tshift_pos; /* its read position, the file position is meaningless */
 	off_t seek_to_pts(int64_t pts);
+	off_t seek_fill(off_t pos);
 	off_t mp_seekSync(off_t pos);
 	int64_t get_PES_PTS(uint8_t *buf, int len, bool until_eof);
 
@@ -172,6 +180,9 @@ PBPrivate::PBPrivate(VDec *v)
 	in_fd = -1;
 	streamtype = 0;
 	vdec = v;
+	index = NULL;
+	tshift = NULL;
+	tshift_pos = 0;
 }
 
 PBPrivate::~PBPrivate()
@@ -223,6 +234,11 @@ void PBPrivate::Close(void)
 	lt_info("%s: after pthread_join\n", __FUNCTION__);
 	mf_close();
 	filelist.clear();
+	delete index;
+	index = NULL;
+	if (tshift)
+		tshift->put();
+	tshift = NULL;
 
 	if (inbuf)
 		free(inbuf);
@@ -312,6 +328,19 @@ bool PBPrivate::Start(char *filename, unsigned short vp, int vtype, unsigned sho
 	filelist_auto_add();
 	if (mf_open(0) < 0)
 		return false;
+	/* the offsets in the index are only valid for single file recordings */
+	if (filetype == FILETYPE_TS && filelist.size() == 1)
+	{
+		tshift = TimeshiftFile::get(filelist[0].Name.c_str());
+		if (!tshift)
+			index = RecIndex::open(filelist[0].Name.c_str());
+	}
+	off_t start = 0, tail;
+	if (tshift)
+	{
+		tshift->range(&start, &tail);
+		lt_info("timeshift from %lldk to %lldk\n", (long long)start / 1024, (long long)tail / 1024);
+	}
 
 	pts_start = pts_end = pts_curr = -1;
 	pesbuf_pos = 0;
@@ -320,7 +349,8 @@ bool PBPrivate::Start(char *filename, unsigned short vp, int vtype, unsigned sho
 	inbuf_sync = 0;
 	r = mf_getsize();
 
-	if (r > INBUF_SIZE)
+	/* with timeshift, the writer knows the times */
+	if (r > INBUF_SIZE && !tshift)
 	{
 		if (mp_seekSync(r - INBUF_SIZE) < 0)
 			return false;
@@ -343,7 +373,7 @@ bool PBPrivate::Start(char *filename, unsigned short vp, int vtype, unsigned sho
 	else
 		pts_end = -1; /* unknown */
 
-	if (mp_seekSync(0) < 0)
+	if (mp_seekSync(start) < 0)
 		return false;
 
 	pesbuf_pos = 0;
@@ -357,6 +387,8 @@ bool PBPrivate::Start(char *filename, unsigned short vp, int vtype, unsigned sho
 			break;
 	}
 	pts_curr = pts_start;
+	if (tshift)
+		tshift->times(&pts_start, &pts_end);
 	bytes_per_second = -1;
 	if (pts_end != -1 && pts_start > pts_end) /* PTS overflow during this file */
 		pts_end += 0x200000000ULL;
@@ -602,9 +634,19 @@ bool PBPrivate::GetPosition(int &position, int &duration)
 	lt_debug("%s\n", __FUNCTION__);
 	off_t currsize = mf_getsize();
 	bool update = false;
+	if (tshift)
+	{
+		/* the circular timeshift file: cheap */
+		int64_t head, tail;
+		if (tshift->times(&head, &tail))
+		{
+			pts_start = head;
+			pts_end = tail;
+		}
+	}
 	/* handle a growing file, e.g. for timeshift.
 	   this might be pretty expensive... */
-	if (filetype == FILETYPE_TS && filelist.size() == 1)
+	else if (filetype == FILETYPE_TS && filelist.size() == 1)
 	{
 		off_t tmppos = currsize - PESBUF_SIZE;
 		if (currsize > last_size && (currsize - last_size) < 10485760 &&
@@ -772,7 +814,7 @@ off_t PBPrivate::seek_to_pts(int64_t pts)
 	off_t newpos = curr_pos;
 	int64_t tmppts, ptsdiff;
 	int count = 0;
-	if (pts_start < 0 || pts_end < 0 || bytes_per_second < 0)
+	if (pts_start < 0 || pts_end < 0 || (bytes_per_second < 0 && !tshift))
 	{
 		lt_info("%s pts_start (%lld) or pts_end (%lld) or bytes_per_second (%lld) not initialized\n",
 			__FUNCTION__, pts_start, pts_end, bytes_per_second);
@@ -785,6 +827,21 @@ off_t PBPrivate::seek_to_pts(int64_t pts)
 		return -1;
 	}
 
+	/* the index has the I-frame right before pts, no need to get closer.
+	 * The timeshift file has the PCR at most half a second before */
+	off_t ipos = -1;
+	if (tshift)
+		ipos = tshift->find((pts_start + pts) & 0x1FFFFFFFFLL);
+	else if (index)
+		ipos = index->find((pts_start + pts) & 0x1FFFFFFFFLL);
+	if (ipos >= 0 && ipos < mf_getsize())
+	{
+		lt_info("%s index: %lldms => pos %lldk\n", __FUNCTION__, pts / 90, ipos / 1024);
+		return seek_fill(ipos);
+	}
+	if (tshift)
+		return -1;
+
 	/* tmppts is normalized current pts */
 	if (pts_curr < pts_start)
 		tmppts = pts_curr + 0x200000000ULL - pts_start;
@@ -799,17 +856,9 @@ off_t PBPrivate::seek_to_pts(int64_t pts)
 			__FUNCTION__, count, tmppts / 90, pts / 90, ptsdiff / 90, curr_pos / 1024, newpos / 1024, bytes_per_second / 1024);
 		if (newpos < 0)
 			newpos = 0;
-		newpos = mp_seekSync(newpos);
+		newpos = seek_fill(newpos);
 		if (newpos < 0)
 			return newpos;
-		pthread_mutex_lock(&inbufpos_mutex);
-		inbuf_pos = 0;
-		inbuf_sync = 0;
-		while (inbuf_pos < INBUF_SIZE * 8 / 10) {
-			if (inbuf_read() <= 0)
-				break; // EOF
-		}
-		pthread_mutex_unlock(&inbufpos_mutex);
 		if (pts_curr < pts_start)
 			tmppts = pts_curr + 0x200000000ULL - pts_start;
 		else
@@ -819,6 +868,23 @@ off_t PBPrivate::seek_to_pts(int64_t pts)
 	return newpos;
 }
 
+/* seek to pos and refill the input buffer, which also updates pts_curr */
+off_t PBPrivate::seek_fill(off_t pos)
+{
+	pos = mp_seekSync(pos);
+	if (pos < 0)
+		return pos;
+	pthread_mutex_lock(&inbufpos_mutex);
+	inbuf_pos = 0;
+	inbuf_sync = 0;
+	while (inbuf_pos < INBUF_SIZE * 8 / 10) {
+		if (inbuf_read() <= 0)
+			break; // EOF
+	}
+	pthread_mutex_unlock(&inbufpos_mutex);
+	return pos;
+}
+
 bool PBPrivate::filelist_auto_add()
 {
 	if (filelist.size() != 1)
@@ -889,6 +955,12 @@ int PBPrivate::mf_close(void)
 off_t PBPrivate::mf_getsize(void)
 {
 	off_t ret = 0;
+	if (tshift)
+	{
+		off_t head;
+		tshift->range(&head, &ret);
+		return ret;
+	}
 	if (filelist.size() == 1 && in_fd != -1)
 	{
 		/* for timeshift, we need to deal with a growing file... */
@@ -906,6 +978,17 @@ off_t PBPrivate::mf_lseek(off_t pos)
 {
 	off_t offset = 0, lpos = pos, ret;
 	unsigned int fileno;
+	if (tshift)
+	{
+		off_t head, tail;
+		tshift->range(&head, &tail);
+		if (pos > tail)
+			return -2;
+		if (pos < head)	/* overwritten already */
+			pos = (head + 187) / 188 * 188;
+		tshift_pos = curr_pos = pos;
+		return curr_pos;
+	}
 	/* this is basically needed for timeshifting - to allow
 	   growing files to be handled... */
 	if (filelist.size() == 1 && filetype == FILETYPE_TS)
@@ -946,6 +1029,27 @@ off_t PBPrivate::mf_lseek(off_t pos)
 	return curr_pos;
 }
 
+/* read() from the current file position, which for timeshift is tshift_pos */
+ssize_t PBPrivate::mf_read(uint8_t *buf, size_t len)
+{
+	if (!tshift)
+		return read(in_fd, buf, len);
+	ssize_t ret = tshift->read(in_fd, buf, len, tshift_pos);
+	if (ret < 0 && errno == ERANGE)
+	{
+		/* paused for too long, the writer has overtaken us */
+		off_t head, tail;
+		tshift->range(&head, &tail);
+		lt_info("%s: %lldk was overwritten, continuing at %lldk\n", __func__,
+			(long long)tshift_pos / 1024, (long long)head / 1024);
+		tshift_pos = curr_pos = (head + 187) / 188 * 188;
+		ret = tshift->read(in_fd, buf, len, tshift_pos);
+	}
+	if (ret > 0)
+		tshift_pos += ret;
+	return ret;
+}
+
 /* gets the PTS at a specific file position from a PES
    ATTENTION! resets buf!  */
 int64_t PBPrivate::get_PES_PTS(uint8_t *buf, int len, bool last)
@@ -1026,7 +1130,7 @@ ssize_t PBPrivate::read_ts()
 			ssize_t done = 0;
 			while (done < tmpread)
 			{
-				ret = read(in_fd, pesbuf, tmpread - done);
+				ret = mf_read(pesbuf, tmpread - done);
 				if (ret == 0 && retry) /* EOF */
 				{
 					mf_lseek(curr_pos);
@@ -1108,7 +1212,7 @@ ssize_t PBPrivate::read_ts()
 		pthread_mutex_lock(&currpos_mutex);
 		while(true)
 		{
-			ret = read(in_fd, inbuf + inbuf_pos, toread);
+			ret = mf_read(inbuf + inbuf_pos, toread);
 			if (ret == 0 && retry) /* EOF */
 			{
 				mf_lseek(curr_pos);
@@ -1146,8 +1250,11 @@ ssize_t PBPrivate::read_ts()
 		buf = inbuf + inbuf_sync + i;
 		if (*buf != 0x47)
 		{
-			synccnt++;
-			i++;
+			int s = ts_resync(buf, inbuf_pos - inbuf_sync - i, 188);
+			if (s < 0)
+				s = inbuf_pos - inbuf_sync - i;
+			synccnt += s;
+			i += s;
 			continue;
 		}
 		if (synccnt)
@@ -1504,36 +1611,39 @@ off_t PBPrivate::mp_seekSync(off_t pos)
 		return ret;
 	}
 
-	/* TODO: use bigger buffer here, too and handle EOF / next splitfile */
-	while (read(in_fd, pkt, 1) > 0)
+	/* read up to 100 packets and look for two sync bytes one packet apart,
+	 * continue with the next file in the list at EOF */
+	uint8_t tsbuf[101 * 188];
+	ssize_t have = 0, r;
+	bool retry = false;
+	while (have < (ssize_t)sizeof(tsbuf))
 	{
-		//-- check every byte until sync word reached --
-		npos++;
-		if (*pkt == 0x47)
+		r = mf_read(tsbuf + have, sizeof(tsbuf) - have);
+		if (r < 0)
 		{
-			//-- if found double check for next sync word --
-			if (read(in_fd, pkt, 188) == 188)
-			{
-				if(pkt[188-1] == 0x47)
-				{
-					ret = mf_lseek(npos - 1); // assume sync ok
-					pthread_mutex_unlock(&currpos_mutex);
-					if (ret < 0)
-						lt_info("%s:%d lseek ret < 0 (%m)\n", __FUNCTION__, __LINE__);
-					return ret;
-				}
-				else
-				{
-					ret = mf_lseek(npos); // oops, next pkt doesn't start with sync
-					if (ret < 0)
-						lt_info("%s:%d lseek ret < 0 (%m)\n", __FUNCTION__, __LINE__);
-				}
-			}
-		}
-
-		//-- check probe limits --
-		if (npos > (pos + 100 * 188))
+			if (errno == EINTR)
+				continue;
+			lt_info("%s read failed: %m\n", __FUNCTION__);
 			break;
+		}
+		if (r == 0) // EOF?
+		{
+			if (retry || mf_lseek(pos + have) < 0) /* next file in list? */
+				break;
+			retry = true;
+			continue;
+		}
+		retry = false;
+		have += r;
+	}
+	int s = ts_find_sync(tsbuf, have, 188);
+	if (s >= 0)
+	{
+		ret = mf_lseek(pos + s);
+		pthread_mutex_unlock(&currpos_mutex);
+		if (ret < 0)
+			lt_info("%s:%d lseek ret < 0 (%m)\n", __FUNCTION__, __LINE__);
+		return ret;
 	}
 
 	//-- on error stay on actual position --
@@ -1544,19 +1654,7 @@ off_t PBPrivate::mp_seekSync(off_t pos)
 
 static int sync_ts(uint8_t *p, int len)
 {
-	int count;
-	if (len < 189)
-		return -1;
-
-	count = 0;
-	while (*p != 0x47 || *(p + 188) != 0x47)
-	{
-		count++;
-		p++;
-		if (count + 188 > len)
-			return -1;
-	}
-	return count;
+	return ts_find_sync(p, len, 188);
 }
 
 /* get the pts value from a TS or PES packet
@@ -1634,23 +1732,17 @@ int64_t PBPrivate::get_pts(uint8_t *p, bool pes, int bufsize)
 static int mp_syncPES(uint8_t *buf, int len, bool quiet)
 {
 	int ret = 0;
+	int s;
 	while (ret < len - 4)
 	{
-		if (buf[ret + 2] != 0x01)
+		/* the stream ID must be inside the buffer, too */
+		s = ts_find_startcode(buf + ret, len - 2 - ret);
+		if (s < 0)
 		{
-			ret++;
-			continue;
-		}
-		if (buf[ret + 1] != 0x00)
-		{
-			ret += 2;
-			continue;
-		}
-		if (buf[ret] != 0x00)
-		{
-			ret += 3;
-			continue;
+			ret = len - 4;
+			break;
 		}
+		ret += s;
 		/* all stream IDs are > 0x80 */
 		if ((buf[ret + 3] & 0x80) != 0x80)
 		{
@@ -27,6 +27,8 @@
 
 #include "record_hal.h"
 #include "dmx_hal.h"
+#include "rec_index.h"
+#include "timeshift.h"
 #include "lt_debug.h"
 #define lt_debug(args...) _lt_debug(TRIPLE_DEBUG_RECORD, this, args)
 #define lt_info(args...) _lt_info(TRIPLE_DEBUG_RECORD, this, args)
@@ -49,6 +51,9 @@ public:
 		record_thread_running = false;
 		file_fd = -1;
 		exit_flag = RECORD_STOPPED;
+		index = NULL;
+		tshift_size = 0;
+		tshift = NULL;
 	}
 	int file_fd;
 	cDemux *dmx;
@@ -56,7 +61,11 @@ public:
 	bool record_thread_running;
 	record_state_t exit_flag;
 	int state;
+	RecIndexWriter *index;	/* see rec_index.h */
+	uint64_t tshift_size;	/* from SetTimeshift() */
+	TimeshiftFile *tshift;	/* see timeshift.h */
 	void RecordThread();
+	ssize_t Write(const uint8_t *buf, size_t len, off_t offset);
 };
 
 
@@ -113,6 +122,11 @@ bool cRecord::Start(int fd, unsigned short vpid, unsigned short *apids, int nump
 		pd->dmx->addPid(apids[i]);
 
 	pd->file_fd = fd;
+	if (pd->tshift_size)
+		pd->tshift = TimeshiftFile::create(fd, pd->tshift_size);
+	/* the offsets of a circular file are no use in an index file */
+	if (!pd->tshift)
+		pd->index = RecIndexWriter::create(fd, vpid);
 	pd->exit_flag = RECORD_RUNNING;
 	if (posix_fadvise(pd->file_fd, 0, 0, POSIX_FADV_DONTNEED))
 		perror("posix_fadvise");
@@ -125,6 +139,11 @@ bool cRecord::Start(int fd, unsigned short vpid, unsigned short *apids, int nump
 		lt_info("%s: error creating thread! (%m)\n", __func__);
 		delete pd->dmx;
 		pd->dmx = NULL;
+		delete pd->index;
+		pd->index = NULL;
+		if (pd->tshift)
+			pd->tshift->put();
+		pd->tshift = NULL;
 		return false;
 	}
 	pd->record_thread_running = true;
@@ -142,6 +161,12 @@ bool cRecord::Stop(void)
 	if (pd->record_thread_running)
 		pthread_join(pd->record_thread, NULL);
 	pd->record_thread_running = false;
+	delete pd->index;
+	pd->index = NULL;
+	/* the readers might still use it */
+	if (pd->tshift)
+		pd->tshift->put();
+	pd->tshift = NULL;
 
 	/* We should probably do that from the destructor... */
 	if (!pd->dmx)
@@ -215,6 +240,30 @@ bool cRecord::AddPid(unsigned short pid)
 	return dmx->addPid(pid);
 }
 
+bool cRecord::SetTimeshift(uint64_t size)
+{
+	lt_info("%s: %lld\n", __func__, (long long)size);
+	if (pd->record_thread_running)
+		return false;
+	pd->tshift_size = size;
+	return true;
+}
+
+/* write() at offset, which is the logical position with timeshift */
+ssize_t RecData::Write(const uint8_t *buf, size_t len, off_t offset)
+{
+	if (!tshift)
+		return write(file_fd, buf, len);
+	off_t size = tshift->getSize();
+	if ((off_t)len > size - offset % size)
+		len = size - offset % size;	/* up to the end of the file */
+	tshift->submit(offset + len);
+	ssize_t ret = pwrite(file_fd, buf, len, offset % size);
+	if (ret > 0)
+		tshift->written(buf, ret, offset);
+	return ret;
+}
+
 void RecData::RecordThread()
 {
 	lt_info("%s: begin\n", __func__);
@@ -223,6 +272,7 @@ void RecData::RecordThread()
 	int buf_pos = 0;
 	uint8_t *buf;
 	buf = (uint8_t *)malloc(BUFSIZE);
+	off_t offset = tshift ? 0 : lseek(file_fd, 0, SEEK_CUR);	/* for the index */
 
 	if (!buf)
 	{
@@ -258,13 +308,16 @@ void RecData::RecordThread()
 			size_t towrite = BUFSIZE / 2;
 			if (buf_pos < BUFSIZE / 2)
 				towrite = buf_pos;
-			r = write(file_fd, buf, towrite);
+			r = Write(buf, towrite, offset);
 			if (r < 0)
 			{
 				exit_flag = RECORD_FAILED_FILE;
 				lt_info("%s: write error: %m\n", __func__);
 				break;
 			}
+			if (index)
+				index->feed(buf, r, offset);
+			offset += r;
 			buf_pos -= r;
 			memmove(buf, buf + r, buf_pos);
 			lt_debug("%s: buf_pos %6d w %6d / %6d\n", __func__, buf_pos, (int)r, (int)towrite);
@@ -279,13 +332,16 @@ void RecData::RecordThread()
 	dmx->Stop();
 	while (buf_pos > 0) /* write out the unwritten buffer content */
 	{
-		r = write(file_fd, buf, buf_pos);
+		r = Write(buf, buf_pos, offset);
 		if (r < 0)
 		{
 			exit_flag = RECORD_FAILED_FILE;
 			lt_info("%s: write error: %m\n", __func__);
 			break;
 		}
+		if (index)
+			index->feed(buf, r, offset);
+		offset += r;
 		buf_pos -= r;
 		memmove(buf, buf + r, buf_pos);
 	}
@@ -311,6 +367,13 @@ void RecData::RecordThread()
 
 int cRecord::GetStatus()
 {
+	return GetStatus(NULL);
+}
+
+int cRecord::GetStatus(int *buffered)
+{
+	if (buffered)
+		*buffered = 0;
 	/* dummy for now */
 	return REC_STATUS_OK;
 }
@@ -319,3 +382,9 @@ void cRecord::ResetStatus()
 {
 	return;
 }
+
+/* not implemented here */
+bool cRecord::GetStats(rec_stats *)
+{
+	return false;
+}
@@ -35,6 +35,8 @@
 #include <sys/ioctl.h>
 #include "dmx_hal.h"
 #include "lt_debug.h"
+#include "mmap_ring.h"
+#include "ts_stats.h"
 
 /* needed for getSTC :-( */
 #include "video_hal.h"
@@ -75,6 +77,12 @@ static const char *devname[] = {
 static int dmx_tp_count = 0;
 #define MAX_TS_COUNT 8
 
+typedef struct dmx_pdata {
+	cMmapRing *ring;	/* created by getBuffer() */
+	TSStats *stats;		/* DMX_TP_CHANNEL only */
+} dmx_pdata;
+#define P ((dmx_pdata *)pdata)
+
 cDemux::cDemux(int n)
 {
 	if (n < 0 || n > 2)
@@ -85,12 +93,15 @@ cDemux::cDemux(int n)
 	else
 		num = n;
 	fd = -1;
+	pdata = calloc(1, sizeof(dmx_pdata));
 }
 
 cDemux::~cDemux()
 {
 	lt_debug("%s #%d fd: %d\n", __FUNCTION__, num, fd);
 	Close();
+	free(pdata);
+	pdata = NULL;
 }
 
 bool cDemux::Open(DMX_CHANNEL_TYPE pes_type, void * /*hVideoBuffer*/, int uBufferSize)
@@ -134,6 +145,8 @@ bool cDemux::Open(DMX_CHANNEL_TYPE pes_type, void * /*hVideoBuffer*/, int uBuffe
 			lt_info("%s DMX_SET_BUFFER_SIZE failed (%m)\n", __func__);
 	}
 	buffersize = uBufferSize;
+	if (dmx_type == DMX_TP_CHANNEL)
+		P->stats = new TSStats();
 
 	return true;
 }
@@ -147,8 +160,15 @@ void cDemux::Close(void)
 		return;
 	}
 	pesfds.clear();
+	if (P->ring)
+	{
+		delete P->ring;
+		P->ring = NULL;
+	}
 	ioctl(fd, DMX_STOP);
 	close(fd);
+	delete P->stats;
+	P->stats = NULL;
 	fd = -1;
 	if (dmx_type == DMX_TP_CHANNEL)
 	{
@@ -170,6 +190,8 @@ bool cDemux::Start(bool)
 		return false;
 	}
 	ioctl(fd, DMX_START);
+	if (P->ring)
+		P->ring->reset();
 	return true;
 }
 
@@ -193,6 +215,14 @@ int cDemux::Read(unsigned char *buff, int len, int timeout)
 			__FUNCTION__, num, fd, DMX_T[dmx_type], len, timeout);
 #endif
 	int rc;
+	if (P->ring)
+	{
+		/* the ring is filled from fd, so fd must not be read directly */
+		rc = P->ring->read(buff, len, timeout > 0 ? timeout : (dmx_type == DMX_PSI_CHANNEL ? -1 : 0));
+		if (rc < 0)
+			dmx_err("read: %s", strerror(errno), 0);
+		return rc;
+	}
 	struct pollfd ufds;
 	ufds.fd = fd;
 	ufds.events = POLLIN|POLLPRI|POLLERR;
@@ -234,6 +264,14 @@ int cDemux::Read(unsigned char *buff, int len, int timeout)
 	}
 
 	rc = ::read(fd, buff, len);
+	/* with a ring, the producer feeds the stats */
+	if (P->stats)
+	{
+		if (rc > 0)
+			P->stats->feed(buff, rc);
+		else if (rc < 0 && errno == EOVERFLOW)
+			P->stats->overflow();
+	}
 	//fprintf(stderr, "fd %d ret: %d\n", fd, rc);
 	if (rc < 0)
 		dmx_err("read: %s", strerror(errno), 0);
@@ -351,6 +389,8 @@ bool cDemux::sectionFilter(unsigned short _pid, const unsigned char * const filt
 	fprintf(stderr,"mode: ");for(int i=0;i<DMX_FILTER_SIZE;i++)fprintf(stderr,"%02hhx ",s_flt.filter.mode  [i]);fprintf(stderr,"\n");
 #endif
 	ioctl (fd, DMX_STOP);
+	if (P->ring)
+		P->ring->reset();
 	if (ioctl(fd, DMX_SET_FILTER, &s_flt) < 0)
 		return false;
 
@@ -404,6 +444,8 @@ bool cDemux::pesFilter(const unsigned short _pid)
 		lt_info("%s #%d invalid dmx_type %d!\n", __func__, num, dmx_type);
 		return false;
 	}
+	if (P->ring)
+		P->ring->reset();
 	return (ioctl(fd, DMX_SET_PES_FILTER, &p_flt) >= 0);
 }
 
@@ -412,10 +454,36 @@ void cDemux::SetSyncMode(AVSYNC_TYPE /*mode*/)
 	lt_debug("%s #%d\n", __FUNCTION__, num);
 }
 
+/* returns a cMmapRing, see mmap_ring.h. Once it is used, Read() also
+ * reads from the ring */
 void *cDemux::getBuffer()
 {
 	lt_debug("%s #%d\n", __FUNCTION__, num);
-	return NULL;
+	if (fd < 0)
+		return NULL;
+	if (!P->ring)
+	{
+		cMmapRing *ring = new cMmapRing(buffersize);
+		if (ring->getSize() == 0)
+		{
+			delete ring;
+			return NULL;
+		}
+		ring->setSource(fd);
+		if (P->stats)
+			ring->setTap(TSStats::tap, P->stats);
+		P->ring = ring;
+	}
+	return P->ring;
+}
+
+bool cDemux::GetStats(unsigned short _pid, dmx_pid_stats *stats)
+{
+	if (!P->stats || !P->stats->get(_pid, stats))
+		return false;
+	if (P->ring)
+		stats->overflows += P->ring->getOverflows();
+	return true;
 }
 
 void *cDemux::getChannel()
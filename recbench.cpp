@@ -0,0 +1,313 @@
+/* record benchmark for libstb-hal
+ * License: GPL v2 or later
+ *
+ * Runs some cRecord instances on a synthetic (or file) TS stream that
+ * is fed through the userspace demux (HAL_SWDEMUX) at a given bitrate,
+ * and reports what reached the disk, the CPU time that took and the
+ * overflows. The HAL_REC_* variables work as usual, so the buffer
+ * strategies can be compared on the same storage.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <string>
+#include <vector>
+
+#include <include/record_hal.h>
+
+#define MAX_RECORDINGS 16
+#define PMT_PID 0x20
+/* packets per write() to the demux */
+#define BLOCK 64
+
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#endif
+
+static volatile bool running = true;
+static int pipe_fd[2];
+/* the demux does not slow down its source (as a tuner would not), so
+ * find the limit by raising the bitrate until there are overflows */
+static double bitrate = 20e6;	/* bit/s */
+static const char *input = NULL;
+static uint16_t vpid = 0x100;
+static uint16_t apid = 0x101;
+static uint64_t fed = 0;
+static double feeder_cpu = 0;
+
+static double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static double cpu_time(int who)
+{
+	struct rusage r;
+	getrusage(who, &r);
+	return r.ru_utime.tv_sec + r.ru_utime.tv_usec / 1e6 +
+		r.ru_stime.tv_sec + r.ru_stime.tv_usec / 1e6;
+}
+
+static uint32_t crc32_mpeg(const uint8_t *p, int len)
+{
+	uint32_t crc = 0xffffffff;
+	while (len--) {
+		crc ^= (uint32_t)*p++ << 24;
+		for (int i = 0; i < 8; i++)
+			crc = (crc << 1) ^ ((crc & 0x80000000) ? 0x04c11db7 : 0);
+	}
+	return crc;
+}
+
+/* one packet with a complete section */
+static void psi_packet(uint8_t *pkt, uint16_t pid, uint8_t *cc, const uint8_t *sec, int len)
+{
+	memset(pkt, 0xff, 188);
+	pkt[0] = 0x47;
+	pkt[1] = 0x40 | (pid >> 8);
+	pkt[2] = pid & 0xff;
+	pkt[3] = 0x10 | ((*cc)++ & 0x0f);
+	pkt[4] = 0;	/* pointer_field */
+	memcpy(pkt + 5, sec, len);
+	uint32_t crc = crc32_mpeg(sec, len);
+	pkt[5 + len] = crc >> 24;
+	pkt[6 + len] = crc >> 16;
+	pkt[7 + len] = crc >> 8;
+	pkt[8 + len] = crc;
+}
+
+/* a service with one video and one audio PID, PAT and PMT every 100ms
+ * and a PCR every 40ms, the payload is a pattern */
+static int synth(uint8_t *buf, int n, double t)
+{
+	static uint8_t cc[4];
+	static double next_psi = 0, next_pcr = 0;
+	static unsigned int count = 0;
+	int i = 0;
+	if (t >= next_psi && n >= 2) {
+		const uint8_t pat[] = { 0x00, 0xb0, 13, 0x12, 0x34, 0xc1, 0, 0,
+					0x00, 0x01, 0xe0 | (PMT_PID >> 8), PMT_PID & 0xff };
+		const uint8_t vh = 0xe0 | (vpid >> 8), vl = vpid & 0xff;
+		const uint8_t ah = 0xe0 | (apid >> 8), al = apid & 0xff;
+		const uint8_t pmt[] = { 0x02, 0xb0, 23, 0x00, 0x01, 0xc1, 0, 0,
+					vh, vl, 0xf0, 0,
+					0x1b, vh, vl, 0xf0, 0,
+					0x03, ah, al, 0xf0, 0 };
+		psi_packet(buf, 0, &cc[2], pat, sizeof(pat));
+		psi_packet(buf + 188, PMT_PID, &cc[3], pmt, sizeof(pmt));
+		i = 2;
+		next_psi = t + 0.1;
+	}
+	for (; i < n; i++, count++) {
+		uint8_t *p = buf + i * 188;
+		bool audio = (count % 10) == 9;
+		uint16_t pid = audio ? apid : vpid;
+		p[0] = 0x47;
+		p[1] = pid >> 8;
+		p[2] = pid & 0xff;
+		p[3] = 0x10 | (cc[audio]++ & 0x0f);
+		int o = 4;
+		if (!audio && t >= next_pcr) {
+			uint64_t pcr = (uint64_t)(t * 90000) & 0x1ffffffffULL;
+			p[3] |= 0x20;
+			p[4] = 7;
+			p[5] = 0x10;
+			p[6] = pcr >> 25;
+			p[7] = pcr >> 17;
+			p[8] = pcr >> 9;
+			p[9] = pcr >> 1;
+			p[10] = (pcr << 7) | 0x7e;
+			p[11] = 0;
+			o = 12;
+			next_pcr = t + 0.04;
+		}
+		memset(p + o, count & 0xff, 188 - o);
+	}
+	return n * 188;
+}
+
+static void *feeder(void *)
+{
+	uint8_t buf[BLOCK * 188];
+	int in = -1;
+	if (input) {
+		in = open(input, O_RDONLY);
+		if (in < 0) {
+			perror(input);
+			running = false;
+			return NULL;
+		}
+	}
+	double start = now();
+	while (running) {
+		double t = now() - start;
+		if (fed * 8 > bitrate * t) {
+			usleep(1000);
+			continue;
+		}
+		int len;
+		if (in > -1) {
+			len = read(in, buf, sizeof(buf));
+			if (len <= 0) {	/* loop the file */
+				lseek(in, 0, SEEK_SET);
+				continue;
+			}
+		} else
+			len = synth(buf, BLOCK, t);
+		int w = 0;
+		while (w < len && running) {
+			int r = write(pipe_fd[1], buf + w, len - w);
+			if (r < 0 && errno != EINTR)
+				break;
+			if (r > 0)
+				w += r;
+		}
+		fed += w;
+	}
+	if (in > -1)
+		close(in);
+	feeder_cpu = cpu_time(RUSAGE_THREAD);
+	return NULL;
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [options]\n"
+		"  -n <count>     concurrent recordings (1, max %d)\n"
+		"  -b <Mbit/s>    input bitrate (20)\n"
+		"  -t <seconds>   duration (30)\n"
+		"  -d <dir>       where the recordings are written (.)\n"
+		"  -i <file.ts>   TS input instead of the synthetic stream, looped\n"
+		"  -v <pid>       video PID (0x100), -a <pid> audio PID (0x101)\n"
+		"  -k             keep the recordings\n"
+		"The HAL_REC_* variables select the record buffer strategies.\n",
+		name, MAX_RECORDINGS);
+}
+
+int main(int argc, char **argv)
+{
+	int num = 1;
+	int duration = 30;
+	const char *dir = ".";
+	bool keep = false;
+	int c;
+	while ((c = getopt(argc, argv, "n:b:t:d:i:v:a:kh")) != -1) {
+		switch (c) {
+		case 'n': num = atoi(optarg); break;
+		case 'b': bitrate = atof(optarg) * 1e6; break;
+		case 't': duration = atoi(optarg); break;
+		case 'd': dir = optarg; break;
+		case 'i': input = optarg; break;
+		case 'v': vpid = strtol(optarg, NULL, 0); break;
+		case 'a': apid = strtol(optarg, NULL, 0); break;
+		case 'k': keep = true; break;
+		default:
+			usage(argv[0]);
+			return c != 'h';
+		}
+	}
+	if (num < 1 || num > MAX_RECORDINGS || duration < 1 || bitrate <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (pipe(pipe_fd)) {
+		perror("pipe");
+		return 1;
+	}
+	fcntl(pipe_fd[1], F_SETPIPE_SZ, 1 << 20);
+	char src[16];
+	snprintf(src, sizeof(src), "fd:%d", pipe_fd[0]);
+	/* all recordings read the one stream through the userspace demux */
+	setenv("HAL_SWDEMUX", src, 1);
+	signal(SIGPIPE, SIG_IGN);
+
+	std::vector<cRecord *> rec;
+	std::vector<std::string> names;
+	for (int i = 0; i < num; i++) {
+		char name[4096];
+		snprintf(name, sizeof(name), "%s/recbench-%d.ts", dir, i);
+		int fd = open(name, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0644);
+		if (fd < 0) {
+			perror(name);
+			return 1;
+		}
+		cRecord *r = new cRecord(0);
+		unsigned short apids[1] = { apid };
+		if (!r->Start(fd, vpid, apids, 1)) {
+			fprintf(stderr, "%s: cRecord::Start failed\n", name);
+			return 1;
+		}
+		rec.push_back(r);
+		names.push_back(name);
+	}
+
+	double cpu0 = cpu_time(RUSAGE_SELF);
+	double t0 = now();
+	pthread_t thread;
+	pthread_create(&thread, NULL, feeder, NULL);
+	uint64_t last_written = 0;
+	for (int s = 1; s <= duration && running; s++) {
+		sleep(1);
+		uint64_t written = 0;
+		unsigned int overflows = 0, lost = 0;
+		for (int i = 0; i < num; i++) {
+			rec_stats st;
+			if (!rec[i]->GetStats(&st))
+				continue;
+			written += st.bytes_written;
+			overflows += st.overflows;
+			lost += st.lost;
+		}
+		printf("%3ds: in %6.1f Mbit/s, written %6.1f MB/s, overflows %u, lost %u\n",
+			s, fed * 8 / 1e6 / (now() - t0), (written - last_written) / 1e6, overflows, lost);
+		fflush(stdout);
+		last_written = written;
+	}
+	running = false;
+	/* the recordings still read, the feeder cannot block */
+	pthread_join(thread, NULL);
+	close(pipe_fd[1]);
+
+	printf("\n%-24s %6s %10s %10s %9s %6s %s\n", "recording", "status", "MB", "max ms", "overflows", "lost",
+		"writes <1 <4 <16 <64 <256 <1k <4k more ms");
+	uint64_t total = 0;
+	for (int i = 0; i < num; i++) {
+		rec_stats st;
+		memset(&st, 0, sizeof(st));
+		rec[i]->GetStats(&st);
+		int status = rec[i]->GetStatus();
+		rec[i]->Stop();
+		total += st.bytes_written;
+		std::string base = names[i].substr(names[i].rfind('/') + 1);
+		printf("%-24s %6d %10.1f %10u %9u %6u", base.c_str(), status, st.bytes_written / 1e6,
+			st.latency_max, st.overflows, st.lost);
+		for (int j = 0; j < REC_STATS_BUCKETS; j++)
+			printf(" %u", st.latency[j]);
+		printf("\n");
+		delete rec[i];
+		if (!keep)
+			unlink(names[i].c_str());
+	}
+	double elapsed = now() - t0;
+	double cpu = cpu_time(RUSAGE_SELF) - cpu0 - feeder_cpu;
+	printf("\ninput %.1f MB (%.1f Mbit/s), written %.1f MB in %.1f s: %.2f MB/s, "
+		"CPU %.2f ms per MB written (without the feeder)\n",
+		fed / 1e6, fed * 8 / 1e6 / elapsed, total / 1e6, elapsed, total / 1e6 / elapsed,
+		total ? cpu * 1000 / (total / 1e6) : 0.0);
+	return 0;
+}
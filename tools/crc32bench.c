@@ -0,0 +1,89 @@
+/*
+ * crc32bench - compare the CRC32/MPEG-2 implementations of libstb-hal
+ *
+ * usage: crc32bench [megabytes]
+ *
+ * checks that all implementations usable on this CPU agree and measures
+ * their throughput on typical section sizes and on large buffers.
+ *
+ * License: GPLv2 or later
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "crc32.h"
+
+static double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	/* short PAT/PMT, a typical EIT section, the largest section, bulk data */
+	static const int sizes[] = { 16, 184, 1024, 4096, 65536 };
+	const int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+	const struct dvb_crc32_impl *impl;
+	int n = dvb_crc32_impls(&impl);
+	int mb = 256;
+	int i, j, ret = 0;
+	uint8_t *buf;
+
+	if (argc > 1)
+		mb = atoi(argv[1]);
+	if (mb <= 0)
+		mb = 256;
+	buf = malloc(65536 + 1);
+	if (!buf) {
+		perror("malloc");
+		return 1;
+	}
+	srand(1);
+	for (i = 0; i < 65536 + 1; i++)
+		buf[i] = rand();
+
+	/* correctness: all lengths and alignments against the byte wise one */
+	for (j = 1; j < n; j++) {
+		int len, off;
+		for (len = 0; len <= 4096; len++) {
+			for (off = 0; off < 2; off++) {
+				uint32_t a = impl[0].fn(0xffffffff, buf + off, len);
+				uint32_t b = impl[j].fn(0xffffffff, buf + off, len);
+				if (a != b) {
+					printf("%s: MISMATCH len %d offset %d: %08x != %08x\n",
+						impl[j].name, len, off, b, a);
+					ret = 1;
+					len = 4096;
+					break;
+				}
+			}
+		}
+	}
+
+	printf("default: %s\n", dvb_crc32_name());
+	printf("%-8s", "bytes");
+	for (i = 0; i < nsizes; i++)
+		printf(" %10d", sizes[i]);
+	printf("   (MB/s)\n");
+	for (j = 0; j < n; j++) {
+		printf("%-8s", impl[j].name);
+		for (i = 0; i < nsizes; i++) {
+			long loops = (long)mb * 1024 * 1024 / sizes[i];
+			volatile uint32_t sink = 0;
+			double t = now();
+			long l;
+			for (l = 0; l < loops; l++)
+				sink ^= impl[j].fn(0xffffffff, buf, sizes[i]);
+			t = now() - t;
+			printf(" %10.1f", t > 0 ? mb / t : 0.0);
+			fflush(stdout);
+			(void)sink;
+		}
+		printf("\n");
+	}
+	free(buf);
+	return ret;
+}
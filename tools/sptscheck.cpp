@@ -0,0 +1,248 @@
+/*
+ * sptscheck - check the PMT of single program TS recordings (HAL_REC_SPTS)
+ *
+ * usage: sptscheck
+ *
+ * records a generated service with video, audio and subtitle streams
+ * through cRecord on a stub demux that, like spark and generic-pc, does not
+ * list the pesFilter() PID in pesfds, and only delivers the PIDs that are
+ * set. The recording starts with subtitles and audio, then the subtitles
+ * are removed with ChangePids(). The last PMT in the recording must have
+ * the video and the audio stream, but not the subtitles.
+ *
+ * License: GPLv2 or later
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "dmx_hal.h"
+#include "record_hal.h"
+#include "mmap_ring.h"
+#include "crc32.h"
+
+#define SID	0x0001
+#define PMT_PID	0x0020
+#define VPID	0x0100
+#define APID	0x0101
+#define SPID	0x0102
+
+static int pipefd[2];
+static cMmapRing *ring;
+/* the PID filter of the stub demux */
+static pthread_mutex_t filter_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t filter[0x2000];
+
+static void set_filter(unsigned short pid, bool on)
+{
+	pthread_mutex_lock(&filter_lock);
+	filter[pid & 0x1fff] = on;
+	pthread_mutex_unlock(&filter_lock);
+}
+
+/* just enough of a demux for cRecord */
+cDemux::cDemux(int n) { num = n; fd = -1; buffersize = 0; }
+cDemux::~cDemux() { }
+bool cDemux::Open(DMX_CHANNEL_TYPE, void *, int size) { buffersize = size; return true; }
+bool cDemux::pesFilter(const unsigned short p)
+{
+	pesfds.clear();
+	memset(filter, 0, sizeof(filter));
+	set_filter(p, true);
+	return true;
+}
+bool cDemux::addPid(unsigned short p)
+{
+	pes_pids x;
+	x.fd = -1;
+	x.pid = p;
+	pesfds.push_back(x);
+	set_filter(p, true);
+	return true;
+}
+void cDemux::removePid(unsigned short p)
+{
+	for (std::vector<pes_pids>::iterator i = pesfds.begin(); i != pesfds.end(); ++i)
+		if ((*i).pid == p) {
+			pesfds.erase(i);
+			set_filter(p, false);
+			return;
+		}
+}
+bool cDemux::Start(bool) { return true; }
+bool cDemux::Stop(void) { return true; }
+void *cDemux::getBuffer()
+{
+	if (!ring) {
+		ring = new cMmapRing(buffersize);
+		ring->setSource(pipefd[0]);
+	}
+	return ring;
+}
+
+static uint8_t cc[0x2000];
+
+static void put_pkt(std::vector<uint8_t> &ts, int pid, const uint8_t *data, int len, bool pusi)
+{
+	uint8_t p[188];
+	p[0] = 0x47;
+	p[1] = (pusi ? 0x40 : 0) | (pid >> 8);
+	p[2] = pid & 0xff;
+	p[3] = 0x10 | (cc[pid]++ & 0x0f);
+	memset(p + 4, 0xff, 184);
+	memcpy(p + 4, data, len);
+	ts.insert(ts.end(), p, p + 188);
+}
+
+/* a short section with pointer_field into one packet */
+static void put_section(std::vector<uint8_t> &ts, int pid, std::vector<uint8_t> sec)
+{
+	int len = sec.size() + 4 - 3;
+	sec[1] = 0xb0 | (len >> 8);
+	sec[2] = len & 0xff;
+	uint32_t crc = dvb_crc32_update(0xffffffff, &sec[0], sec.size());
+	for (int i = 0; i < 4; i++)
+		sec.push_back(crc >> (24 - 8 * i));
+	sec.insert(sec.begin(), 0);
+	put_pkt(ts, pid, &sec[0], sec.size(), true);
+}
+
+static void put_es(std::vector<uint8_t> &sec, int type, int pid)
+{
+	const uint8_t es[] = { (uint8_t)type, (uint8_t)(0xe0 | (pid >> 8)), (uint8_t)(pid & 0xff), 0xf0, 0x00 };
+	sec.insert(sec.end(), es, es + sizeof(es));
+}
+
+/* writes the packets of the PIDs in the filter */
+static void deliver(const std::vector<uint8_t> &ts)
+{
+	std::vector<uint8_t> out;
+	pthread_mutex_lock(&filter_lock);
+	for (size_t i = 0; i + 188 <= ts.size(); i += 188)
+		if (filter[((ts[i + 1] & 0x1f) << 8) | ts[i + 2]])
+			out.insert(out.end(), ts.begin() + i, ts.begin() + i + 188);
+	pthread_mutex_unlock(&filter_lock);
+	for (size_t done = 0; done < out.size(); ) {
+		ssize_t w = write(pipefd[1], &out[done], out.size() - done);
+		if (w > 0)
+			done += w;
+		else
+			usleep(1000);
+	}
+}
+
+static void feed(int count)
+{
+	std::vector<uint8_t> ts;
+	const uint8_t pat[] = { 0x00, 0, 0, 0x12, 0x34, 0xc1, 0, 0,
+		SID >> 8, SID & 0xff, 0xe0 | (PMT_PID >> 8), PMT_PID & 0xff };
+	const uint8_t pmt[] = { 0x02, 0, 0, SID >> 8, SID & 0xff, 0xc1, 0, 0,
+		0xe0 | (VPID >> 8), VPID & 0xff, 0xf0, 0x00 };
+	uint8_t pl[184];
+	memset(pl, 0, sizeof(pl));
+	for (int i = 0; i < count; i++) {
+		if (i % 20 == 0) {
+			/* the filter may change in between */
+			deliver(ts);
+			ts.clear();
+			usleep(10000);
+			put_section(ts, 0, std::vector<uint8_t>(pat, pat + sizeof(pat)));
+			std::vector<uint8_t> sec(pmt, pmt + sizeof(pmt));
+			put_es(sec, 0x1b, VPID);
+			put_es(sec, 0x03, APID);
+			put_es(sec, 0x06, SPID);
+			put_section(ts, PMT_PID, sec);
+		}
+		put_pkt(ts, VPID, pl, 184, false);
+		put_pkt(ts, APID, pl, 184, false);
+		put_pkt(ts, SPID, pl, 184, false);
+	}
+	deliver(ts);
+	usleep(200000);
+}
+
+/* checks the last PMT in the recording, returns the number of errors */
+static int check(const char *what, int fd)
+{
+	std::vector<uint8_t> last;
+	uint8_t p[188];
+	off_t off = 0;
+	while (pread(fd, p, 188, off) == 188) {
+		off += 188;
+		if (p[0] != 0x47 || (((p[1] & 0x1f) << 8) | p[2]) != PMT_PID || !(p[1] & 0x40))
+			continue;
+		int seclen = ((p[6] & 0x0f) << 8) | p[7];
+		if (seclen > 188 - 8)
+			continue;
+		last.assign(p + 5, p + 5 + 3 + seclen);
+	}
+	if (last.empty()) {
+		printf("%s: FAIL, no PMT recorded\n", what);
+		return 1;
+	}
+	if (dvb_crc32_update(0xffffffff, &last[0], last.size()) != 0) {
+		printf("%s: FAIL, PMT CRC\n", what);
+		return 1;
+	}
+	bool video = false, audio = false, subs = false;
+	int pilen = ((last[10] & 0x0f) << 8) | last[11];
+	int end = last.size() - 4;
+	for (int i = 12 + pilen; i + 5 <= end; ) {
+		int pid = ((last[i + 1] & 0x1f) << 8) | last[i + 2];
+		if (last[i] == 0x1b && pid == VPID)
+			video = true;
+		else if (last[i] == 0x03 && pid == APID)
+			audio = true;
+		else if (pid == SPID)
+			subs = true;
+		i += 5 + (((last[i + 3] & 0x0f) << 8) | last[i + 4]);
+	}
+	bool ok = video && audio && !subs;
+	printf("%s: %s, video %s, audio %s, subtitles %s\n", what, ok ? "ok" : "FAIL",
+		video ? "yes" : "NO", audio ? "yes" : "NO", subs ? "YES" : "no");
+	return !ok;
+}
+
+int main(void)
+{
+	char name[] = "/tmp/sptscheck.XXXXXX";
+	/* the first one is dropped later */
+	unsigned short apids[] = { SPID, APID };
+	int ret = 0;
+
+	setenv("HAL_REC_SPTS", "1", 1);
+	if (pipe(pipefd)) {
+		perror("pipe");
+		return 1;
+	}
+	fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+	int fd = mkstemp(name);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+
+	cRecord *rec = new cRecord(0);
+	if (!rec->Start(fd, VPID, apids, 2, SID)) {
+		printf("Start failed\n");
+		unlink(name);
+		return 1;
+	}
+	feed(200);
+	/* drop the subtitles, but not the video stream */
+	rec->ChangePids(VPID, apids + 1, 1);
+	feed(200);
+	rec->Stop();
+	delete rec;
+
+	/* cRecord::Stop() closed it */
+	fd = open(name, O_RDONLY);
+	unlink(name);
+	ret += check("Start/ChangePids", fd);
+	close(fd);
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * streamcheck - check the TS streaming server (cStream)
+ *
+ * usage: streamcheck
+ *
+ * writes a generated TS file with video, audio and one unrelated PID and
+ * streams the video and audio of it through the userspace demux
+ * (HAL_SWDEMUX=<file>) to three clients on 127.0.0.1: one which just
+ * reads (raw TS), one which sends a HTTP GET, and one which never reads.
+ * The first two must get whole packets of the two PIDs only, the HTTP
+ * client after a HTTP reply, and must go on getting them after the third
+ * one is dropped for being too slow.
+ *
+ * License: GPLv2 or later
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <string>
+#include <vector>
+
+#include "stream_hal.h"
+#include "hal_time.h"
+
+#define VPID	0x0100
+#define APID	0x0101
+#define XPID	0x0200	/* not streamed */
+#define PORT	31340
+/* 32MB at 80 Mbit/s: a bit more than 3 seconds */
+#define FILE_SIZE	(32 << 20)
+#define RATE	"80000"
+
+struct reader {
+	const char *what;
+	int fd;
+	bool http;
+	pthread_t thread;
+	/* written by the thread only */
+	volatile uint64_t packets;
+	int bad;
+	bool reply;		/* HTTP reply seen */
+};
+
+static void put_pkt(std::vector<uint8_t> &ts, int pid)
+{
+	static uint8_t cc[0x2000];
+	uint8_t p[188];
+	p[0] = 0x47;
+	p[1] = pid >> 8;
+	p[2] = pid & 0xff;
+	p[3] = 0x10 | (cc[pid]++ & 0x0f);
+	memset(p + 4, pid & 0xff, 184);
+	ts.insert(ts.end(), p, p + 188);
+}
+
+static bool write_file(int fd)
+{
+	std::vector<uint8_t> ts;
+	for (int i = 0; i < 1000; i++) {
+		put_pkt(ts, VPID);
+		put_pkt(ts, VPID);
+		put_pkt(ts, APID);
+		put_pkt(ts, XPID);
+	}
+	for (int done = 0; done < FILE_SIZE; done += ts.size())
+		if (write(fd, &ts[0], ts.size()) != (ssize_t)ts.size())
+			return false;
+	return true;
+}
+
+static int client(int rcvbuf)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (rcvbuf)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(PORT);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* reads until the server closes the connection, checks every packet */
+static void *read_thread(void *arg)
+{
+	reader *r = (reader *)arg;
+	std::string head;
+	uint8_t buf[65536];
+	uint8_t pkt[188];
+	int fill = 0;
+	while (true) {
+		ssize_t n = recv(r->fd, buf, sizeof(buf), 0);
+		if (n <= 0)
+			break;
+		uint8_t *p = buf;
+		if (r->http && !r->reply) {
+			head.append((char *)buf, n);
+			size_t end = head.find("\r\n\r\n");
+			if (end == std::string::npos)
+				continue;
+			r->reply = true;
+			if (head.compare(0, 13, "HTTP/1.0 200 "))
+				r->bad++;
+			/* the rest is TS */
+			p = buf + n - (head.size() - end - 4);
+			n = head.size() - end - 4;
+		}
+		while (n > 0) {
+			int c = 188 - fill;
+			if (c > n)
+				c = n;
+			memcpy(pkt + fill, p, c);
+			fill += c;
+			p += c;
+			n -= c;
+			if (fill < 188)
+				break;
+			fill = 0;
+			int pid = ((pkt[1] & 0x1f) << 8) | pkt[2];
+			if (pkt[0] != 0x47 || (pid != VPID && pid != APID))
+				r->bad++;
+			r->packets++;
+		}
+	}
+	return NULL;
+}
+
+static int check(reader &r, uint64_t before_drop)
+{
+	bool ok = r.packets > before_drop && !r.bad && (!r.http || r.reply);
+	printf("%s: %s, %llu packets, %llu after the drop, %d bad\n", r.what, ok ? "ok" : "FAIL",
+		(unsigned long long)r.packets, (unsigned long long)(r.packets - before_drop), r.bad);
+	return !ok;
+}
+
+int main(void)
+{
+	char name[] = "/tmp/streamcheck.XXXXXX";
+	unsigned short apids[] = { APID };
+	int ret = 0;
+
+	int fd = mkstemp(name);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	if (!write_file(fd)) {
+		perror("write");
+		unlink(name);
+		return 1;
+	}
+	close(fd);
+	setenv("HAL_SWDEMUX", name, 1);
+	setenv("HAL_SWDEMUX_RATE", RATE, 1);
+
+	cStream *s = new cStream(0);
+	if (!s->Start(PORT, VPID, apids, 1)) {
+		printf("Start failed\n");
+		unlink(name);
+		return 1;
+	}
+	/* the demux has it open */
+	unlink(name);
+
+	reader raw = { "raw client", client(0), false, 0, 0, 0, false };
+	reader http = { "HTTP client", client(0), true, 0, 0, 0, false };
+	/* a small receive window, so that it is dropped soon */
+	int stalled = client(4096);
+	if (raw.fd < 0 || http.fd < 0 || stalled < 0) {
+		perror("connect");
+		return 1;
+	}
+	const char get[] = "GET /stream HTTP/1.0\r\n\r\n";
+	if (send(http.fd, get, sizeof(get) - 1, 0) != sizeof(get) - 1)
+		perror("send");
+	pthread_create(&raw.thread, NULL, read_thread, &raw);
+	pthread_create(&http.thread, NULL, read_thread, &http);
+
+	int64_t end = now_ms() + 3000;
+	while (s->GetClients() < 3 && now_ms() < end)
+		usleep(10000);
+	int most = s->GetClients();
+	while (s->GetClients() > 2 && now_ms() < end)
+		usleep(10000);
+	int left = s->GetClients();
+	uint64_t raw_before = raw.packets;
+	uint64_t http_before = http.packets;
+	/* the others must go on */
+	usleep(500000);
+	s->Stop();
+	pthread_join(raw.thread, NULL);
+	pthread_join(http.thread, NULL);
+	delete s;
+
+	ret += check(raw, raw_before);
+	ret += check(http, http_before);
+	bool dropped = most == 3 && left == 2;
+	printf("stalled client: %s, %d clients, then %d\n", dropped ? "ok, dropped" : "FAIL, not dropped",
+		most, left);
+	ret += !dropped;
+	close(raw.fd);
+	close(http.fd);
+	close(stalled);
+	return ret ? 1 : 0;
+}
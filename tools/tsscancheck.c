@@ -0,0 +1,174 @@
+/*
+ * tsscancheck - check the TS sync / start code scanners of libstb-hal
+ *
+ * usage: tsscancheck [rounds]
+ *
+ * compares ts_find_sync(), ts_find_sync_any() and ts_find_startcode() of
+ * every implementation usable on this CPU against simple byte wise ones,
+ * on random data, on packet streams with 188, 192 and 204 byte packets,
+ * with all lengths up to a few packets and at misaligned addresses.
+ *
+ * License: GPLv2 or later
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ts_scan.h"
+
+#define BUFLEN (4 * 204 + 64)
+#define MAXOFF 32
+
+static const int strides[] = { 188, 192, 204 };
+#define NSTRIDES (int)(sizeof(strides) / sizeof(strides[0]))
+
+/* right in front of an inaccessible page: reading past the end of a
+ * truncated buffer crashes */
+static uint8_t *guard_end;
+
+static int ref_sync(const uint8_t *p, int len, int stride)
+{
+	int i;
+	for (i = 0; i + stride < len; i++)
+		if (p[i] == 0x47 && p[i + stride] == 0x47)
+			return i;
+	return -1;
+}
+
+/* the earliest offset with a sync byte 1 and 2 packets later (or past
+ * the end of the buffer), of all packet sizes */
+static int ref_sync_any(const uint8_t *p, int len, int *stride)
+{
+	int i, j;
+	for (i = 0; i < len; i++)
+		for (j = 0; j < NSTRIDES; j++) {
+			int s = strides[j];
+			if (i + s < len && p[i] == 0x47 && p[i + s] == 0x47 &&
+			    (i + 2 * s >= len || p[i + 2 * s] == 0x47)) {
+				*stride = s;
+				return i;
+			}
+		}
+	return -1;
+}
+
+static int ref_startcode(const uint8_t *p, int len)
+{
+	int i;
+	for (i = 0; i + 2 < len; i++)
+		if (p[i] == 0 && p[i + 1] == 0 && p[i + 2] == 1)
+			return i;
+	return -1;
+}
+
+/* all lengths at all offsets of buf, returns the number of errors */
+static int check(const struct ts_scan_impl *impl, const uint8_t *buf, const char *what)
+{
+	int len, off, j, errors = 0;
+	for (off = 0; off <= MAXOFF; off++) {
+		for (len = 0; len <= BUFLEN - MAXOFF; len++) {
+			/* misaligned in buf, or a truncated copy in front of the guard */
+			const uint8_t *p = buf + off;
+			int a, b, sa = 0, sb = 0;
+			if (off == MAXOFF) {
+				p = guard_end - len;
+				memcpy((uint8_t *)p, buf, len);
+			}
+			for (j = 0; j < NSTRIDES; j++) {
+				a = ref_sync(p, len, strides[j]);
+				b = impl->find_sync(p, len, strides[j]);
+				if (a != b && errors++ < 10)
+					printf("%s: %s: find_sync stride %d len %d offset %d: %d != %d\n",
+						impl->name, what, strides[j], len, off, b, a);
+			}
+			a = ref_sync_any(p, len, &sa);
+			b = impl->find_sync_any(p, len, &sb);
+			if ((a != b || (a >= 0 && sa != sb)) && errors++ < 10)
+				printf("%s: %s: find_sync_any len %d offset %d: %d/%d != %d/%d\n",
+					impl->name, what, len, off, b, sb, a, sa);
+			a = ref_startcode(p, len);
+			b = impl->find_startcode(p, len);
+			if (a != b && errors++ < 10)
+				printf("%s: %s: find_startcode len %d offset %d: %d != %d\n",
+					impl->name, what, len, off, b, a);
+		}
+	}
+	return errors;
+}
+
+/* random bytes, biased towards 0x00, 0x01 and 0x47 */
+static void fill_random(uint8_t *buf)
+{
+	static const uint8_t pick[] = { 0x00, 0x00, 0x01, 0x47 };
+	int i;
+	for (i = 0; i < BUFLEN; i++)
+		buf[i] = (rand() & 1) ? pick[rand() & 3] : rand();
+}
+
+/* packets of the given size behind some garbage, with start codes in
+ * the payload, possibly one sync byte broken */
+static void fill_packets(uint8_t *buf, int stride)
+{
+	int i, start = rand() % (stride + 1);
+	fill_random(buf);
+	for (i = 0; i < BUFLEN; i++)
+		if (buf[i] == 0x47)
+			buf[i] = 0;
+	for (i = start; i < BUFLEN; i += stride)
+		buf[i] = 0x47;
+	if (rand() & 1) {
+		i = start + stride * (rand() % 4);
+		if (i < BUFLEN)
+			buf[i] = 0x48;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const struct ts_scan_impl *impl;
+	int n = ts_scan_impls(&impl);
+	int rounds = 20;
+	int i, j, r, errors;
+	uint8_t *buf;
+	long page;
+	int ret = 0;
+
+	if (argc > 1)
+		rounds = atoi(argv[1]);
+	if (rounds <= 0)
+		rounds = 20;
+	buf = malloc(BUFLEN);
+	if (!buf) {
+		perror("malloc");
+		return 1;
+	}
+	page = sysconf(_SC_PAGESIZE);
+	guard_end = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (guard_end == MAP_FAILED || mprotect(guard_end + page, page, PROT_NONE)) {
+		perror("mmap");
+		return 1;
+	}
+	guard_end += page;
+	printf("default: %s\n", ts_scan_name());
+	for (j = 0; j < n; j++) {
+		errors = 0;
+		srand(1);
+		for (r = 0; r < rounds; r++) {
+			fill_random(buf);
+			errors += check(&impl[j], buf, "random");
+			for (i = 0; i < NSTRIDES; i++) {
+				char what[16];
+				sprintf(what, "packets %d", strides[i]);
+				fill_packets(buf, strides[i]);
+				errors += check(&impl[j], buf, what);
+			}
+		}
+		printf("%-8s %s\n", impl[j].name, errors ? "FAILED" : "ok");
+		if (errors)
+			ret = 1;
+	}
+	free(buf);
+	return ret;
+}